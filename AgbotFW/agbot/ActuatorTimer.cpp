@@ -0,0 +1,86 @@
+/*
+ * ActuatorTimer.cpp
+ * Implements the ActuatorTimer class defined in ActuatorTimer.h for firing scheduled commands from a timer interrupt.
+ * See ActuatorTimer.h for more info.
+ * Created: 10/16/2026 1:31:20 PM
+ *  Author: troy.honegger
+ */
+
+#include "ActuatorTimer.h"
+
+#ifdef ACTUATOR_ISR
+
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "Sprayer.h"
+
+// Timer4 ticks every 4us (16MHz / 64)
+#define MICROS_PER_TICK		4
+// Furthest we arm the timer in one hop. Kept well short of the 16-bit range, so the compare value can't wrap past TCNT4.
+#define MAX_TICKS			0xF000UL
+// If a deadline is closer than this (in us), it's fired right away, since TCNT4 could pass the compare value before it's set
+#define MIN_LEAD_TIME		20
+
+ActuatorTimer actuatorTimer;
+
+void ActuatorTimer::begin(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		TCCR4A = 0; // normal mode, OC4x pins disconnected (the Arduino core sets this up for PWM by default)
+		TCCR4B = _BV(CS41) | _BV(CS40); // clk/64
+		TIMSK4 = 0;
+		TIFR4 = _BV(OCF4A);
+		arm();
+	}
+}
+
+void ActuatorTimer::rearm(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		arm();
+	}
+}
+
+void ActuatorTimer::arm(void) {
+	while (!commandQueue.isEmpty()) {
+		uint32_t deadline = commandQueue.getNextTime();
+		int32_t delta = static_cast<int32_t>(deadline - micros());
+		uint32_t ticks;
+		if (delta > static_cast<int32_t>(MAX_TICKS * MICROS_PER_TICK)) {
+			// out of range - arm as far out as we can, and try again from there
+			isHop = true;
+			ticks = MAX_TICKS;
+		}
+		else {
+			if (delta < MIN_LEAD_TIME) {
+				lastError = -delta;
+				commandQueue.dispatch(deadline);
+				sprayerBank.flush();
+				continue;
+			}
+			isHop = false;
+			ticks = (static_cast<uint32_t>(delta) + MICROS_PER_TICK - 1) / MICROS_PER_TICK; // round up, so we never fire early
+			armedMicros = deadline;
+		}
+		OCR4A = TCNT4 + static_cast<uint16_t>(ticks);
+		TIFR4 = _BV(OCF4A); // clear any stale compare match
+		TIMSK4 |= _BV(OCIE4A);
+		return;
+	}
+	// nothing scheduled
+	TIMSK4 &= ~_BV(OCIE4A);
+}
+
+void ActuatorTimer::fire(void) {
+	if (!isHop) {
+		lastError = static_cast<int32_t>(micros() - armedMicros);
+		commandQueue.dispatch(armedMicros);
+		sprayerBank.flush();
+	}
+	arm();
+}
+
+ISR(TIMER4_COMPA_vect) {
+	actuatorTimer.fire();
+}
+
+#endif // ACTUATOR_ISR
@@ -0,0 +1,65 @@
+/*
+ * ActuatorTimer.h
+ * Fires scheduled tiller and sprayer commands from a hardware timer interrupt, so their timing doesn't depend on how
+ * often the main loop gets around to calling update().
+ *
+ * This is opt-in: it is only compiled when ACTUATOR_ISR is defined (see Common.h). When it is, the main loop no longer
+ * dispatches the shared CommandQueue. Instead, whenever a command is scheduled, rearm() arms a compare interrupt on
+ * Timer/Counter4 for the command at the front of the queue. The interrupt dispatches the queue, which flips the pins,
+ * and then re-arms itself for the next command. Timer4 runs at 4us per tick, so commands fire within a few microseconds
+ * of their scheduled time, regardless of any blocking I2C, SPI, or HTTP work in the main loop.
+ *
+ * Commands are scheduled on the micros() clock, so each deadline is armed as-is. Deadlines more than about 250ms out (the
+ * Timer4 range) are reached in several hops.
+ *
+ * Timer4 drives the PWM on pins 6-8, so analogWrite() must not be used on those pins while this is enabled.
+ *
+ * Usage example:
+ *	#define ACTUATOR_ISR // in Common.h
+ *	actuatorTimer.begin(); // in setup(), after the tillers and sprayers
+ *	sprayers[0].setStatus(Sprayer::ON, 500); // calls actuatorTimer.rearm()
+ *
+ * Created: 10/16/2026 1:05:44 PM
+ *  Author: troy.honegger
+ */
+
+#pragma once
+
+#include "Common.h"
+
+#ifdef ACTUATOR_ISR
+
+class ActuatorTimer {
+	private:
+		uint32_t armedMicros; // micros() time the interrupt is armed for
+		volatile int32_t lastError;
+		bool isHop; // true if the interrupt is armed short of the deadline, because the deadline is out of Timer4's range
+
+		// Arms the interrupt for the next-due command, first dispatching any commands that are already due.
+		// Must be called with interrupts disabled.
+		void arm(void);
+
+		// disallow copy constructor
+		void operator=(ActuatorTimer const&) {}
+		ActuatorTimer(ActuatorTimer const&) {}
+	public:
+		ActuatorTimer() : armedMicros(0), lastError(0), isHop(false) {}
+
+		// Configures Timer/Counter4. Call from setup(), after the tillers and sprayers have begun.
+		void begin(void);
+
+		// Re-arms the interrupt for the next-due command in the CommandQueue. Tiller::setHeight() and Sprayer::setStatus()
+		// call this automatically after scheduling a command.
+		void rearm(void);
+
+		// Called by the interrupt. Do not call this directly.
+		void fire(void);
+
+		// Returns the error, in microseconds, between when the most recent command was scheduled to fire and when the
+		// interrupt actually fired it. Positive values mean the command was late.
+		int32_t getLastError(void) const { return lastError; }
+};
+
+extern ActuatorTimer actuatorTimer;
+
+#endif // ACTUATOR_ISR
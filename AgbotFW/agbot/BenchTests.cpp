@@ -14,8 +14,24 @@
  *  Author: troy.honegger
  */ 
 
+#include "ActuatorTimer.h"
 #include "Common.h"
+#include "Devices.h"
+#include "FastGpio.h"
+#include "HttpApi.h"
+#include "HttpApi_Parsing.h"
+#include "KillWindows.h"
 #include "Log.h"
+#include "Scheduler.h"
+#include "WebSocket.h"
+#include "WeedUdp.h"
+
+#ifdef BENCH_TESTS
+// JsonParser replaced the jsmn tokenizer; it's kept only so jsonParserTests() can compare the two on the board
+#define JSMN_STATIC
+#define JSMN_PARENT_LINKS
+#include "jsmn.h"
+#endif
 
 #ifdef BENCH_TESTS
 
@@ -24,6 +40,18 @@
 #endif
 
 void timerTests(void);
+void gpioTests(void);
+void commandQueueTests(void);
+void killWindowsTests(void);
+void schedulerTests(void);
+void jsonParserTests(void);
+void weedBatchTests(void);
+void weedUdpTests(void);
+void webSocketTests(void);
+void webSocketPollerTests(void);
+#ifdef ACTUATOR_ISR
+void actuatorTimerTests(void);
+#endif
 
 void setup() {
 #if LOG_LEVEL != LOG_LEVEL_OFF
@@ -34,6 +62,18 @@ void setup() {
 	LOG_INFO("Beginning bench tests");
 	
 	timerTests();
+	gpioTests();
+	commandQueueTests();
+	killWindowsTests();
+	schedulerTests();
+	jsonParserTests();
+	weedBatchTests();
+	weedUdpTests();
+	webSocketTests();
+	webSocketPollerTests();
+#ifdef ACTUATOR_ISR
+	actuatorTimerTests();
+#endif
 	
 	LOG_INFO("All tests passed");
 }
@@ -50,6 +90,27 @@ void timerTests(void) {
 	assert(!isElapsed(millis() + 0x3fffffff));
 	assert(isElapsed(millis() - 0x3fffffff));
 
+	// micros() wraps every 71 minutes, so deadlines near the wrap are routine. Ordering holds for any two times less
+	// than 2^31us (35 minutes) apart, in either direction around the wrap.
+	assert(timeCmp(0x00000000, 0xFFFFFFFF) == 1);
+	assert(timeCmp(0xFFFFFFFF, 0x00000000) == -1);
+	assert(timeCmp(0xFFFFFC18 + 1000, 0xFFFFFC18) == 1); // 1ms later, past the wrap
+	assert(timeCmp(0xFFFFFFF0 + 0x7FFFFFFE, 0xFFFFFFF0) == 1); // the furthest apart two times can be told apart
+	assert(timeCmp(0xFFFFFFF0, 0xFFFFFFF0 + 0x7FFFFFFE) == -1);
+	assert(timeCmp(0xFFFFFFF0 + CommandQueue::MAX_DELAY * 1000, 0xFFFFFFF0) == 1);
+	assert(timeCmp(0xFFFFFFF0, 0xFFFFFFF0 + CommandQueue::MAX_DELAY * 1000) == -1);
+	assert(isElapsed(0x00000005, 0x00000005) && isElapsed(0x00000005, 0x00000006) && !isElapsed(0x00000005, 0xFFFFFFFF));
+
+	MicroTimer mt;
+	mt.start(500, 0xFFFFFF00); // due at 0x000000F4
+	assert(!mt.isUp(0xFFFFFFFF));
+	assert(!mt.hasElapsed(0x000000F3));
+	assert(mt.isUp(0x000000F4) && mt.hasElapsed(0x000000F4));
+	mt.restart(750); // from micros()
+	assert(mt.isSet && !mt.isUp());
+	delayMicroseconds(1000);
+	assert(mt.isUp() && !mt.isSet);
+
 	Timer t;
 	t.start(100);
 	assert(t.isSet);
@@ -89,6 +150,634 @@ void timerTests(void) {
 	assert(!t.isSet);
 }
 
+// checks StaticPin<PIN> against the Arduino core's pin tables, for every pin from 0 to PIN
+template <uint8_t PIN>
+struct CheckStaticPins {
+	static void run(void) {
+		assert(StaticPin<PIN>::PORT == reinterpret_cast<uint16_t>(portOutputRegister(digitalPinToPort(PIN))));
+		assert(StaticPin<PIN>::MASK == digitalPinToBitMask(PIN));
+		CheckStaticPins<PIN - 1>::run();
+	}
+};
+template <>
+struct CheckStaticPins<0> {
+	static void run(void) {
+		assert(StaticPin<0>::PORT == reinterpret_cast<uint16_t>(portOutputRegister(digitalPinToPort(0))));
+		assert(StaticPin<0>::MASK == digitalPinToBitMask(0));
+	}
+};
+
+void gpioTests(void) {
+	LOG_INFO("GPIO tests");
+	CheckStaticPins<69>::run();
+
+	// pin 38 (sprayer 0) is on a low I/O port, and pin 42 (sprayer 4) is on a memory-mapped one
+	CachedPin pin;
+	pin.begin(42);
+	pin.output();
+	pin.high();
+	assert(digitalRead(42) == HIGH);
+	pin.write(LOW);
+	assert(digitalRead(42) == LOW);
+	StaticPin<38>::output();
+	StaticPin<38>::high();
+	assert(digitalRead(38) == HIGH);
+	StaticPin<38>::write(LOW);
+	assert(digitalRead(38) == LOW);
+
+	// not a pass/fail test, but report the speedup
+	uint32_t start = micros();
+	for (uint8_t i = 0; i < 100; i++) { digitalWrite(38, HIGH); digitalWrite(38, LOW); }
+	uint32_t digitalWriteTime = micros() - start;
+	start = micros();
+	for (uint8_t i = 0; i < 100; i++) { pin.high(); pin.low(); }
+	uint32_t cachedPinTime = micros() - start;
+	start = micros();
+	for (uint8_t i = 0; i < 100; i++) { StaticPin<38>::high(); StaticPin<38>::low(); }
+	uint32_t staticPinTime = micros() - start;
+	LOG_INFO("200 writes: digitalWrite %luus, CachedPin %luus, StaticPin %luus", digitalWriteTime, cachedPinTime, staticPinTime);
+	pin.input();
+	StaticPin<38>::input();
+
+	// the sprayer bank switches pins on PORTD, PORTG, and PORTL in one flush
+	for (uint8_t i = 0; i < Sprayer::COUNT; i++) {
+		sprayerBank.begin(i);
+		assert(digitalRead(SprayerBank::FIRST_PIN + i) == SprayerBank::OFF_VOLTAGE);
+	}
+	const uint8_t masks[] = { 0x01, 0x0E, 0xF0, 0x5A, 0xA5, 0xFF, 0x00 };
+	for (uint8_t m = 0; m < sizeof(masks); m++) {
+		sprayerBank.setAll(masks[m]);
+		assert(sprayerBank.getOutputs() == (m ? masks[m - 1] : 0)); // nothing changes until the flush
+		sprayerBank.flush();
+		assert(sprayerBank.getOutputs() == masks[m]);
+		for (uint8_t i = 0; i < Sprayer::COUNT; i++) {
+			assert(digitalRead(SprayerBank::FIRST_PIN + i) == (masks[m] & (1 << i) ? SprayerBank::ON_VOLTAGE : SprayerBank::OFF_VOLTAGE));
+		}
+	}
+	// flush() only writes the valves that changed, so it must leave the other bits of the port alone
+	sprayerBank.set(3, true);
+	StaticPin<SprayerBank::FIRST_PIN + 3>::write(SprayerBank::ON_VOLTAGE); // pretend something else drove the pin
+	sprayerBank.set(3, false);
+	sprayerBank.set(4, true);
+	sprayerBank.flush();
+	assert(sprayerBank.getOutputs() == 0x10);
+	assert(digitalRead(SprayerBank::FIRST_PIN + 3) == SprayerBank::ON_VOLTAGE);
+	assert(digitalRead(SprayerBank::FIRST_PIN + 4) == SprayerBank::ON_VOLTAGE);
+	for (uint8_t i = 0; i < Sprayer::COUNT; i++) {
+		sprayerBank.end(i);
+	}
+}
+
+// records the commands it executes, in order
+class TraceActuator : public Actuator {
+	public:
+		char trace[CommandQueue::CAPACITY + 1];
+		uint8_t len;
+		TraceActuator() : len(0) { trace[0] = '\0'; }
+		void execute(uint8_t command, uint32_t) { trace[len++] = command; trace[len] = '\0'; }
+};
+
+void commandQueueTests(void) {
+	LOG_INFO("Command queue tests");
+	CommandQueue q;
+	TraceActuator a, b;
+	assert(q.isEmpty());
+	assert(q.dispatch(0) == 0);
+
+	// commands come out in time order, regardless of the order they went in
+	assert(q.push(&a, 'c', 300));
+	assert(q.push(&a, 'a', 100));
+	assert(q.push(&b, 'x', 150));
+	assert(q.push(&a, 'b', 200));
+	assert(q.getSize() == 4 && q.getNextTime() == 100);
+	assert(q.dispatch(99) == 0);
+	assert(q.dispatch(150) == 2);
+	assert(!strcmp(a.trace, "a") && !strcmp(b.trace, "x"));
+	assert(q.getNextTime() == 200);
+
+	// cancelling only affects the given actuator, at or after the given time
+	assert(q.push(&b, 'y', 250));
+	q.cancel(&a, 300);
+	assert(q.getSize() == 2);
+	q.cancel(&b, 251);
+	assert(q.getSize() == 2);
+	assert(q.dispatch(1000) == 2);
+	assert(!strcmp(a.trace, "ab") && !strcmp(b.trace, "xy"));
+	assert(q.isEmpty());
+
+	// ordering holds across the micros() overflow, even for commands less than a millisecond apart
+	assert(q.push(&a, 'e', 0x10));
+	assert(q.push(&a, 'd', 0xFFFFFFF0));
+	assert(q.push(&b, 'z', 0xFFFFFFF0 + 0x100));
+	assert(q.dispatch(0xFFFFFFF0) == 1);
+	assert(q.dispatch(0x10) == 1);
+	assert(!strcmp(a.trace, "abde"));
+	assert(q.dispatch(0xEF) == 0);
+	assert(q.dispatch(0xF0) == 1);
+	assert(!strcmp(b.trace, "xyz"));
+
+	// the queue depth is shared, so one actuator can use all of it
+	a.len = 0;
+	for (uint8_t i = 0; i < CommandQueue::CAPACITY; i++) {
+		assert(q.push(&a, 'A' + (CommandQueue::CAPACITY - 1 - i) % 26, CommandQueue::CAPACITY - i));
+	}
+	assert(!q.push(&b, 'z', 0));
+	q.cancel(&a, CommandQueue::CAPACITY - 1);
+	assert(q.getSize() == CommandQueue::CAPACITY - 2);
+	assert(q.dispatch(CommandQueue::CAPACITY) == CommandQueue::CAPACITY - 2);
+	for (uint8_t i = 0; i < CommandQueue::CAPACITY - 2; i++) {
+		assert(a.trace[i] == 'A' + i % 26); // i.e. in order of increasing time
+	}
+}
+
+// Follows w through every edge due by the given time, the way Tiller and Sprayer do from the command queue.
+static void advanceKillWindows(KillWindows& w, bool& isOn, uint32_t now) {
+	uint32_t edge;
+	while (w.getNextEdge(edge) && timeCmp(edge, now) <= 0) {
+		switch (w.advance(edge)) {
+			case KillWindows::START: isOn = true; break;
+			case KillWindows::END: isOn = false; break;
+			default: break;
+		}
+	}
+}
+
+void killWindowsTests(void) {
+	LOG_INFO("Kill window tests");
+	KillWindows w;
+	bool isOn = false;
+	uint32_t edge;
+	assert(!w.getNextEdge(edge));
+
+	// overlapping and touching windows merge; separate ones don't
+	w.add(100, 200);
+	w.add(150, 250);
+	w.add(250, 300);
+	w.add(400, 500);
+	assert(w.getCount() == 2);
+	assert(w.getNextEdge(edge) && edge == 100);
+	advanceKillWindows(w, isOn, 99);
+	assert(!isOn);
+	advanceKillWindows(w, isOn, 100);
+	assert(isOn);
+	assert(w.getNextEdge(edge) && edge == 300);
+	advanceKillWindows(w, isOn, 350);
+	assert(!isOn && w.getCount() == 1);
+
+	// a window that ends before the active one started is already over
+	advanceKillWindows(w, isOn, 400);
+	assert(isOn);
+	w.add(50, 60);
+	assert(w.getCount() == 1);
+
+	// truncating cuts the active window short, without an END, so the overriding command stays in control
+	w.add(600, 700);
+	w.truncate(450);
+	assert(w.getCount() == 1 && w.getNextEdge(edge) && edge == 450);
+	advanceKillWindows(w, isOn, 450);
+	assert(isOn && w.isEmpty());
+	isOn = false;
+
+	// once full, the closest windows are merged
+	for (uint8_t i = 0; i <= KillWindows::CAPACITY; i++) {
+		w.add(1000 + i * 100 - (i == 2 ? 50 : 0), 1010 + i * 100); // the gap before window 2 is the smallest
+	}
+	assert(w.getCount() == KillWindows::CAPACITY);
+	advanceKillWindows(w, isOn, 1105);
+	assert(isOn);
+	advanceKillWindows(w, isOn, 1200);
+	assert(isOn); // merged with window 2
+	advanceKillWindows(w, isOn, 1250);
+	assert(!isOn);
+	advanceKillWindows(w, isOn, 0x10000);
+	assert(!isOn && w.isEmpty());
+
+	// windows separated by less than minGap are bridged
+	uint8_t bridged;
+	assert(w.add(200000, 200100, 50, &bridged) == 0 && bridged == 0);
+	assert(w.add(200140, 200200, 50, &bridged) == 1 && bridged == 1);
+	assert(w.add(200290, 200400, 50, &bridged) == 0 && bridged == 0); // a gap of 90ms is fine
+	assert(w.add(200150, 200260, 50, &bridged) == 2 && bridged == 1); // overlaps the first window and bridges the second
+	assert(w.getCount() == 1);
+	advanceKillWindows(w, isOn, 200000);
+	assert(isOn);
+	advanceKillWindows(w, isOn, 200399);
+	assert(isOn);
+	advanceKillWindows(w, isOn, 200400);
+	assert(!isOn && w.isEmpty());
+
+	// Stress test: fire thousands of random weeds, and check every ms that each weed is being killed (no missed windows),
+	// and that everything turns back off at the end (no lockups). This starts shortly before the clock overflows.
+	static const uint16_t HORIZON = 1024; // ms - must exceed the furthest a window ends after it is added
+	uint8_t covered[HORIZON / 8]; // ring buffer, marking the ms that fall within any weed's window
+	memset(covered, 0, sizeof(covered));
+	randomSeed(42);
+	uint32_t start = 0xFFFFFFFF - 10000;
+	uint32_t t;
+	for (t = start; t != start + 30000; t++) {
+		advanceKillWindows(w, isOn, t);
+		uint16_t bit = t % HORIZON;
+		assert(isOn || !(covered[bit / 8] & (1 << (bit % 8))));
+		covered[bit / 8] &= ~(1 << (bit % 8));
+		if (t - start < 25000 && !random(4)) {
+			uint32_t on = t + 300 + random(400);
+			uint32_t off = on + 1 + random(200);
+			w.add(on, off);
+			for (uint32_t i = on; i != off; i++) {
+				bit = i % HORIZON;
+				covered[bit / 8] |= 1 << (bit % 8);
+			}
+		}
+	}
+	assert(!isOn && w.isEmpty());
+}
+
+static char schedulerTrace[8];
+static uint32_t schedulerTraceTimes[8]; // the time (in ms) each traced task was given
+static uint8_t schedulerTraceLen;
+static void traceTask(char name, Timestamp const& now) {
+	schedulerTraceTimes[schedulerTraceLen] = now.ms;
+	schedulerTrace[schedulerTraceLen++] = name;
+}
+static void actuatorTask(Timestamp const& now) { traceTask('A', now); }
+static void actuatorTask2(Timestamp const& now) { traceTask('B', now); }
+static void housekeepingTask(Timestamp const& now) { traceTask('H', now); }
+
+static Timestamp fakeTime;
+static Timestamp fakeClock(void) { return fakeTime; }
+static void advanceFakeClock(uint32_t us) {
+	fakeTime.us += us;
+	fakeTime.ms += us / 1000;
+}
+static void slowHousekeepingTask(Timestamp const& now) { traceTask('H', now); advanceFakeClock(5000); }
+
+void schedulerTests(void) {
+	LOG_INFO("Scheduler tests");
+	Scheduler s;
+	// added in the wrong order, but the actuator should still run first
+	assert(s.add(housekeepingTask, PSTR("h"), Scheduler::PRIORITY_HOUSEKEEPING, 0, 100));
+	assert(s.add(actuatorTask, PSTR("a"), Scheduler::PRIORITY_ACTUATOR, 10000, 10));
+	schedulerTraceLen = 0;
+	s.run();
+	assert(schedulerTraceLen == 2);
+	assert(schedulerTrace[0] == 'A' && schedulerTrace[1] == 'H');
+
+	// the actuator isn't due for another 10ms, so only housekeeping runs, and its 100us budget fits in the slack
+	schedulerTraceLen = 0;
+	s.run();
+	assert(schedulerTraceLen == 1);
+	assert(schedulerTrace[0] == 'H');
+
+	// a housekeeping task that won't finish before the actuator's next deadline is deferred...
+	Scheduler s2;
+	assert(s2.add(actuatorTask, PSTR("a"), Scheduler::PRIORITY_ACTUATOR, 10000, 10));
+	assert(s2.add(housekeepingTask, PSTR("h"), Scheduler::PRIORITY_HOUSEKEEPING, 0, 15000));
+	schedulerTraceLen = 0;
+	s2.run();
+	assert(schedulerTraceLen == 1);
+	assert(schedulerTrace[0] == 'A');
+
+	// ...until it has been waiting for MAX_DEFERRAL
+	delay(Scheduler::MAX_DEFERRAL / 1000 + 1);
+	schedulerTraceLen = 0;
+	s2.run();
+	assert(schedulerTraceLen == 2);
+	assert(schedulerTrace[0] == 'A' && schedulerTrace[1] == 'H');
+
+	// with a fake clock: every task in a pass is given the same time...
+	fakeTime.ms = 1000;
+	fakeTime.us = 1000000;
+	Scheduler s3(fakeClock);
+	assert(s3.add(actuatorTask, PSTR("a"), Scheduler::PRIORITY_ACTUATOR, 1000, 10));
+	assert(s3.add(slowHousekeepingTask, PSTR("h"), Scheduler::PRIORITY_HOUSEKEEPING, 0, 0));
+	advanceFakeClock(3000);
+	assert(s3.add(actuatorTask2, PSTR("b"), Scheduler::PRIORITY_ACTUATOR, 1000, 10)); // not due until 1003ms
+	fakeTime.ms = 1000;
+	fakeTime.us = 1000000;
+	schedulerTraceLen = 0;
+	s3.run();
+	// ...except tasks that come due after a less urgent one ran, which are given the time it finished
+	assert(schedulerTraceLen == 3);
+	assert(schedulerTrace[0] == 'A' && schedulerTrace[1] == 'H' && schedulerTrace[2] == 'B');
+	assert(schedulerTraceTimes[0] == 1000 && schedulerTraceTimes[1] == 1000 && schedulerTraceTimes[2] == 1005);
+	// by 1006ms, both actuators are due again
+	advanceFakeClock(1000);
+	schedulerTraceLen = 0;
+	s3.run();
+	assert(schedulerTraceLen == 3);
+	assert(schedulerTrace[0] == 'A' && schedulerTrace[1] == 'B' && schedulerTrace[2] == 'H');
+	assert(schedulerTraceTimes[0] == 1006 && schedulerTraceTimes[1] == 1006 && schedulerTraceTimes[2] == 1006);
+	// the first pass started at 1000ms, and the second at 1006ms
+	assert(s3.takeMaxCycleTime() == 6000);
+	assert(s3.takeMaxCycleTime() == 0);
+
+	Timer timer;
+	timer.start(10, 0xFFFFFFFA); // the deadline wraps past zero
+	assert(!timer.isUp(0xFFFFFFFF));
+	assert(timer.isUp(4) && timer.hasElapsed());
+	timer.restart(10, 100);
+	assert(!timer.isUp(109) && timer.isUp(110));
+	assert(!isElapsed(110, 109) && isElapsed(110, 110));
+
+	DurationHistogram h;
+	h.record(0);
+	h.record(1);
+	h.record(1000); // 10 bits
+	h.record(1023);
+	h.record(0xFFFFFFFF); // should saturate to the last bucket
+	assert(h.counts[0] == 1 && h.counts[1] == 1 && h.counts[10] == 2);
+	assert(h.counts[DurationHistogram::NUM_BUCKETS - 1] == 1);
+	h.reset();
+	assert(h.counts[0] == 0 && h.counts[10] == 0);
+
+	// The metrics are written in pieces, which join up into one JSON object. The loop took 6000us (13 bits), the actuators
+	// took no time at all, and h took 5000us (13 bits) each time.
+	char str[80];
+	char piece[16];
+	uint16_t state = 0;
+	str[0] = '\0';
+	while (size_t len = s3.writeMetrics(piece, sizeof(piece), state)) {
+		assert(len < sizeof(piece) && strlen(str) + len < sizeof(str));
+		strncat(str, piece, len); // the rest of the piece may hold the start of a token that didn't fit
+	}
+	assert(!strcmp_P(str, PSTR("{\"loop\":{\"13\":1},\"a\":{\"0\":2},\"b\":{\"0\":2},\"h\":{\"13\":2}}")));
+	// everything written was cleared
+	state = 0;
+	str[0] = '\0';
+	while (size_t len = s3.writeMetrics(piece, sizeof(piece), state)) {
+		strncat(str, piece, len);
+	}
+	assert(!strcmp_P(str, PSTR("{\"loop\":{},\"a\":{},\"b\":{},\"h\":{}}")));
+}
+
+// Copies str (a PROGMEM string) into buf, and parses it as a PUT to a tiller
+static ParseStatus parseTiller(char* buf, const char* str, PutTiller& result) {
+	strcpy_P(buf, str);
+	return parsePutTillerCmd(buf, strlen(buf), result);
+}
+
+// The tiller command parser as it was written against jsmn (12 tokens), for jsonParserTests() to compare JsonParser with
+#define JSMN_TOKEN_CNT (12)
+static jsmn_parser jsmnParser;
+static jsmntok_t jsmnTokens[JSMN_TOKEN_CNT];
+#define TOKEN_IS(json, tok, s) ((tok).type == JSMN_STRING && (tok).end - (tok).start == sizeof(s) - 1 && \
+		!strncmp_P((json) + (tok).start, PSTR(s), sizeof(s) - 1))
+static ParseStatus jsmnParseTiller(char* json, size_t n, PutTiller& result) {
+	jsmn_init(&jsmnParser);
+	int nTok = jsmn_parse(&jsmnParser, json, n, jsmnTokens, JSMN_TOKEN_CNT);
+	if (nTok < 0) {
+		return nTok == JSMN_ERROR_NOMEM ? ParseStatus::BUFFER_OVERFLOW : ParseStatus::SYNTAX_ERROR;
+	}
+	else if (jsmnTokens[0].type != JSMN_OBJECT) {
+		return ParseStatus::SEMANTIC_ERROR;
+	}
+	bool hasTargetHeight = false, hasDelay = false;
+	result.delay = 0;
+	for (int i = 1; i < nTok - 1; i++) {
+		jsmntok_t* tok = jsmnTokens + i;
+		if (tok->parent > 0) {
+			continue;
+		}
+		if (TOKEN_IS(json, *tok, "targetHeight")) {
+			if (hasTargetHeight) {
+				return ParseStatus::SEMANTIC_ERROR;
+			}
+			tok++;
+			i++;
+			hasTargetHeight = true;
+			if (tok->type == JSMN_PRIMITIVE && json[tok->start] >= '0' && json[tok->start] <= '9') {
+				int cmd = atoi(json + tok->start);
+				if (cmd > Tiller::MAX_HEIGHT) {
+					return ParseStatus::SEMANTIC_ERROR;
+				}
+				result.targetHeight = cmd;
+			}
+			else if (TOKEN_IS(json, *tok, "STOP")) { result.targetHeight = TillerCommand::STOP; }
+			else if (TOKEN_IS(json, *tok, "UP")) { result.targetHeight = TillerCommand::UP; }
+			else if (TOKEN_IS(json, *tok, "DOWN")) { result.targetHeight = TillerCommand::DOWN; }
+			else if (TOKEN_IS(json, *tok, "LOWERED")) { result.targetHeight = TillerCommand::LOWERED; }
+			else if (TOKEN_IS(json, *tok, "RAISED")) { result.targetHeight = TillerCommand::RAISED; }
+			else {
+				return ParseStatus::SEMANTIC_ERROR;
+			}
+		}
+		else if (TOKEN_IS(json, *tok, "delay")) {
+			if (hasDelay) {
+				return ParseStatus::SEMANTIC_ERROR;
+			}
+			tok++;
+			i++;
+			hasDelay = true;
+			if (tok->type != JSMN_PRIMITIVE || json[tok->start] < '0' || json[tok->start] > '9') {
+				return ParseStatus::SEMANTIC_ERROR;
+			}
+			result.delay = atol(json + tok->start);
+			if (result.delay > CommandQueue::MAX_DELAY) {
+				return ParseStatus::SEMANTIC_ERROR;
+			}
+		}
+	}
+	return hasTargetHeight ? ParseStatus::SUCCESS : ParseStatus::SEMANTIC_ERROR;
+}
+
+void jsonParserTests(void) {
+	LOG_INFO("JSON parser tests");
+	char buf[96];
+	PutTiller tiller;
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": 40}"), tiller) == ParseStatus::SUCCESS);
+	assert(tiller.targetHeight == 40 && tiller.delay == 0);
+	assert(parseTiller(buf, PSTR(" {\"delay\":1500,\"targetHeight\":\"RAISED\"} "), tiller) == ParseStatus::SUCCESS);
+	assert(tiller.targetHeight == TillerCommand::RAISED && tiller.delay == 1500);
+	// fields that aren't in the schema are skipped, however many tokens they take
+	assert(parseTiller(buf, PSTR("{\"a\":[1,{\"b\":\"}\"}],\"c\":null,\"d\":-2.5e3,\"targetHeight\":\"STOP\"}"), tiller)
+			== ParseStatus::SUCCESS);
+	assert(tiller.targetHeight == TillerCommand::STOP);
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": 101}"), tiller) == ParseStatus::SEMANTIC_ERROR);
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": 5.5}"), tiller) == ParseStatus::SEMANTIC_ERROR);
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": \"stop\"}"), tiller) == ParseStatus::SEMANTIC_ERROR);
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": 5, \"targetHeight\": 6}"), tiller) == ParseStatus::SEMANTIC_ERROR);
+	assert(parseTiller(buf, PSTR("{\"delay\": 5}"), tiller) == ParseStatus::SEMANTIC_ERROR);
+	assert(parseTiller(buf, PSTR("[40]"), tiller) == ParseStatus::SEMANTIC_ERROR);
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": 5,}"), tiller) == ParseStatus::SYNTAX_ERROR);
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": STOP}"), tiller) == ParseStatus::SYNTAX_ERROR);
+	// leading zeros aren't valid JSON, even in a field that's skipped; -0 is, and reads as 0
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": 0}"), tiller) == ParseStatus::SUCCESS && tiller.targetHeight == 0);
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": 007}"), tiller) == ParseStatus::SYNTAX_ERROR);
+	assert(parseTiller(buf, PSTR("{\"a\": 007, \"targetHeight\": 5}"), tiller) == ParseStatus::SYNTAX_ERROR);
+	tiller.targetHeight = 5;
+	assert(parseTiller(buf, PSTR("{\"targetHeight\": -0}"), tiller) == ParseStatus::SUCCESS && tiller.targetHeight == 0);
+	assert(parseTiller(buf, PSTR("{\"a\": -0, \"targetHeight\": 5}"), tiller) == ParseStatus::SUCCESS);
+	assert(parseTiller(buf, PSTR("{\"a\": 0.5, \"targetHeight\": 5}"), tiller) == ParseStatus::SUCCESS);
+	assert(parseTiller(buf, PSTR("{\"a\":[[[[[[[[[0]]]]]]]]],\"targetHeight\":5}"), tiller) == ParseStatus::BUFFER_OVERFLOW);
+
+	PutSprayer sprayer;
+	strcpy_P(buf, PSTR("{\"status\": \"ON\", \"delay\": 20}"));
+	assert(parsePutSprayerCmd(buf, strlen(buf), sprayer) == ParseStatus::SUCCESS && sprayer.status && sprayer.delay == 20);
+	PutHitch hitch;
+	strcpy_P(buf, PSTR("{\"targetHeight\": \"DOWN\"}"));
+	assert(parsePutHitchCmd(buf, strlen(buf), hitch) == ParseStatus::SUCCESS && hitch.targetHeight == HITCH_CMD__DOWN);
+
+	// not a pass/fail test, but compare how long typical commands take to parse with JsonParser and with jsmn. Both parse
+	// the same buffer, which is copied once up front, so only the parsing is timed.
+	static const char* const benchCommands[] = {
+		PSTR("{\"targetHeight\": \"RAISED\", \"delay\": 1500}"),
+		PSTR("{\"delay\": 250, \"targetHeight\": 40}")
+	};
+	for (uint8_t c = 0; c < 2; c++) {
+		strcpy_P(buf, benchCommands[c]);
+		size_t n = strlen(buf);
+		PutTiller jsmnTiller;
+		assert(parsePutTillerCmd(buf, n, tiller) == ParseStatus::SUCCESS);
+		assert(jsmnParseTiller(buf, n, jsmnTiller) == ParseStatus::SUCCESS);
+		assert(tiller.targetHeight == jsmnTiller.targetHeight && tiller.delay == jsmnTiller.delay);
+		uint32_t start = micros();
+		for (uint8_t i = 0; i < 100; i++) {
+			parsePutTillerCmd(buf, n, tiller);
+		}
+		uint32_t schemaTime = micros() - start;
+		start = micros();
+		for (uint8_t i = 0; i < 100; i++) {
+			jsmnParseTiller(buf, n, jsmnTiller);
+		}
+		LOG_INFO("100 tiller commands %S parsed in %luus (jsmn: %luus)", benchCommands[c], schemaTime, micros() - start);
+	}
+	// JsonParser has no static RAM; this is what jsmn set aside
+	LOG_INFO("jsmn's parser and %d tokens took %u bytes of RAM", JSMN_TOKEN_CNT,
+			static_cast<unsigned>(sizeof(jsmnParser) + sizeof(jsmnTokens)));
+}
+
+void weedBatchTests(void) {
+	LOG_INFO("Weed batch tests");
+	char buf[128];
+	WeedBatch batch;
+	strcpy_P(buf, PSTR("[{\"tillers\": 5, \"sprayers\": 33, \"offset\": -20}, {\"sprayers\": 2, \"time\": 1500}]"));
+	assert(parseWeedBatch(buf, strlen(buf), 1000, batch) == ParseStatus::SUCCESS && batch.count == 2);
+	assert(batch.events[0].tillers == 5 && batch.events[0].sprayers == 33 && batch.events[0].offset == -20);
+	assert(batch.events[1].tillers == 0 && batch.events[1].sprayers == 2 && batch.events[1].offset == 500);
+	strcpy_P(buf, PSTR("[{\"offset\": 1, \"time\": 1}]"));
+	assert(parseWeedBatch(buf, strlen(buf), 1000, batch) == ParseStatus::SEMANTIC_ERROR);
+	strcpy_P(buf, PSTR("[{\"tillers\": 8}]"));
+	assert(parseWeedBatch(buf, strlen(buf), 1000, batch) == ParseStatus::SEMANTIC_ERROR);
+
+	// WEED_BATCH_MAX_EVENTS events fit in a batch, but no more
+	strcpy_P(buf, PSTR("[{}"));
+	for (uint8_t i = 1; i < WEED_BATCH_MAX_EVENTS; i++) {
+		strcat_P(buf, PSTR(",{}"));
+	}
+	strcat_P(buf, PSTR("]"));
+	assert(parseWeedBatch(buf, strlen(buf), 1000, batch) == ParseStatus::SUCCESS && batch.count == WEED_BATCH_MAX_EVENTS);
+	strcpy_P(buf + strlen(buf) - 1, PSTR(",{}]"));
+	assert(parseWeedBatch(buf, strlen(buf), 1000, batch) == ParseStatus::BUFFER_OVERFLOW);
+
+	// binary: the version, the event count, then each event's tillers, sprayers, and time (little-endian)
+	uint8_t binary[] = {
+		WEED_BATCH_VERSION, 2,
+		0x02, 0x81, 0xEC, 0xFF, 0xFF, 0xFF, // 20ms before the batch arrived
+		0x01 | WEED_EVENT_ABSOLUTE, 0x00, 0x94, 0x88, 0x01, 0x00 // at millis() time 100500
+	};
+	char* body = reinterpret_cast<char*>(binary);
+	assert(parseWeedBatch(body, sizeof(binary), 100000, batch) == ParseStatus::SUCCESS && batch.count == 2);
+	assert(batch.events[0].tillers == 2 && batch.events[0].sprayers == 0x81 && batch.events[0].offset == -20);
+	assert(batch.events[1].tillers == 1 && batch.events[1].sprayers == 0 && batch.events[1].offset == 500);
+	assert(parseWeedBatch(body, sizeof(binary) - 1, 100000, batch) == ParseStatus::SYNTAX_ERROR); // an event cut short
+	assert(parseWeedBatch(body, 2, 100000, batch) == ParseStatus::SYNTAX_ERROR); // no events
+	binary[1] = 1;
+	assert(parseWeedBatch(body, sizeof(binary), 100000, batch) == ParseStatus::SYNTAX_ERROR); // an event too many
+	binary[1] = WEED_BATCH_MAX_EVENTS + 1;
+	assert(parseWeedBatch(body, sizeof(binary), 100000, batch) == ParseStatus::BUFFER_OVERFLOW);
+
+	// weeds already past the implements are skipped
+	WeedEvent event = { 1, 0, -100 };
+	assert(!hasWeedPassed(event, 100));
+	event.offset = -101;
+	assert(hasWeedPassed(event, 100));
+	assert(!hasWeedPassed(event, 200));
+}
+
+void weedUdpTests(void) {
+	LOG_INFO("Weed UDP tests");
+	// tiller bitmask, sprayer bitmask, and delay (little-endian). Delays of 32768ms and up don't fit in a 16-bit int.
+	const uint8_t shortDelay[WeedUdpServer::EVENT_SIZE] = { 0x01, 0x00, 0x0A, 0x00 };
+	const uint8_t longDelay[WeedUdpServer::EVENT_SIZE] = { 0x01, 0x00, 0x00, 0x80 };
+	const uint8_t maxDelay[WeedUdpServer::EVENT_SIZE] = { 0x01, 0x00, 0xFF, 0xFF };
+	assert(WeedUdpServer::eventDelay(shortDelay) == 10000UL);
+	assert(WeedUdpServer::eventDelay(longDelay) == 0x8000 * 1000UL);
+	assert(WeedUdpServer::eventDelay(maxDelay) == 0xFFFF * 1000UL);
+}
+
+void webSocketTests(void) {
+	LOG_INFO("WebSocket tests");
+	// the example handshake from RFC 6455, section 1.3
+	char accept[WEBSOCKET_ACCEPT_SIZE + 1];
+	uint32_t start = micros();
+	webSocketAccept("dGhlIHNhbXBsZSBub25jZQ==", accept);
+	uint32_t acceptTime = micros() - start;
+	assert(!strcmp_P(accept, PSTR("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")));
+	LOG_INFO("Sec-WebSocket-Accept computed in %luus", acceptTime);
+
+	uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+	assert(webSocketFrameHeader(header, WEBSOCKET_OPCODE_TEXT, true, 125) == 2);
+	assert(header[0] == 0x81 && header[1] == 125);
+	assert(webSocketFrameHeader(header, WEBSOCKET_OPCODE_CONTINUATION, false, 300) == 4);
+	assert(header[0] == 0x00 && header[1] == 126 && header[2] == 0x01 && header[3] == 0x2C);
+}
+
+void webSocketPollerTests(void) {
+	LOG_INFO("WebSocket poller tests");
+	char buf[8];
+	webSocketPoller(buf, sizeof(buf)); // whatever the devices start out as counts as a change
+	assert(webSocketPoller(buf, sizeof(buf)) == 0);
+	// the poller runs every HTTP_WEBSOCKET_POLL_INTERVAL, inside the HTTP server's budget
+	uint32_t start = micros();
+	for (uint8_t i = 0; i < 100; i++) {
+		assert(webSocketPoller(buf, sizeof(buf)) == 0);
+	}
+	LOG_INFO("100 WebSocket polls in %luus", micros() - start);
+}
+
+#ifdef ACTUATOR_ISR
+void actuatorTimerTests(void) {
+	LOG_INFO("Actuator timer tests");
+	config.begin();
+	for (uint8_t i = 0; i < Sprayer::COUNT; i++) {
+		sprayers[i].begin(i, &config);
+	}
+	for (uint8_t i = 0; i < Tiller::COUNT; i++) {
+		tillers[i].begin(i, &config);
+	}
+	actuatorTimer.begin();
+
+	// nothing calls update() here, so the interrupt has to fire the commands on its own
+	assert(sprayers[0].setStatus(Sprayer::ON, 20));
+	assert(sprayers[1].setStatus(Sprayer::ON, 300)); // out of range of a single Timer4 hop
+	assert(sprayers[0].getStatus() == Sprayer::OFF);
+	delay(15);
+	assert(sprayers[0].getStatus() == Sprayer::OFF);
+	delay(10);
+	assert(sprayers[0].getStatus() == Sprayer::ON);
+	assert(-100 < actuatorTimer.getLastError() && actuatorTimer.getLastError() < 100);
+	assert(sprayers[1].getStatus() == Sprayer::OFF);
+
+	// block the CPU with interrupts enabled, the way a slow I2C read would
+	uint32_t start = micros();
+	while (micros() - start < 300000UL);
+	assert(sprayers[1].getStatus() == Sprayer::ON);
+	assert(-100 < actuatorTimer.getLastError() && actuatorTimer.getLastError() < 100);
+
+	// commands due at the same time should all fire together
+	assert(tillers[0].setHeight(TillerCommand::UP, 10));
+	assert(sprayers[0].setStatus(Sprayer::OFF, 10));
+	assert(sprayers[1].setStatus(Sprayer::OFF, 10));
+	delay(15);
+	assert(tillers[0].getDH() == 1);
+	assert(sprayers[0].getStatus() == Sprayer::OFF);
+	assert(sprayers[1].getStatus() == Sprayer::OFF);
+	tillers[0].setHeight(TillerCommand::STOP);
+	tillers[0].update();
+	assert(tillers[0].getDH() == 0);
+}
+#endif
+
 void loop() {
 	// do nothing - if we get here, tests are complete and we passed
 }
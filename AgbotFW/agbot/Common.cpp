@@ -8,6 +8,8 @@
 #include "Common.h"
 #include "Log.h"
 
+#include <util/atomic.h>
+
 void assertImpl(bool condition, const char* conditionStr, const char* file, int line) {
 	if (!condition) {
 		LOG_ERROR("%S:%d - assert(%S) failed.", file, line, conditionStr);
@@ -23,18 +25,35 @@ void assertImpl(bool condition, const char* conditionStr, const char* file, int
 	}
 }
 
+Timestamp readClock(void) {
+	Timestamp now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		now.ms = millis();
+		now.us = micros();
+	}
+	return now;
+}
+
 Timer::Timer() : time(0), isSet(false), wasSet(false) {}
 
 void Timer::start(uint32_t delay) {
+	start(delay, millis());
+}
+
+void Timer::start(uint32_t delay, uint32_t now) {
 	if (!isSet) {
-		time = millis() + delay;
+		time = now + delay;
 		isSet = true;
 		wasSet = false;
 	}
 }
 
 void Timer::restart(uint32_t delay) {
-	time = millis() + delay;
+	restart(delay, millis());
+}
+
+void Timer::restart(uint32_t delay, uint32_t now) {
+	time = now + delay;
 	isSet = true;
 	wasSet = false;
 }
@@ -45,7 +64,11 @@ void Timer::stop(void) {
 }
 
 bool Timer::isUp(void) {
-	if (isSet && isElapsed(time)) {
+	return isUp(millis());
+}
+
+bool Timer::isUp(uint32_t now) {
+	if (isSet && timeCmp(now, time) >= 0) {
 		isSet = false;
 		wasSet = true;
 		return true;
@@ -54,10 +77,14 @@ bool Timer::isUp(void) {
 }
 
 bool Timer::hasElapsed(void) {
+	return hasElapsed(millis());
+}
+
+bool Timer::hasElapsed(uint32_t now) {
 	if (wasSet) {
 		return true;
 	}
-	else if (isSet && isElapsed(time)) {
+	else if (isSet && isElapsed(time, now)) {
 		wasSet = true;
 		return true;
 	}
@@ -65,3 +92,101 @@ bool Timer::hasElapsed(void) {
 		return false;
 	}
 }
+
+CommandQueue commandQueue;
+
+void CommandQueue::siftUp(uint8_t i) {
+	while (i) {
+		uint8_t parent = (i - 1) >> 1;
+		if (timeCmp(heap[parent].time, heap[i].time) <= 0) {
+			break;
+		}
+		Entry tmp = heap[parent];
+		heap[parent] = heap[i];
+		heap[i] = tmp;
+		i = parent;
+	}
+}
+
+void CommandQueue::siftDown(uint8_t i) {
+	while (true) {
+		uint8_t smallest = i;
+		uint8_t child = (i << 1) + 1;
+		if (child < size && timeCmp(heap[child].time, heap[smallest].time) < 0) {
+			smallest = child;
+		}
+		child++;
+		if (child < size && timeCmp(heap[child].time, heap[smallest].time) < 0) {
+			smallest = child;
+		}
+		if (smallest == i) {
+			break;
+		}
+		Entry tmp = heap[smallest];
+		heap[smallest] = heap[i];
+		heap[i] = tmp;
+		i = smallest;
+	}
+}
+
+bool CommandQueue::push(Actuator* target, uint8_t command, uint32_t time) {
+	if (size == CAPACITY) {
+		return false;
+	}
+	heap[size].time = time;
+	heap[size].target = target;
+	heap[size].command = command;
+	siftUp(size);
+	size++;
+	return true;
+}
+
+void CommandQueue::cancel(Actuator* target, uint32_t time) {
+	bool removed = false;
+	for (uint8_t i = 0; i < size; ) {
+		if (heap[i].target == target && timeCmp(heap[i].time, time) >= 0) {
+			heap[i] = heap[--size];
+			removed = true;
+		}
+		else {
+			i++;
+		}
+	}
+	if (removed) {
+		heapify();
+	}
+}
+
+void CommandQueue::cancelCommand(Actuator* target, uint8_t command) {
+	bool removed = false;
+	for (uint8_t i = 0; i < size; ) {
+		if (heap[i].target == target && heap[i].command == command) {
+			heap[i] = heap[--size];
+			removed = true;
+		}
+		else {
+			i++;
+		}
+	}
+	if (removed) {
+		heapify();
+	}
+}
+
+void CommandQueue::heapify(void) {
+	for (uint8_t i = size >> 1; i > 0; i--) {
+		siftDown(i - 1);
+	}
+}
+
+uint8_t CommandQueue::dispatch(uint32_t now) {
+	uint8_t count = 0;
+	while (size && timeCmp(now, heap[0].time) >= 0) {
+		Entry entry = heap[0];
+		heap[0] = heap[--size];
+		siftDown(0);
+		entry.target->execute(entry.command, entry.time);
+		count++;
+	}
+	return count;
+}
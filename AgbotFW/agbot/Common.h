@@ -11,6 +11,19 @@
 // Comment this line to use a static IP address of 10.0.0.2; un-comment to use DHCP
 #define DHCP
 
+// Un-comment this line to fire scheduled tiller and sprayer commands from a hardware timer interrupt, rather than waiting
+// for the main loop to call update(). See ActuatorTimer.h
+//#define ACTUATOR_ISR
+
+#ifdef ACTUATOR_ISR
+#include <util/atomic.h>
+// Actuator state is shared with the actuator timer interrupt. Wrap any code in the main loop that touches it in an
+// ACTUATOR_ATOMIC { ... } block. This is a plain block when ACTUATOR_ISR is not defined.
+#define ACTUATOR_ATOMIC ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#else
+#define ACTUATOR_ATOMIC
+#endif
+
 void assertImpl(bool condition, const char* conditionStr, const char* file, int line);
 
 #ifdef DEBUG
@@ -21,13 +34,15 @@ void assertImpl(bool condition, const char* conditionStr, const char* file, int
 
 #define AGBOTFW_VERSION "v0.9.0(dev)"
 
+// Compares two times on the same 32-bit clock - either millis() or micros() - allowing for the clock to wrap around. This is
+// correct as long as the times are within 2^31 ticks of each other: about 24 days for millis(), or 35 minutes for micros().
 // returns: > 0 if t1 comes after t2; < 0 if t1 comes before t2; 0 if t1 equals t2
-inline int8_t timeCmp(unsigned long t1, unsigned long t2) {
-	unsigned long diff = t1 - t2;
+inline int8_t timeCmp(uint32_t t1, uint32_t t2) {
+	uint32_t diff = t1 - t2;
 	if (diff == 0) {
 		return 0;
 	}
-	else if (diff < ((~0UL)>>1)) {
+	else if (diff < 0x7FFFFFFFUL) {
 		return 1;
 	}
 	else {
@@ -38,24 +53,125 @@ inline int8_t timeCmp(unsigned long t1, unsigned long t2) {
 // technically, this function isn't perfect - if time is more than about 25 days in the future, it will be reported as elapsed,
 // and if it is more than about 25 days in the past, it will be reported as not elapsed, due to arithmetic overflow. However,
 // it is as accurate as possible given the constraints of the system architecture.
-inline bool isElapsed(unsigned long time) { return timeCmp(millis(), time) >= 0; }
+inline bool isElapsed(uint32_t time, uint32_t now) { return timeCmp(now, time) >= 0; }
+inline bool isElapsed(unsigned long time) { return isElapsed(time, millis()); }
+
+// A reading of both system clocks, taken together. The scheduler reads the clock once per pass of the main loop, and hands
+// the same Timestamp to every task, rather than each module calling millis() and micros() on its own (each call disables
+// interrupts). That way, every implement updated in the same pass agrees on what time it is.
+struct Timestamp {
+	uint32_t ms; // millis()
+	uint32_t us; // micros()
+};
+
+// A source of Timestamps. readClock() is the real one; tests may substitute a fake clock (see Scheduler.h).
+typedef Timestamp Clock(void);
+
+// Reads millis() and micros() with interrupts disabled, so the two are consistent with each other.
+Timestamp readClock(void);
 
 struct Timer {
 	uint32_t time;
 	bool isSet;
 	// start the timer. If it is already started, do nothing.
 	void start(uint32_t delay);
+	// same as start(), but counts the delay from the given time instead of millis().
+	void start(uint32_t delay, uint32_t now);
 	// restart the timer. If the timer is not already started, start it.
 	void restart(uint32_t delay);
+	// same as restart(), but counts the delay from the given time instead of millis().
+	void restart(uint32_t delay, uint32_t now);
 	// stop the timer. If it is already stopped, do nothing.
 	void stop(void);
 	// if the timer is set and the time has elapsed, stop the timer and return true. Otherwise, return false.
 	bool isUp(void);
+	// same as isUp(), but checks against the given time instead of millis().
+	bool isUp(uint32_t now);
 	// returns true as long as the timer was set in the past, and has now elapsed. Upon triggering, subsequent calls
 	// will return true until the timer is started again.
 	bool hasElapsed(void);
+	// same as hasElapsed(), but checks against the given time instead of millis().
+	bool hasElapsed(uint32_t now);
 
 	Timer();
 private:
 	bool wasSet;
-};
\ No newline at end of file
+};
+
+// A Timer with microsecond resolution. Delays are in microseconds, and the overloads that take the current time expect
+// micros() rather than millis(). Delays must be shorter than about 35 minutes, when micros() wraps halfway around.
+struct MicroTimer : public Timer {
+	using Timer::start;
+	using Timer::restart;
+	using Timer::isUp;
+	using Timer::hasElapsed;
+	inline void start(uint32_t delay) { start(delay, micros()); }
+	inline void restart(uint32_t delay) { restart(delay, micros()); }
+	inline bool isUp(void) { return isUp(micros()); }
+	inline bool hasElapsed(void) { return hasElapsed(micros()); }
+};
+
+// Interface for an implement that executes commands scheduled through the CommandQueue.
+class Actuator {
+	public:
+		// Executes a previously scheduled command. The meaning of command depends on the implement. time is the time (on the
+		// micros() clock) the command was scheduled for.
+		virtual void execute(uint8_t command, uint32_t time) = 0;
+	protected:
+		~Actuator() {}
+};
+
+// A min-heap of pending actuator commands, shared by every implement and ordered by the time they are due. Checking whether
+// anything is due is a single comparison against the front of the heap, no matter how many implements there are, and the
+// queue depth is shared, rather than reserved separately for every implement.
+//
+// Times are on the micros() clock, so a command comes due at the microsecond it was scheduled for, rather than being rounded
+// to the nearest millisecond. It fires the next time dispatch() is called after that: within a few microseconds with
+// ACTUATOR_ISR (see ActuatorTimer.h), but otherwise up to 1ms late, as the main loop dispatches every millisecond.
+// micros() wraps around every 71 minutes, so no command may be scheduled more than MAX_DELAY in advance.
+//
+// Usage example:
+//	commandQueue.cancel(&tiller, time); // cancel tiller's commands due at or after time
+//	commandQueue.push(&tiller, TillerCommand::LOWERED, time);
+//	commandQueue.dispatch(micros()); // call this repeatedly to execute commands as they come due
+class CommandQueue {
+	public:
+		static const uint8_t CAPACITY = 32;
+		// The longest delay, in milliseconds, a command may be scheduled with (30 minutes), well inside the micros() range.
+		static const uint32_t MAX_DELAY = 30UL * 60 * 1000;
+	private:
+		struct Entry {
+			uint32_t time;
+			Actuator* target;
+			uint8_t command;
+		};
+		Entry heap[CAPACITY];
+		uint8_t size;
+
+		void siftUp(uint8_t i);
+		void siftDown(uint8_t i);
+		void heapify(void); // restores the heap property after entries were removed
+
+		// disallow copy constructor
+		void operator=(CommandQueue const&) {}
+		CommandQueue(CommandQueue const&) {}
+	public:
+		CommandQueue() : size(0) {}
+
+		// Schedules command to be executed by target once time (on the micros() clock) has elapsed.
+		// returns: true on success; false if the queue is full.
+		bool push(Actuator* target, uint8_t command, uint32_t time);
+		// Cancels every command for target that is due at or after time.
+		void cancel(Actuator* target, uint32_t time);
+		// Cancels every instance of the given command for target, whenever it is due.
+		void cancelCommand(Actuator* target, uint8_t command);
+		// Executes every command that is due at the given time, in the order they are due. Returns the number executed.
+		uint8_t dispatch(uint32_t now);
+
+		inline bool isEmpty(void) const { return !size; }
+		inline uint8_t getSize(void) const { return size; }
+		// Returns the time the next command is due. Only valid if the queue is not empty.
+		inline uint32_t getNextTime(void) const { return heap[0].time; }
+};
+
+extern CommandQueue commandQueue;
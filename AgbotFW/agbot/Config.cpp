@@ -10,10 +10,11 @@
 #include <EEPROM.h>
 
 #include "Config.h"
+#include "Log.h"
 
 #define MAKE_SETTING_STRING(setting)	static_assert((uint8_t) Setting::setting >= 0, ""); \
 										static const char setting##_STR [] PROGMEM = #setting
-#define SETTING_METADATA(setting, minVal, maxVal) { setting##_STR, minVal, maxVal }
+#define SETTING_METADATA(setting, minVal, maxVal, defaultVal) { setting##_STR, minVal, maxVal, defaultVal }
 
 MAKE_SETTING_STRING(Precision);
 MAKE_SETTING_STRING(KeepAliveTimeout);
@@ -26,6 +27,9 @@ MAKE_SETTING_STRING(TillerRaisedHeight);
 MAKE_SETTING_STRING(HitchAccuracy);
 MAKE_SETTING_STRING(HitchLoweredHeight);
 MAKE_SETTING_STRING(HitchRaisedHeight);
+MAKE_SETTING_STRING(SprayerMinOffTime);
+MAKE_SETTING_STRING(BroadcastPeriod);
+MAKE_SETTING_STRING(BroadcastGroup);
 
 // Ordering of these values MUST align with order of settings declared
 // in Setting enum.
@@ -33,18 +37,22 @@ static struct {
 	const char* name;
 	uint16_t minValue;
 	uint16_t maxValue;
+	uint16_t defaultValue; // what Config::begin() stores if the EEPROM holds a value out of range
 } settingData[] = {
-	SETTING_METADATA(Precision, 0, 0xFFFF),
-	SETTING_METADATA(KeepAliveTimeout, 0, 0xFFFF),
-	SETTING_METADATA(ResponseDelay, 0, 0xFFFF),
-	SETTING_METADATA(TillerRaiseTime, 0, 0xFFFF),
-	SETTING_METADATA(TillerLowerTime, 0, 0xFFFF),
-	SETTING_METADATA(TillerAccuracy, 0, 100),
-	SETTING_METADATA(TillerLoweredHeight, 0, 100),
-	SETTING_METADATA(TillerRaisedHeight, 0, 100),
-	SETTING_METADATA(HitchAccuracy, 0, 100),
-	SETTING_METADATA(HitchLoweredHeight, 0, 100),
-	SETTING_METADATA(HitchRaisedHeight, 0, 100),
+	SETTING_METADATA(Precision, 0, 0xFFFF, 100),
+	SETTING_METADATA(KeepAliveTimeout, 0, 0xFFFF, 2000),
+	SETTING_METADATA(ResponseDelay, 0, 0xFFFF, 0),
+	SETTING_METADATA(TillerRaiseTime, 0, 0xFFFF, 1000),
+	SETTING_METADATA(TillerLowerTime, 0, 0xFFFF, 1000),
+	SETTING_METADATA(TillerAccuracy, 0, 100, 5),
+	SETTING_METADATA(TillerLoweredHeight, 0, 100, 0),
+	SETTING_METADATA(TillerRaisedHeight, 0, 100, 100),
+	SETTING_METADATA(HitchAccuracy, 0, 100, 5),
+	SETTING_METADATA(HitchLoweredHeight, 0, 100, 0),
+	SETTING_METADATA(HitchRaisedHeight, 0, 100, 100),
+	SETTING_METADATA(SprayerMinOffTime, 0, 1000, 0),
+	SETTING_METADATA(BroadcastPeriod, 0, 10000, 0),
+	SETTING_METADATA(BroadcastGroup, 0, 0xFFFF, 0),
 };
 
 static_assert(Config::NUM_SETTINGS == sizeof(settingData) / sizeof(settingData[0]),
@@ -53,6 +61,11 @@ static_assert(Config::NUM_SETTINGS == sizeof(settingData) / sizeof(settingData[0
 void Config::begin() {
 	for (uint8_t i = 0; i < NUM_SETTINGS; i++) {
 		EEPROM.get(i * SETTING_SIZE, settings[i]);
+		if (settings[i] < settingData[i].minValue || settings[i] > settingData[i].maxValue) {
+			LOG_WARNING("Setting %S is out of range (%u) - reset to %u", settingData[i].name, settings[i],
+					settingData[i].defaultValue);
+			set(static_cast<Setting>(i), settingData[i].defaultValue);
+		}
 	}
 }
 
@@ -41,13 +41,21 @@ enum class Setting : uint8_t {
 	// The height of the 3-point hitch when it is lowered for processing. This should be between 0 and 100.
 	HitchLoweredHeight = 9,
 	// The height of the 3-point hitch when it is raised for transport or at the end of a row. This should be between 0 and 100.
-	HitchRaisedHeight = 10
+	HitchRaisedHeight = 10,
+	// The shortest time, in milliseconds, a sprayer valve is allowed to stay closed between two weeds. If the sprayer would turn
+	// off for less than this, it stays on instead, since the solenoid can't close and reopen that fast. 0 disables this.
+	SprayerMinOffTime = 11,
+	// The length of time, in milliseconds, between the state frames multicast over UDP (see StateBroadcast.h). 0 turns the
+	// broadcast off.
+	BroadcastPeriod = 12,
+	// The multicast group the state frames are sent to: the high byte and low byte are the last two octets of 239.255.x.y.
+	BroadcastGroup = 13
 };
 
 class Config {
 	public:
 		static const size_t SETTING_SIZE = sizeof(uint16_t);
-		static const uint8_t NUM_SETTINGS = 11;
+		static const uint8_t NUM_SETTINGS = 14;
 	private:
 		// in-RAM buffer for all settings
 		uint16_t settings[NUM_SETTINGS];
@@ -59,7 +67,8 @@ class Config {
 		// Creates a new config object. Until begin() is called, any other member functions are still undefined.
 		Config() {}
 
-		// Loads the configuration settings from EEPROM memory.
+		// Loads the configuration settings from EEPROM memory. Settings that are out of range (e.g. settings added since
+		// the EEPROM was last written, which read as 0xFFFF) are reset to their default value, with a warning.
 		void begin();
 
 		// Returns the specified setting from the cache.
@@ -16,6 +16,8 @@
 #include "Throttle.h"
 #include "LidarLiteV3.h"
 #include "Estop.h"
+#include "Scheduler.h"
+#include "Http.h"
 
 extern Estop estop;
 extern Config config;
@@ -24,4 +26,6 @@ extern Tiller tillers[Tiller::COUNT];
 extern Sprayer sprayers[Sprayer::COUNT];
 extern Throttle throttle;
 extern LidarLiteBank heightSensors;
+extern Scheduler scheduler;
+extern HttpServer server;
 
@@ -8,23 +8,24 @@
 
 #include "Common.h"
 #include "Estop.h"
+#include "FastGpio.h"
 
 Estop::Estop() : whenEngaged(0), engaged(false) { }
 
 void Estop::begin() {
-	pinMode(Estop::HW_PIN, OUTPUT);
-	digitalWrite(Estop::HW_PIN, HIGH);
+	StaticPin<Estop::HW_PIN>::output();
+	StaticPin<Estop::HW_PIN>::high();
 }
 
 void Estop::engage() {
 	whenEngaged = millis();
 	engaged = true;
-	digitalWrite(Estop::HW_PIN, LOW);
+	StaticPin<Estop::HW_PIN>::low();
 }
 
-void Estop::update() {
-	if (engaged && isElapsed(whenEngaged + Estop::PULSE_LEN)) {
+void Estop::update(uint32_t now) {
+	if (engaged && isElapsed(whenEngaged + Estop::PULSE_LEN, now)) {
 		engaged = false;
-		digitalWrite(Estop::HW_PIN, HIGH);
+		StaticPin<Estop::HW_PIN>::high();
 	}
 }
@@ -14,7 +14,7 @@
  *	Estop estop;
  *	estop.begin();
  *	estop.engage();
- *	estop.update();
+ *	estop.update(millis());
  * 
  * Created: 3/6/2019 1:30:36 PM
  *  Author: troy.honegger
@@ -48,6 +48,6 @@ class Estop {
 		// The e-stop contains a hardware latch, so once the e-stop line is pulled low for long enough to energize
 		// the relay coil, the e-stop will engage until it is manually reset. Calling update() causes the controller
 		// to stop asserting the e-stop line after enough time has passed, which allows for painless e-stop recovery.
-		// As such, it should be called every iteration of the main control loop.
-		void update();
+		// As such, it should be called every iteration of the main control loop, with the current time in milliseconds.
+		void update(uint32_t now);
 };
@@ -0,0 +1,135 @@
+/*
+ * FastGpio.h
+ * Drives digital output pins directly through the port registers, rather than through digitalWrite() and pinMode().
+ *
+ * digitalWrite() looks up the pin's port, bit, and timer in three PROGMEM tables, and turns off PWM, on every call. That
+ * costs several microseconds, which adds up when every actuator drives its pins on every pass of the main loop.
+ *
+ * StaticPin<PIN> is for pins known at compile time (e.g. Hitch::RAISE_PIN). The port register and bitmask are resolved
+ * at compile time. On ports A-G, which are in the low I/O space, each write compiles to one sbi or cbi instruction, which
+ * is also atomic. Ports H-L are memory-mapped, so the bit has to be read, modified, and written. That is done with
+ * interrupts disabled, since the actuator timer interrupt (see ActuatorTimer.h) may write to the same port.
+ *
+ * CachedPin is for pins computed at run time (e.g. Sprayer::getPin()). It looks up the port register and bitmask once,
+ * in begin(), and every write after that is a read-modify-write with interrupts briefly disabled.
+ *
+ * Neither one turns off PWM on the pin, so don't use them on pins driven by analogWrite().
+ *
+ * Usage example:
+ *	StaticPin<Hitch::RAISE_PIN>::output();
+ *	StaticPin<Hitch::RAISE_PIN>::write(HIGH);
+ *	CachedPin pin;
+ *	pin.begin(getPin()); // e.g. in Sprayer::begin()
+ *	pin.output();
+ *	pin.write(LOW);
+ *
+ * Created: 10/16/2026 4:12:09 PM
+ *  Author: troy.honegger
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "Common.h"
+
+// Data-space addresses of the PORTx registers on the ATmega2560. DDRx is always one below PORTx, and PINx two below.
+#define GPIO_PORTA	0x22
+#define GPIO_PORTB	0x25
+#define GPIO_PORTC	0x28
+#define GPIO_PORTD	0x2B
+#define GPIO_PORTE	0x2E
+#define GPIO_PORTF	0x31
+#define GPIO_PORTG	0x34
+#define GPIO_PORTH	0x102
+#define GPIO_PORTJ	0x105
+#define GPIO_PORTK	0x108
+#define GPIO_PORTL	0x10B
+// Registers below this address are in the low I/O space, and can be accessed with sbi and cbi
+#define GPIO_SBI_LIMIT	0x40
+
+// Port and bit of every digital pin on the Arduino Mega (see pins_arduino.h). These are only used in constant
+// expressions, so they don't take up any space in RAM or flash.
+static constexpr uint16_t MEGA_PIN_PORTS[] = {
+	GPIO_PORTE, GPIO_PORTE, GPIO_PORTE, GPIO_PORTE, GPIO_PORTG, GPIO_PORTE, GPIO_PORTH, GPIO_PORTH, // 0-7
+	GPIO_PORTH, GPIO_PORTH, GPIO_PORTB, GPIO_PORTB, GPIO_PORTB, GPIO_PORTB, GPIO_PORTJ, GPIO_PORTJ, // 8-15
+	GPIO_PORTH, GPIO_PORTH, GPIO_PORTD, GPIO_PORTD, GPIO_PORTD, GPIO_PORTD, GPIO_PORTA, GPIO_PORTA, // 16-23
+	GPIO_PORTA, GPIO_PORTA, GPIO_PORTA, GPIO_PORTA, GPIO_PORTA, GPIO_PORTA, GPIO_PORTC, GPIO_PORTC, // 24-31
+	GPIO_PORTC, GPIO_PORTC, GPIO_PORTC, GPIO_PORTC, GPIO_PORTC, GPIO_PORTC, GPIO_PORTD, GPIO_PORTG, // 32-39
+	GPIO_PORTG, GPIO_PORTG, GPIO_PORTL, GPIO_PORTL, GPIO_PORTL, GPIO_PORTL, GPIO_PORTL, GPIO_PORTL, // 40-47
+	GPIO_PORTL, GPIO_PORTL, GPIO_PORTB, GPIO_PORTB, GPIO_PORTB, GPIO_PORTB, GPIO_PORTF, GPIO_PORTF, // 48-55
+	GPIO_PORTF, GPIO_PORTF, GPIO_PORTF, GPIO_PORTF, GPIO_PORTF, GPIO_PORTF, GPIO_PORTK, GPIO_PORTK, // 56-63
+	GPIO_PORTK, GPIO_PORTK, GPIO_PORTK, GPIO_PORTK, GPIO_PORTK, GPIO_PORTK // 64-69
+};
+static constexpr uint8_t MEGA_PIN_BITS[] = {
+	0, 1, 4, 5, 5, 3, 3, 4, // 0-7
+	5, 6, 4, 5, 6, 7, 1, 0, // 8-15
+	1, 0, 3, 2, 1, 0, 0, 1, // 16-23
+	2, 3, 4, 5, 6, 7, 7, 6, // 24-31
+	5, 4, 3, 2, 1, 0, 7, 2, // 32-39
+	1, 0, 7, 6, 5, 4, 3, 2, // 40-47
+	1, 0, 3, 2, 1, 0, 0, 1, // 48-55
+	2, 3, 4, 5, 6, 7, 0, 1, // 56-63
+	2, 3, 4, 5, 6, 7 // 64-69
+};
+static_assert(sizeof(MEGA_PIN_PORTS) / sizeof(MEGA_PIN_PORTS[0]) == 70 && sizeof(MEGA_PIN_BITS) == 70,
+		"MEGA_PIN_PORTS and MEGA_PIN_BITS must cover all 70 digital pins");
+
+template <uint8_t PIN>
+struct StaticPin {
+	static_assert(PIN < sizeof(MEGA_PIN_BITS), "StaticPin: not an Arduino Mega pin");
+
+	static const uint16_t PORT = MEGA_PIN_PORTS[PIN]; // data-space address of PORTx
+	static const uint8_t MASK = 1 << MEGA_PIN_BITS[PIN];
+
+	// Sets this pin's bit in the register at the given address (PORTx or DDRx). Compiles to sbi when possible.
+	static inline void set(uint16_t address) {
+		if (PORT < GPIO_SBI_LIMIT) {
+			_SFR_MEM8(address) |= MASK;
+		}
+		else {
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { _SFR_MEM8(address) |= MASK; }
+		}
+	}
+	// Clears this pin's bit in the register at the given address (PORTx or DDRx). Compiles to cbi when possible.
+	static inline void clear(uint16_t address) {
+		if (PORT < GPIO_SBI_LIMIT) {
+			_SFR_MEM8(address) &= ~MASK;
+		}
+		else {
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { _SFR_MEM8(address) &= ~MASK; }
+		}
+	}
+
+	static inline void high(void) { set(PORT); }
+	static inline void low(void) { clear(PORT); }
+	static inline void write(uint8_t value) { if (value) { high(); } else { low(); } }
+	// Equivalent to pinMode(PIN, OUTPUT)
+	static inline void output(void) { set(PORT - 1); }
+	// Equivalent to pinMode(PIN, INPUT) - also turns off the pull-up resistor
+	static inline void input(void) { clear(PORT - 1); low(); }
+};
+
+class CachedPin {
+	private:
+		volatile uint8_t* port;
+		uint8_t mask;
+	public:
+		CachedPin() : port(nullptr), mask(0) {}
+
+		// Looks up the port register and bitmask for the given pin. Call this before any other member functions.
+		inline void begin(uint8_t pin) {
+			port = portOutputRegister(digitalPinToPort(pin));
+			mask = digitalPinToBitMask(pin);
+		}
+
+		inline void high(void) const { ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { *port |= mask; } }
+		inline void low(void) const { ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { *port &= ~mask; } }
+		inline void write(uint8_t value) const { if (value) { high(); } else { low(); } }
+		// Equivalent to pinMode(pin, OUTPUT)
+		inline void output(void) const { ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { *(port - 1) |= mask; } }
+		// Equivalent to pinMode(pin, INPUT) - also turns off the pull-up resistor
+		inline void input(void) const { ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { *(port - 1) &= ~mask; *port &= ~mask; } }
+};
@@ -9,6 +9,7 @@
 #include <Arduino.h>
 #include "Common.h"
 #include "Config.h"
+#include "FastGpio.h"
 #include "Hitch.h"
 
 uint8_t Hitch::getActualHeight() const {
@@ -18,15 +19,15 @@ uint8_t Hitch::getActualHeight() const {
 
 void Hitch::begin(Config const* config) {
 	Hitch::config = config;
-	digitalWrite(RAISE_PIN, OFF_VOLTAGE);
-	pinMode(RAISE_PIN, OUTPUT);
-	digitalWrite(LOWER_PIN, OFF_VOLTAGE);
-	pinMode(LOWER_PIN, OUTPUT);
-	pinMode(HEIGHT_SENSOR_PIN, INPUT);
+	StaticPin<RAISE_PIN>::write(OFF_VOLTAGE);
+	StaticPin<RAISE_PIN>::output();
+	StaticPin<LOWER_PIN>::write(OFF_VOLTAGE);
+	StaticPin<LOWER_PIN>::output();
+	StaticPin<HEIGHT_SENSOR_PIN>::input();
 	targetHeight = STOP;
 	dh = 0;
-	pinMode(CLUTCH_PIN, OUTPUT);
-	digitalWrite(CLUTCH_PIN, CLUTCH_OFF_VOLTAGE);
+	StaticPin<CLUTCH_PIN>::output();
+	StaticPin<CLUTCH_PIN>::write(CLUTCH_OFF_VOLTAGE);
 	updateClutch();
 }
 
@@ -45,16 +46,16 @@ void Hitch::update() {
 		dh = newDh;
 		switch (newDh) {
 			case -1:
-				digitalWrite(RAISE_PIN, OFF_VOLTAGE);
-				digitalWrite(LOWER_PIN, ON_VOLTAGE);
+				StaticPin<RAISE_PIN>::write(OFF_VOLTAGE);
+				StaticPin<LOWER_PIN>::write(ON_VOLTAGE);
 				break;
 			case 0:
-				digitalWrite(RAISE_PIN, OFF_VOLTAGE);
-				digitalWrite(LOWER_PIN, OFF_VOLTAGE);
+				StaticPin<RAISE_PIN>::write(OFF_VOLTAGE);
+				StaticPin<LOWER_PIN>::write(OFF_VOLTAGE);
 				break;
 			case 1:
-				digitalWrite(LOWER_PIN, OFF_VOLTAGE);
-				digitalWrite(RAISE_PIN, ON_VOLTAGE);
+				StaticPin<LOWER_PIN>::write(OFF_VOLTAGE);
+				StaticPin<RAISE_PIN>::write(ON_VOLTAGE);
 				break;
 		}
 	}
@@ -64,12 +65,12 @@ void Hitch::update() {
 void Hitch::updateClutch() {
 	if (targetHeight == STOP) {
 		// We're not moving, but we don't know if the hitch is up or not. We'll leave the clutch on to be safe.
-		digitalWrite(CLUTCH_PIN, CLUTCH_OFF_VOLTAGE);
+		StaticPin<CLUTCH_PIN>::write(CLUTCH_OFF_VOLTAGE);
 	}
 	else if (targetHeight < MAX_HEIGHT / 2) {
-		digitalWrite(CLUTCH_PIN, CLUTCH_ON_VOLTAGE);
+		StaticPin<CLUTCH_PIN>::write(CLUTCH_ON_VOLTAGE);
 	}
-	else { digitalWrite(CLUTCH_PIN, CLUTCH_OFF_VOLTAGE); }
+	else { StaticPin<CLUTCH_PIN>::write(CLUTCH_OFF_VOLTAGE); }
 }
 
 size_t Hitch::serialize(char* str, size_t n) const {
@@ -1,14 +1,25 @@
 ﻿#include "Http.h"
 
+#include <ctype.h>
+
 #include "Common.h"
 #include "Log.h"
-
-typedef long ssize_t; // for some reason Arduino doesn't have this defined by default?
+#include "WebSocket.h"
 
 #define HTTPCLIENT_STATUS_DISCONNECTED	(0)
+#define HTTPCLIENT_STATUS_WEBSOCKET		(16)
 #define HTTPCLIENT_STATUS_READING		(32)
 #define HTTPCLIENT_STATUS_RCVD			(64)
 
+// WebSocket states MUST be between 17 and 31
+#define HTTPCLIENT_WS_READING_HEADER	(17)
+#define HTTPCLIENT_WS_READING_PAYLOAD	(18)
+#define HTTPCLIENT_WS_RCVD_MESSAGE		(19)
+#define HTTPCLIENT_WS_RCVD_PING			(20)
+#define HTTPCLIENT_WS_CLOSING			(21) // sending a close frame; the connection is closed once it's sent
+#define HTTPCLIENT_WS_WRITING_REPLY		(22) // waiting to send the reply to a message
+#define HTTPCLIENT_WS_WRITING_CHUNKS	(23) // sending streamed content in continuation frames (see HttpResponse::writer)
+
 // Reading states MUST be between 33 and 63
 #define HTTPCLIENT_READING_METHOD		(33)
 #define HTTPCLIENT_READING_VERSION		(34)
@@ -25,27 +36,68 @@ typedef long ssize_t; // for some reason Arduino doesn't have this defined by de
 #define HTTPCLIENT_RCVD_URI_TOO_LONG	(68)
 #define HTTPCLIENT_RCVD_HDRS_TOO_LONG	(69)
 #define HTTPCLIENT_RCVD_BODY_TOO_LONG	(70)
+#define HTTPCLIENT_RCVD_BAD_REQUEST		(71)
+#define HTTPCLIENT_RCVD_TIMEOUT			(72)
+#define HTTPCLIENT_RCVD_NO_CONNECTION	(73)
+#define HTTPCLIENT_RCVD_BAD_REQUEST_LINE	(74)
+
+#define HTTPCLIENT_STATUS_WRITING		(128)
 
+// Writing states MUST be between 129 and 159
+#define HTTPCLIENT_WRITING_HEAD			(129) // waiting to send the status line and headers
+#define HTTPCLIENT_WRITING_BODY			(130) // sending the rest of the content
+#define HTTPCLIENT_WRITING_CHUNKS		(131) // sending streamed content (see HttpResponse::writer)
+
+// Connection priorities (see HttpClassifier)
+#define HTTP_PRIORITY_UNKNOWN			(0) // no request classified yet
+#define HTTP_PRIORITY_NORMAL			(1)
+#define HTTP_PRIORITY_URGENT			(2)
 
-#define HTTP_METHOD_MAX_LEN				(7)
-#define HTTP_VERSION_MAX_LEN			(8)
 
 // TODO duplication of identical definition in EthernetApi.cpp
 #define MAKE_CONST_STR_WITH_LEN(token) static const char token##_STR[] PROGMEM = #token; static const uint8_t token##_STR_LEN = strlen_P(token##_STR)
 
-#define PSTR_AND_LEN(s)					reinterpret_cast<const uint8_t*>(PSTR(s)), sizeof(s) - 1
+#define PSTR_AND_LEN(s)					PSTR(s), sizeof(s) - 1
 
 static const char HTTP_10_STR[] PROGMEM = "HTTP/1.0";
-static const uint8_t HTTP_10_STR_LEN = 8;
-
 static const char HTTP_11_STR[] PROGMEM = "HTTP/1.1";
-static const uint8_t HTTP_11_STR_LEN = 8;
-
-static const char CRLF_STR[] PROGMEM = "\r\n";
-static const uint8_t CRLF_STR_LEN = 2;
+static const uint8_t HTTP_VERSION_STR_LEN = 8;
 
 static const char CONTENT_LENGTH_STR[] PROGMEM = "Content-Length";
-static const uint8_t CONTENT_LENGTH_STR_LEN = 14;
+static const char CONNECTION_STR[] PROGMEM = "Connection";
+static const char UPGRADE_STR[] PROGMEM = "Upgrade";
+static const char SEC_WEBSOCKET_KEY_STR[] PROGMEM = "Sec-WebSocket-Key";
+static const char CLOSE_STR[] PROGMEM = "close";
+static const char KEEP_ALIVE_STR[] PROGMEM = "keep-alive";
+static const char UPGRADE_TOKEN_STR[] PROGMEM = "upgrade";
+static const char WEBSOCKET_STR[] PROGMEM = "websocket";
+
+// Sent by every response that closes the connection, including the hardcoded error responses
+#define CONNECTION_CLOSE_HEADER			"Connection: close\r\n"
+
+// Connection header, followed by the blank line that ends the headers
+static const char CONNECTION_CLOSE_STR[] PROGMEM = CONNECTION_CLOSE_HEADER "\r\n";
+static const uint8_t CONNECTION_CLOSE_STR_LEN = 21;
+
+static const char CONNECTION_KEEP_ALIVE_STR[] PROGMEM = "Connection: keep-alive\r\n\r\n";
+static const uint8_t CONNECTION_KEEP_ALIVE_STR_LEN = 26;
+
+// headers of a 101 response to a WebSocket upgrade request, up to the Sec-WebSocket-Accept value
+static const char CONNECTION_UPGRADE_STR[] PROGMEM = "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+static const uint8_t CONNECTION_UPGRADE_STR_LEN = 63;
+
+static const char TRANSFER_ENCODING_CHUNKED_STR[] PROGMEM = "Transfer-Encoding: chunked\r\n";
+static const uint8_t TRANSFER_ENCODING_CHUNKED_STR_LEN = 28;
+
+// the last chunk of a chunked response, followed by the blank line that ends it
+static const char LAST_CHUNK_STR[] PROGMEM = "0\r\n\r\n";
+static const uint8_t LAST_CHUNK_STR_LEN = 5;
+
+// Each chunk of a streamed response is framed in place in the connection's content buffer, so it goes out in a single write:
+// the chunk size in hex and a CRLF are put just before the data, and a CRLF just after. The header has room for 3 hex digits.
+#define CHUNK_HEADER_SIZE				(5)
+#define CHUNK_TRAILER_SIZE				(2)
+static_assert(CHUNK_HEADER_SIZE >= WEBSOCKET_MAX_HEADER_SIZE, "A WebSocket frame header must fit in front of a chunk");
 
 MAKE_CONST_STR_WITH_LEN(OPTIONS);
 MAKE_CONST_STR_WITH_LEN(GET);
@@ -55,10 +107,19 @@ MAKE_CONST_STR_WITH_LEN(PUT);
 MAKE_CONST_STR_WITH_LEN(DELETE);
 MAKE_CONST_STR_WITH_LEN(PATCH);
 
+static void resetRequest(HttpConnection&);
 static void resetConnection(HttpConnection&);
 
-HttpServer::HttpServer(EthernetServer& server, uint8_t maxConnections, HttpHandler* handler)
-		: maxConnections(maxConnections), server(server), handler(handler) {
+static_assert(HTTP_RESPONSE_BUFFER_CNT >= 1 && HTTP_RESPONSE_BUFFER_CNT <= 8, "HTTP_RESPONSE_BUFFER_CNT must be between 1 and 8");
+static_assert(HTTP_RESPONSE_CONTENT_SIZE <= 0xFFF + CHUNK_HEADER_SIZE + CHUNK_TRAILER_SIZE,
+		"HTTP_RESPONSE_CONTENT_SIZE is too big for the chunk header");
+static_assert(HTTP_RESPONSE_CONTENT_SIZE >= HTTP_MIN_CHUNK_SIZE + CHUNK_HEADER_SIZE + CHUNK_TRAILER_SIZE,
+		"HTTP_RESPONSE_CONTENT_SIZE is too small to hold a chunk of HTTP_MIN_CHUNK_SIZE");
+
+HttpServer::HttpServer(EthernetServer& server, uint8_t maxConnections, HttpHandler* handler, HttpClassifier* classifier,
+		WebSocketPoller* poller, WebSocketPusher* pusher)
+		: maxConnections(maxConnections), server(server), freeResponseBuffers((1 << HTTP_RESPONSE_BUFFER_CNT) - 1), handler(handler),
+		classifier(classifier), poller(poller), pusher(pusher), lastPoll(0), reclaimedConnections(0), webSocketCount(0) {
 	// limit maxConnections to HTTP_MAX_CONNECTIONS
 	if (maxConnections > HTTP_MAX_CONNECTIONS) {
 		HttpServer::maxConnections = HTTP_MAX_CONNECTIONS;
@@ -73,742 +134,1088 @@ void HttpServer::begin(void) {
 	server.begin();
 }
 
-// reads up to bufferLen - 1 bytes into buf, either from connection.leftovers (if present)
-// or the Ethernet client (otherwise). Always null-terminates the input.
-static size_t read(EthernetClient& client, HttpConnection& connection, char* buf, size_t bufferLen) {
-	size_t numRead = 0;
-	if (connection.leftovers) {
-		numRead = connection.leftoversLength;
-		if (numRead > bufferLen - 1) {
-			numRead = bufferLen - 1;
-		}
-		memcpy(buf, connection.leftovers, numRead);
-		buf[numRead] = '\0';
-		if (numRead == connection.leftoversLength) {
-			connection.leftovers = nullptr;
-			connection.leftoversLength = 0;
-		}
-		else {
-			connection.leftovers += numRead;
-			connection.leftoversLength -= numRead;
-		}
+bool HttpServer::acquireResponseBuffer(HttpConnection& connection) {
+	if (connection.responseBuffer != HTTP_NO_RESPONSE_BUFFER) {
+		return true;
 	}
-	else {
-		numRead = client.read((uint8_t*) buf, bufferLen - 1);
-		buf[numRead] = '\0';
+	for (uint8_t i = 0; i < HTTP_RESPONSE_BUFFER_CNT; i++) {
+		if (freeResponseBuffers & (1 << i)) {
+			freeResponseBuffers &= ~(1 << i);
+			connection.responseBuffer = i;
+			memset(&connection.response, 0, sizeof(connection.response));
+			connection.response.headers = responseBuffers[i].headers;
+			connection.response.contentBuffer = responseBuffers[i].content;
+			*responseBuffers[i].headers = '\0';
+			*responseBuffers[i].content = '\0';
+			return true;
+		}
 	}
-	return numRead;
+	return false;
 }
 
-// ASSUMES: extra points inside the string last returned by read(), for this connection
-static void unread(HttpConnection& connection, char *extra, size_t extraLen) {
-	if (connection.leftovers) {
-		// extra points to a copy of memory stored immediately before leftovers.
-		connection.leftovers -= extraLen;
-		connection.leftoversLength += extraLen;
-	}
-	else {
-		connection.leftovers = extra;
-		connection.leftoversLength = extraLen;
+void HttpServer::releaseResponseBuffer(HttpConnection& connection) {
+	if (connection.responseBuffer != HTTP_NO_RESPONSE_BUFFER) {
+		freeResponseBuffers |= 1 << connection.responseBuffer;
+		connection.responseBuffer = HTTP_NO_RESPONSE_BUFFER;
+		connection.response.headers = nullptr;
+		connection.response.contentBuffer = nullptr;
 	}
 }
 
-// character-by-character copy. Useful for shifting things in memory when src and dest may overlap.
-static void copyInPlace(char* dest, char *src, size_t length) {
-	for (; length; length--) {
-		*dest++ = *src++;
-	}
-}
+// Incremental string matching. The method, version, and the header names and tokens the server cares about are matched
+// one character at a time, as they arrive, against PROGMEM tables of candidate strings, so they never have to be buffered.
+// Candidates are tracked as a bitmask of indexes into the table; a table has at most 8 entries.
+#define ALL_CANDIDATES(cnt)				static_cast<uint8_t>((1 << (cnt)) - 1)
+#define NO_MATCH						(0xFF)
 
-static bool parseHttpMethod(const char* str, HttpMethod& method) {
-	if (!strncmp_P(str, GET_STR, GET_STR_LEN)) {
-		method = HttpMethod::GET;
-		return true;
-	}
-	else if (!strncmp_P(str, POST_STR, POST_STR_LEN)) {
-		method = HttpMethod::POST;
-		return true;
-	}
-	else if (!strncmp_P(str, PUT_STR, PUT_STR_LEN)) {
-		method = HttpMethod::PUT;
-		return true;
-	}
-	else if (!strncmp_P(str, DELETE_STR, DELETE_STR_LEN)) {
-		method = HttpMethod::DELETE;
-		return true;
-	}
-	else if (!strncmp_P(str, HEAD_STR, HEAD_STR_LEN)) {
-		method = HttpMethod::HEAD;
-		return true;
-	}
-	else if (!strncmp_P(str, PATCH_STR, PATCH_STR_LEN)) {
-		method = HttpMethod::PATCH;
-		return true;
-	}
-	else if (!strncmp_P(str, OPTIONS_STR, OPTIONS_STR_LEN)) {
-		method = HttpMethod::OPTIONS;
-		return true;
-	}
-	else {
-		return false;
-	}
-}
+static const char* const METHOD_STRS[] PROGMEM = { // indexed by HttpMethod
+	OPTIONS_STR, GET_STR, HEAD_STR, POST_STR, PUT_STR, DELETE_STR, PATCH_STR
+};
+static const uint8_t METHOD_CNT = 7;
 
-static bool parseHttpVersion(const char* str, HttpVersion& version) {
-	if (!strncmp_P(str, HTTP_10_STR, HTTP_10_STR_LEN)) {
-		version = HttpVersion::Http_10;
-		return true;
-	}
-	else if (!strncmp_P(str, HTTP_11_STR, HTTP_11_STR_LEN)) {
-		version = HttpVersion::Http_11;
-		return true;
-	}
-	else {
-		return false;
-	}
+const char* httpMethodToString(HttpMethod method) {
+	return reinterpret_cast<const char*>(pgm_read_ptr(METHOD_STRS + static_cast<uint8_t>(method)));
 }
 
-static char* strnchr(char* str, char c, size_t n) {
-	if (!str) {
-		return nullptr;
-	}
-	for (; n > 0 && *str; n--) {
-		if (*str == c) {
-			return str;
+static const char* const VERSION_STRS[] PROGMEM = { // indexed by HttpVersion
+	HTTP_10_STR, HTTP_11_STR
+};
+static const uint8_t VERSION_CNT = 2;
+
+#define HTTP_HEADER_CONTENT_LENGTH		(0)
+#define HTTP_HEADER_CONNECTION			(1)
+#define HTTP_HEADER_UPGRADE				(2)
+#define HTTP_HEADER_SEC_WEBSOCKET_KEY	(3)
+#define HTTP_HEADER_OTHER				(NO_MATCH)
+static const char* const HEADER_STRS[] PROGMEM = { // indexed by HTTP_HEADER_*
+	CONTENT_LENGTH_STR, CONNECTION_STR, UPGRADE_STR, SEC_WEBSOCKET_KEY_STR
+};
+static const uint8_t HEADER_CNT = 4;
+
+// tokens in the Connection header
+#define HTTP_CONNECTION_CLOSE			(0)
+#define HTTP_CONNECTION_KEEP_ALIVE		(1)
+#define HTTP_CONNECTION_UPGRADE			(2)
+static const char* const CONNECTION_TOKEN_STRS[] PROGMEM = { // indexed by HTTP_CONNECTION_*
+	CLOSE_STR, KEEP_ALIVE_STR, UPGRADE_TOKEN_STR
+};
+static const uint8_t CONNECTION_TOKEN_CNT = 3;
+
+// tokens in the Upgrade header
+#define HTTP_UPGRADE_WEBSOCKET			(0)
+static const char* const UPGRADE_TOKEN_STRS[] PROGMEM = { // indexed by HTTP_UPGRADE_*
+	WEBSOCKET_STR
+};
+static const uint8_t UPGRADE_TOKEN_CNT = 1;
+
+// HttpConnection::connectionTokens has a bit for each token of each header. The Upgrade tokens follow the Connection tokens.
+#define CONNECTION_TOKEN_BIT(token)		_BV(token)
+#define UPGRADE_TOKEN_BIT(token)		_BV(CONNECTION_TOKEN_CNT + (token))
+
+// returns the candidates (a bitmask of indexes into table) that have the character c at the given position
+static uint8_t matchChar(const char* const* table, uint8_t count, uint8_t candidates, uint16_t position, char c, bool ignoreCase) {
+	for (uint8_t i = 0; i < count; i++) {
+		if (candidates & (1 << i)) {
+			// every candidate still in the running matched all of the previous characters, so position is within the string
+			char expected = pgm_read_byte(reinterpret_cast<const char*>(pgm_read_ptr(table + i)) + position);
+			if (ignoreCase ? tolower(expected) != tolower(c) : expected != c) {
+				candidates &= ~(1 << i);
+			}
 		}
-		str++;
 	}
-	return nullptr;
+	return candidates;
 }
 
-static char* strchrs_2(char* str, char c1, char c2) {
-	if (!str) {
-		return nullptr;
-	}
-	while (*str) {
-		if (*str == c1 || *str == c2) {
-			return str;
+// returns the index of the candidate that is exactly position characters long, or NO_MATCH if there isn't one
+static uint8_t matchEnd(const char* const* table, uint8_t count, uint8_t candidates, uint16_t position) {
+	for (uint8_t i = 0; i < count; i++) {
+		if ((candidates & (1 << i)) && !pgm_read_byte(reinterpret_cast<const char*>(pgm_read_ptr(table + i)) + position)) {
+			return i;
 		}
-		str++;
 	}
-	return nullptr;
+	return NO_MATCH;
 }
 
-// returns: TRUE to stop parsing and wait for more data to come in; FALSE to try serving the state machine again
-static bool parseClient_ReadingMethod(EthernetClient& client, HttpConnection& connection) {
-	// NOTE: the literal text of the HTTP method is not stored; only an HttpMethod enum. For parsing,
-	// the method is temporarily stored in the requestHeaders string, to save space.
+static inline bool isWhitespace(char c) {
+	return c == ' ' || c == '\t';
+}
 
-	// no data to read - try again later
-	if (!connection.leftovers && !client.available()) {
-		return true;
-	}
-	ssize_t bufferLen = HTTP_METHOD_MAX_LEN + 2 - connection.readPosition; // space for the worst-case string ("OPTIONS ") incl zero byte
-	if (bufferLen <= 1) { // need bufferLen > 1 so there is room for more data + null byte
-		connection.state = HTTPCLIENT_RCVD_BAD_METHOD;
-		return false;
+static void parseChar_Method(HttpConnection& connection, char c) {
+	if (!connection.position && (c == '\r' || c == '\n')) {
+		return; // ignore blank lines before the request line (e.g. an extra CRLF after the previous request's body)
 	}
-	size_t amountRead = read(client, connection, connection.requestHeaders + connection.readPosition, bufferLen);
-	// search for a whitespace character signifying end of this field
-	char* endPosn = strchrs_2(connection.requestHeaders + connection.readPosition, ' ', '\t');
-	if (endPosn) {
-		// Store anything after the field delimiter as leftovers to be parsed later
-		if (endPosn + 1 < connection.requestHeaders + connection.readPosition + amountRead) {
-			unread(connection, endPosn + 1, connection.requestHeaders + connection.readPosition + amountRead - (endPosn + 1));
-		}
-		*endPosn = '\0';
-		if (parseHttpMethod(connection.requestHeaders, connection.request.method)) {
-			connection.state = HTTPCLIENT_READING_URI;
+	if (isWhitespace(c)) {
+		uint8_t method = matchEnd(METHOD_STRS, METHOD_CNT, connection.candidates, connection.position);
+		if (method == NO_MATCH) {
+			connection.state = HTTPCLIENT_RCVD_BAD_METHOD;
 		}
 		else {
-			connection.state = HTTPCLIENT_RCVD_BAD_METHOD;
+			connection.request.method = static_cast<HttpMethod>(method);
+			connection.position = 0;
+			connection.state = HTTPCLIENT_READING_URI;
 		}
-		memset(connection.requestHeaders, 0, endPosn - connection.requestHeaders);
-		connection.readPosition = 0;
-		connection.parsePosition = 0;
+		return;
 	}
-	else {
-		connection.readPosition += amountRead;
+	connection.candidates = matchChar(METHOD_STRS, METHOD_CNT, connection.candidates, connection.position, c, false);
+	connection.position++;
+	if (!connection.candidates) {
+		connection.state = HTTPCLIENT_RCVD_BAD_METHOD;
 	}
-	return false;
 }
 
-// returns: TRUE to stop parsing and wait for more data to come in; FALSE to try serving the state machine again
-static bool parseClient_ReadingUri(EthernetClient& client, HttpConnection& connection) {
-	if (!connection.leftovers && !client.available()) {
-		return true; // wait for more data to come in
+static void parseChar_Uri(HttpConnection& connection, char c) {
+	if (isWhitespace(c)) {
+		if (connection.position) {
+			connection.requestUri[connection.position] = '\0';
+			connection.request.uriLength = connection.position;
+			connection.position = 0;
+			connection.candidates = ALL_CANDIDATES(VERSION_CNT);
+			connection.state = HTTPCLIENT_READING_VERSION;
+		}
+		// otherwise, skip the leading whitespace
+	}
+	else if (c == '\r' || c == '\n') {
+		connection.state = HTTPCLIENT_RCVD_BAD_VERSION; // no version (i.e. HTTP/0.9)
 	}
-	ssize_t bufferLen = sizeof(connection.requestUri) - connection.readPosition;
-	if (bufferLen <= 1) { // need bufferLen > 1 so there is room for more data + null byte
+	else if (connection.position + 1u >= sizeof(connection.requestUri)) { // need room for the zero byte
 		connection.state = HTTPCLIENT_RCVD_URI_TOO_LONG;
-		return false;
 	}
-	size_t amountRead = read(client, connection, connection.requestUri + connection.readPosition, bufferLen);
+	else {
+		connection.requestUri[connection.position++] = c;
+	}
+}
 
-	// check for leading whitespace and trim it if necessary
-	if (connection.readPosition == 0) {
-		unsigned int i;
-		for (i = 0; i < amountRead; i++) {
-			if (connection.requestUri[i] != ' ' && connection.requestUri[i] != '\t') {
-				break;
+// HttpConnection::position, once the field it counts the characters of has ended, and only whitespace may follow
+#define FIELD_ENDED						(0xFFFF)
+
+static void parseChar_Version(HttpConnection& connection, char c) {
+	if (c == '\r' || (isWhitespace(c) && (!connection.position || connection.position == FIELD_ENDED))) {
+		return; // whitespace around the version
+	}
+	if (connection.position == FIELD_ENDED && c != '\n') {
+		connection.state = HTTPCLIENT_RCVD_BAD_REQUEST_LINE; // e.g. "HTTP/ 1.1"
+		return;
+	}
+	if (isWhitespace(c) || c == '\n') {
+		if (connection.position != FIELD_ENDED) {
+			uint8_t version = matchEnd(VERSION_STRS, VERSION_CNT, connection.candidates, connection.position);
+			if (version == NO_MATCH) {
+				connection.state = isWhitespace(c) ? HTTPCLIENT_RCVD_BAD_REQUEST_LINE : HTTPCLIENT_RCVD_BAD_VERSION;
+				return;
 			}
+			connection.request.version = static_cast<HttpVersion>(version);
+			connection.position = FIELD_ENDED;
 		}
-		if (i != 0) {
-			copyInPlace(connection.requestUri, connection.requestUri + i, amountRead - i + /*zero byte*/ 1);
-			amountRead -= i;
-		}
-	}
-	// search for a whitespace character signifying end of this field
-	char* endPosn = strchrs_2(connection.requestUri + connection.readPosition, ' ', '\t');
-	if (endPosn) {
-		// Store anything after the field delimiter as leftovers to be parsed later
-		if (endPosn + 1 < connection.requestUri + connection.readPosition + amountRead) {
-			unread(connection, endPosn + 1, connection.requestUri + connection.readPosition + amountRead - (endPosn + 1));
+		if (c == '\n') {
+			// HTTP/1.1 connections are persistent by default; HTTP/1.0 connections are not (see the Connection header)
+			connection.request.keepAlive = connection.request.version == HttpVersion::Http_11;
+			connection.state = HTTPCLIENT_READING_HEADER_START;
 		}
-		*endPosn = 0;
-		connection.state = HTTPCLIENT_READING_VERSION;
-		connection.readPosition = 0;
-		connection.parsePosition = 0;
+		return;
 	}
-	else {
-		connection.readPosition += amountRead;
+	connection.candidates = matchChar(VERSION_STRS, VERSION_CNT, connection.candidates, connection.position, c, false);
+	connection.position++;
+	if (!connection.candidates) {
+		connection.state = HTTPCLIENT_RCVD_BAD_VERSION;
 	}
-	return false;
 }
 
-// returns: TRUE to stop parsing and wait for more data to come in; FALSE to try serving the state machine again
-static bool parseClient_ReadingVersion(EthernetClient& client, HttpConnection& connection) {
-	// NOTE: the literal text of the HTTP version is not stored; only an HttpVersion enum. For parsing,
-	// the version is temporarily stored in the requestBody string, to save space.
-	if (!connection.leftovers && !client.available()) {
-		return true; // wait for more data to come in
+// The Sec-WebSocket-Key is kept in requestBody, which isn't used until after the headers, just after the zero byte at the
+// start, so that a request with no body still has empty content
+static inline char* webSocketKey(HttpConnection& connection) {
+	return connection.requestBody + 1;
+}
+
+// called at the blank line that ends the headers
+static void endHeaders(HttpConnection& connection) {
+	if (connection.connectionTokens & CONNECTION_TOKEN_BIT(HTTP_CONNECTION_CLOSE)) {
+		connection.request.keepAlive = false;
 	}
-	ssize_t bufferLen = HTTP_VERSION_MAX_LEN + CRLF_STR_LEN + 1 - connection.readPosition; // space for the worst-case string ("HTTP/1.1\r\n") incl zero byte
-	if (bufferLen <= 1) { // need bufferLen > 1 so there is room for more data + null byte
-		connection.state = HTTPCLIENT_RCVD_BAD_VERSION;
-		return false;
+	else if (connection.connectionTokens & CONNECTION_TOKEN_BIT(HTTP_CONNECTION_KEEP_ALIVE)) {
+		connection.request.keepAlive = true;
 	}
-	size_t amountRead = read(client, connection, connection.requestBody + connection.readPosition, bufferLen);
+	// a body would overwrite the Sec-WebSocket-Key
+	connection.request.isWebSocketUpgrade = connection.request.method == HttpMethod::GET
+			&& connection.request.version == HttpVersion::Http_11
+			&& (connection.connectionTokens & CONNECTION_TOKEN_BIT(HTTP_CONNECTION_UPGRADE))
+			&& (connection.connectionTokens & UPGRADE_TOKEN_BIT(HTTP_UPGRADE_WEBSOCKET))
+			&& strlen(webSocketKey(connection)) == WEBSOCKET_KEY_SIZE && !connection.request.contentLength;
 
-	// check for leading whitespace and trim it if necessary
-	if (connection.readPosition == 0) {
-		unsigned int i;
-		for (i = 0; i < amountRead; i++) {
-			if (connection.requestBody[i] != ' ' && connection.requestBody[i] != '\t') {
-				break;
-			}
-		}
-		if (i != 0) {
-			copyInPlace(connection.requestBody, connection.requestBody + i, amountRead - i + /*also copy zero byte*/ 1);
-			amountRead -= i;
-		}
+	if (connection.request.contentLength + 1 > sizeof(connection.requestBody)) { // need room for the zero byte
+		connection.state = HTTPCLIENT_RCVD_BODY_TOO_LONG;
 	}
-	// search for a whitespace character signifying end of text
-	char* endPosn = strstr_P(connection.requestBody + connection.readPosition, CRLF_STR);
-	if (endPosn) {
-		// Store anything after the field delimiter as leftovers to be parsed later
-		if (endPosn + CRLF_STR_LEN < connection.requestBody + connection.readPosition + amountRead) {
-			unread(connection, endPosn + CRLF_STR_LEN, connection.requestBody + connection.readPosition + amountRead - (endPosn + CRLF_STR_LEN));
-		}
-		memset(endPosn, 0, CRLF_STR_LEN);
-		if (parseHttpVersion(connection.requestBody, connection.request.version)) {
-			connection.state = HTTPCLIENT_READING_HEADER_START;
-		}
-		else {
-			connection.state = HTTPCLIENT_RCVD_BAD_VERSION;
-		}
-		memset(connection.requestBody, 0, endPosn - connection.requestBody);
-		connection.readPosition = 0;
-		connection.parsePosition = 0;
+	else if (connection.request.contentLength) {
+		connection.position = 0;
+		connection.state = HTTPCLIENT_READING_BODY;
 	}
 	else {
-		connection.readPosition += amountRead;
+		connection.state = HTTPCLIENT_RCVD_REQUEST;
 	}
-	return false;
 }
 
-// returns: TRUE to stop parsing and wait for more data to come in; FALSE to try serving the state machine again
-static bool parseClient_ReadingHeaderStart(EthernetClient& client, HttpConnection& connection) {
-	if (connection.readPosition - connection.parsePosition < 2) {
-		if (!connection.leftovers && !client.available()) {
-			return true;
-		}
-		// we have to read ahead more before we can tell whether this is an actual header or a blank line
-		ssize_t bufferLen = sizeof(connection.requestHeaders) - connection.readPosition;
-		if (bufferLen <= 1) {
-			connection.state = HTTPCLIENT_RCVD_HDRS_TOO_LONG;
-		}
-		else {
-			connection.readPosition += read(client, connection, connection.requestHeaders + connection.readPosition, bufferLen);
-		}
+static void parseChar_HeaderStart(HttpConnection& connection, char c) {
+	if (c == '\r') {
+		return;
 	}
-	else {
-		if (!strncmp_P(connection.requestHeaders + connection.parsePosition, CRLF_STR, CRLF_STR_LEN)) {
-			// end of header section
-
-			// Store anything after the field delimiter as leftovers to be parsed later
-			if (connection.parsePosition + CRLF_STR_LEN < connection.readPosition) {
-				unread(connection, connection.requestHeaders + connection.parsePosition + CRLF_STR_LEN,
-						connection.requestHeaders + connection.readPosition - (connection.requestHeaders + connection.parsePosition + CRLF_STR_LEN));
-			}
-
-			connection.readPosition = 0;
-			connection.parsePosition = 0;
-			connection.state = HTTPCLIENT_READING_BODY;
-		}
-		else if (connection.request.numHeaders == HTTP_HEADER_CNT) {
-			connection.state = HTTPCLIENT_RCVD_HDRS_TOO_LONG;
-		}
-		else {
-			// we're looking at the start of a valid header.
-			connection.request.headers[connection.request.numHeaders].key = connection.requestHeaders + connection.parsePosition;
-			connection.request.numHeaders++;
-			connection.state = HTTPCLIENT_READING_HEADER_KEY;
-		}
+	if (c == '\n') {
+		endHeaders(connection);
+		return;
 	}
-	return false;
+	connection.position = 0;
+	connection.candidates = ALL_CANDIDATES(HEADER_CNT);
+	connection.state = HTTPCLIENT_READING_HEADER_KEY;
 }
 
-// returns: TRUE to stop parsing and wait for more data to come in; FALSE to try serving the state machine again
-static bool parseClient_ReadingHeaderKey(EthernetClient& client, HttpConnection& connection) {
-	if (connection.parsePosition == connection.readPosition) {
-		if (!connection.leftovers && !client.available()) {
-			return true; // need to wait for more data to come through
-		}
-		else {
-			ssize_t bufferLen = sizeof(connection.requestHeaders) - connection.readPosition;
-			if (bufferLen <= 1) {
-				connection.state = HTTPCLIENT_RCVD_HDRS_TOO_LONG;
-			}
-			else {
-				connection.readPosition += read(client, connection, connection.requestHeaders + connection.readPosition, bufferLen);
-			}
+static void parseChar_HeaderKey(HttpConnection& connection, char c) {
+	if (c == ':') {
+		connection.field = matchEnd(HEADER_STRS, HEADER_CNT, connection.candidates, connection.position);
+		if (connection.field == HTTP_HEADER_CONTENT_LENGTH) {
+			connection.request.contentLength = 0;
 		}
+		connection.position = 0;
+		connection.candidates = connection.field == HTTP_HEADER_UPGRADE ? ALL_CANDIDATES(UPGRADE_TOKEN_CNT) : ALL_CANDIDATES(CONNECTION_TOKEN_CNT);
+		connection.state = HTTPCLIENT_READING_HEADER_VALUE;
+	}
+	else if (c == '\n') {
+		connection.state = HTTPCLIENT_READING_HEADER_START; // not a valid header (no colon) - ignore it
 	}
 	else {
-		char* endPosn = strchr(connection.requestHeaders + connection.parsePosition, ':');
-		if (endPosn) {
-			connection.request.headers[connection.request.numHeaders - 1].keyLen = endPosn - connection.request.headers[connection.request.numHeaders - 1].key;
-			connection.parsePosition = endPosn - connection.requestHeaders + 1;
-			connection.state = HTTPCLIENT_READING_HEADER_VALUE;
-		}
-		else {
-			connection.parsePosition = connection.readPosition;
-		}
+		connection.candidates = matchChar(HEADER_STRS, HEADER_CNT, connection.candidates, connection.position, c, true);
+		connection.position++;
 	}
-	return false;
 }
 
-// returns: TRUE to stop parsing and wait for more data to come in; FALSE to try serving the state machine again
-static bool parseClient_ReadingHeaderValue(EthernetClient& client, HttpConnection& connection) {
-	if (connection.parsePosition == connection.readPosition) {
-		if (!connection.leftovers && !client.available()) {
-			return true; // need to wait for more data
-		}
-		else {
-			ssize_t bufferLen = sizeof(connection.requestHeaders) - connection.readPosition;
-			if (bufferLen <= 1) {
-				connection.state = HTTPCLIENT_RCVD_HDRS_TOO_LONG;
-			}
-			else {
-				connection.readPosition += read(client, connection, connection.requestHeaders + connection.readPosition, bufferLen);
-			}
-		}
+static void parseChar_HeaderValue(HttpConnection& connection, char c) {
+	if (c == '\r') {
+		return;
 	}
-	else {
-		HttpHeader* currentHeader = &connection.request.headers[connection.request.numHeaders - 1];
-		if (!currentHeader->value) {
-			unsigned int i;
-			// haven't found the start of the literal value yet. Scan ahead until you find a non-whitespace character
-			for (i = connection.parsePosition; i < connection.readPosition; i++) {
-				if (connection.requestHeaders[i] != ' ' && connection.requestHeaders[i] != '\t') {
-					currentHeader->value = connection.requestHeaders + i;
-					break;
+	switch (connection.field) {
+		case HTTP_HEADER_CONTENT_LENGTH:
+			// One or more digits, with optional whitespace around them. position counts the digits, and is set to
+			// FIELD_ENDED by the whitespace after them, so "1 2" isn't read as 12.
+			if (c >= '0' && c <= '9' && connection.position != FIELD_ENDED) {
+				connection.request.contentLength = connection.request.contentLength * 10 + (c - '0');
+				if (connection.request.contentLength > sizeof(connection.requestBody)) {
+					connection.request.contentLength = sizeof(connection.requestBody); // too long either way - don't overflow
 				}
+				connection.position++;
 			}
-			connection.parsePosition = i;
-		}
-		else {
-			char* endPosn = strstr_P(connection.requestHeaders + connection.parsePosition, CRLF_STR);
-			if (endPosn) {
-				currentHeader->valueLen = endPosn - currentHeader->value;
-				if (!strncasecmp_P(currentHeader->key, CONTENT_LENGTH_STR, currentHeader->keyLen)) {
-					char tmp = currentHeader->value[currentHeader->valueLen];
-					currentHeader->value[currentHeader->valueLen] = '\0';
-					//TODO: this does bad things if the content-length is not an integer
-					connection.request.contentLength = atoi(currentHeader->value);
-					currentHeader->value[currentHeader->valueLen] = tmp;
+			else if (isWhitespace(c)) {
+				if (connection.position) {
+					connection.position = FIELD_ENDED;
 				}
-				connection.parsePosition = endPosn + CRLF_STR_LEN - connection.requestHeaders;
-				connection.state = HTTPCLIENT_READING_HEADER_START;
 			}
-			else {
-				connection.parsePosition = connection.readPosition;
+			else if (c != '\n' || !connection.position) { // an empty Content-Length is invalid too
+				connection.state = HTTPCLIENT_RCVD_BAD_REQUEST;
+				return;
+			}
+			break;
+		case HTTP_HEADER_CONNECTION:
+		case HTTP_HEADER_UPGRADE: {
+			// a comma-separated list of tokens. Ignores case. Each header is matched against its own tokens, so
+			// "Connection: websocket" doesn't count as "Upgrade: websocket".
+			bool isUpgrade = connection.field == HTTP_HEADER_UPGRADE;
+			const char* const* tokenStrs = isUpgrade ? UPGRADE_TOKEN_STRS : CONNECTION_TOKEN_STRS;
+			uint8_t tokenCnt = isUpgrade ? UPGRADE_TOKEN_CNT : CONNECTION_TOKEN_CNT;
+			if (isWhitespace(c) || c == ',' || c == '\n') {
+				if (connection.position) {
+					uint8_t token = matchEnd(tokenStrs, tokenCnt, connection.candidates, connection.position);
+					if (token != NO_MATCH) {
+						connection.connectionTokens |= isUpgrade ? UPGRADE_TOKEN_BIT(token) : CONNECTION_TOKEN_BIT(token);
+					}
+					connection.position = 0;
+					connection.candidates = ALL_CANDIDATES(tokenCnt);
+				}
 			}
+			else if (connection.candidates) {
+				connection.candidates = matchChar(tokenStrs, tokenCnt, connection.candidates, connection.position, c, true);
+				connection.position++;
+			}
+			break;
 		}
+		case HTTP_HEADER_SEC_WEBSOCKET_KEY:
+			// Any key that isn't WEBSOCKET_KEY_SIZE characters long is invalid, so a longer one is cleared
+			if (!isWhitespace(c) && c != '\n') {
+				if (connection.position < WEBSOCKET_KEY_SIZE) {
+					webSocketKey(connection)[connection.position] = c;
+					webSocketKey(connection)[connection.position + 1] = '\0';
+				}
+				else {
+					*webSocketKey(connection) = '\0';
+				}
+				connection.position++;
+			}
+			break;
+		default:
+			break; // we don't care about any other headers
+	}
+	if (c == '\n') {
+		connection.state = HTTPCLIENT_READING_HEADER_START;
 	}
-	return false;
 }
 
-// returns: TRUE to stop parsing and wait for more data to come in; FALSE to try serving the state machine again
-static bool parseClient_ReadingBody(EthernetClient& client, HttpConnection& connection) {
-	if (connection.readPosition >= connection.request.contentLength) {
-		connection.state = HTTPCLIENT_RCVD_REQUEST;
-		return false;
+// Reads as much of the body (request.contentLength bytes, into requestBody) as has arrived. Used for request bodies, and
+// for the payloads of WebSocket frames.
+// returns: FALSE to stop parsing and wait for more data to come in; TRUE to try serving the state machine again
+static bool readBody(EthernetClient& client, HttpConnection& connection) {
+	size_t remaining = connection.request.contentLength - connection.position;
+	uint8_t buffered = connection.inputEnd - connection.inputStart;
+	if (buffered) {
+		// the start of the body was read into the input buffer along with the end of the headers
+		uint8_t amount = buffered < remaining ? buffered : remaining;
+		memcpy(connection.requestBody + connection.position, connection.input + connection.inputStart, amount);
+		connection.inputStart += amount;
+		connection.position += amount;
 	}
-	else if (!connection.leftovers && !client.available()) {
-		return true;
+	else if (client.available()) {
+		// read the rest straight from the socket into requestBody. Never reads past the end of the body, so the next
+		// (pipelined) request stays in the socket until it's parsed.
+		int amount = client.read(reinterpret_cast<uint8_t*>(connection.requestBody + connection.position), remaining);
+		if (amount > 0) {
+			connection.position += amount;
+		}
 	}
-	else if (connection.request.contentLength + 1 > sizeof(connection.requestBody)) {
-		connection.state = HTTPCLIENT_RCVD_BODY_TOO_LONG;
+	else {
 		return false;
 	}
-	else {
-		ssize_t bufferLen = connection.request.contentLength + 1 - connection.readPosition;
-		connection.readPosition += read(client, connection, connection.requestBody + connection.readPosition, bufferLen);
+	return true;
+}
+
+// Returns the next byte of input, from the connection's input buffer, refilling it from the socket if need be; or -1 if
+// no more data has arrived
+static int readInput(EthernetClient& client, HttpConnection& connection) {
+	if (connection.inputStart == connection.inputEnd) {
+		if (!client.available()) {
+			return -1; // wait for more data to come in
+		}
+		int amount = client.read(reinterpret_cast<uint8_t*>(connection.input), sizeof(connection.input));
+		if (amount <= 0) {
+			return -1;
+		}
+		connection.inputStart = 0;
+		connection.inputEnd = amount;
 	}
-	return false;
+	return static_cast<uint8_t>(connection.input[connection.inputStart++]);
 }
 
-//TODO: because of the way that we search for \r\n, if \r and \n come in in separate packets, we won't see it.
+// Parses as much of the request as has arrived. Everything up to the body is read from the socket a few bytes at a time,
+// into the connection's small input buffer, and parsed one character at a time, so only the fields the server needs are
+// stored: the method, URI, and version, and the Content-Length and Connection headers. The body is read straight from the
+// socket into requestBody. Anything left in the input buffer after the request ends is the start of the client's next
+// (pipelined) request, which is parsed after this one has been answered.
 static void parseRequest(EthernetClient& client, HttpConnection& connection) {
-	bool triggerReturn = false;
-	while (!triggerReturn) {
-		if (!(connection.state & HTTPCLIENT_STATUS_READING)) {
+	while (connection.state & HTTPCLIENT_STATUS_READING) {
+		if (connection.state == HTTPCLIENT_READING_BODY) {
+			if (!readBody(client, connection)) {
+				return;
+			}
+			if (connection.position == connection.request.contentLength) {
+				connection.requestBody[connection.position] = '\0';
+				connection.state = HTTPCLIENT_RCVD_REQUEST;
+			}
+			continue;
+		}
+
+		int input = readInput(client, connection);
+		if (input < 0) {
 			return;
 		}
+		char c = input;
+
 		switch (connection.state) {
 			case HTTPCLIENT_READING_METHOD:
-				triggerReturn = parseClient_ReadingMethod(client, connection);
+				parseChar_Method(connection, c);
 				break;
 
-			case HTTPCLIENT_READING_VERSION:
-				triggerReturn = parseClient_ReadingVersion(client, connection);
+			case HTTPCLIENT_READING_URI:
+				parseChar_Uri(connection, c);
 				break;
 
-			case HTTPCLIENT_READING_URI:
-				triggerReturn = parseClient_ReadingUri(client, connection);
+			case HTTPCLIENT_READING_VERSION:
+				parseChar_Version(connection, c);
 				break;
 
 			case HTTPCLIENT_READING_HEADER_START:
-				triggerReturn = parseClient_ReadingHeaderStart(client, connection);
+				parseChar_HeaderStart(connection, c);
+				if (connection.state == HTTPCLIENT_READING_HEADER_KEY) {
+					parseChar_HeaderKey(connection, c); // c is the first character of the header name
+				}
 				break;
 
 			case HTTPCLIENT_READING_HEADER_KEY:
-				triggerReturn = parseClient_ReadingHeaderKey(client, connection);
+				parseChar_HeaderKey(connection, c);
 				break;
 
 			case HTTPCLIENT_READING_HEADER_VALUE:
-				triggerReturn = parseClient_ReadingHeaderValue(client, connection);
+				parseChar_HeaderValue(connection, c);
 				break;
+		}
 
-			case HTTPCLIENT_READING_BODY:
-				triggerReturn = parseClient_ReadingBody(client, connection);
-				break;
+		if (connection.state >= HTTPCLIENT_READING_HEADER_KEY && connection.state <= HTTPCLIENT_READING_HEADER_VALUE
+				&& ++connection.headersLength > HTTP_INCOMING_REQUEST_HEADERS_SIZE) {
+			connection.state = HTTPCLIENT_RCVD_HDRS_TOO_LONG;
 		}
 	}
 }
 
-// TODO:
-// 1. It looks like EthernetClient's write() function has a busy loop
-//    while it waits for the Wiznet shield's buffer to clear out. Might need
-//    to use EthernetClient::availableForWrite() to poll for when hardware
-//    is ready. (Of course, this can only occur under heavy load - if we
-//    can't receive/process/respond to requests fast enough to catch up to
-//    the Wiznet buffer, this own't be an issue).
-//      - Making this change could lead to buffer corruption in the API if
-//        multiple requests are being handled simultaneously. Would probably
-//        have to add a guarantee that no request will be processed before
-//        the response to the previous request has been sent.
-// 2. Writes over 2k (the buffer size of the Wiznet) are silently truncated
-//    by EthernetClient::write_P. This could eventually break things if we
-//    try and send an entire HTML webpage all at once.
-static void writeResponse(EthernetClient& client, HttpResponse& response) {
-	switch (response.version) {
-		case HttpVersion::Http_10:
-			client.write_P(PSTR_AND_LEN("HTTP/1.0 "));
-			break;
-		default:
-			client.write_P(PSTR_AND_LEN("HTTP/1.1 "));
+// Stops reading from a WebSocket connection, and closes it with the given status code (see WebSocket.h), which is kept in
+// the response until the close frame is sent
+static void closeWebSocket(HttpConnection& connection, uint16_t status) {
+	connection.response.responseCode = status;
+	connection.state = HTTPCLIENT_WS_CLOSING;
+}
+
+// Returns the length of a client's frame header, given its second byte: 2 bytes, then the extended payload length, if
+// any, and the 4-byte mask
+static inline uint8_t frameHeaderLength(uint8_t lengthByte) {
+	uint8_t length = lengthByte & 0x7F;
+	return 2 + (length == 126 ? 2 : length == 127 ? 8 : 0) + 4;
+}
+
+// Parses as much of the client's next WebSocket frame as has arrived. Frames are parsed much like requests: the header a
+// byte at a time, into requestUri (which isn't needed until a message has arrived), and the payload straight into
+// requestBody. field holds the first byte of the header, with the FIN bit and the opcode.
+static void parseFrame(EthernetClient& client, HttpConnection& connection) {
+	uint8_t* header = reinterpret_cast<uint8_t*>(connection.requestUri);
+	while (connection.state == HTTPCLIENT_WS_READING_HEADER) {
+		int input = readInput(client, connection);
+		if (input < 0) {
+			return;
+		}
+		header[connection.position++] = input;
+		if (connection.position == 2) {
+			uint8_t opcode = header[0] & 0x0F;
+			bool fin = header[0] & 0x80;
+			uint8_t length = header[1] & 0x7F;
+			if ((header[0] & 0x70) || !(header[1] & 0x80)) {
+				closeWebSocket(connection, WEBSOCKET_CLOSE_PROTOCOL_ERROR); // reserved bits are set, or it isn't masked
+			}
+			else if (opcode >= WEBSOCKET_OPCODE_CLOSE ? !fin || length > 125 : opcode > WEBSOCKET_OPCODE_BINARY) {
+				closeWebSocket(connection, WEBSOCKET_CLOSE_PROTOCOL_ERROR); // a fragmented or long control frame, or an unknown opcode
+			}
+			else if (opcode == WEBSOCKET_OPCODE_CONTINUATION || opcode == WEBSOCKET_OPCODE_BINARY || !fin) {
+				closeWebSocket(connection, WEBSOCKET_CLOSE_UNSUPPORTED_DATA); // only single-frame text messages are supported
+			}
+			else if (length == 127) {
+				closeWebSocket(connection, WEBSOCKET_CLOSE_MESSAGE_TOO_BIG);
+			}
+		}
+		else if (connection.position > 2 && connection.position == frameHeaderLength(header[1])) {
+			uint8_t length = header[1] & 0x7F;
+			connection.request.contentLength = length == 126 ? (static_cast<uint16_t>(header[2]) << 8) | header[3] : length;
+			if (connection.request.contentLength + 1 > sizeof(connection.requestBody)) { // need room for the zero byte
+				closeWebSocket(connection, WEBSOCKET_CLOSE_MESSAGE_TOO_BIG);
+				return;
+			}
+			connection.field = header[0];
+			connection.position = 0;
+			connection.state = HTTPCLIENT_WS_READING_PAYLOAD;
+		}
+	}
+	if (connection.state != HTTPCLIENT_WS_READING_PAYLOAD) {
+		return;
+	}
+	while (connection.position < connection.request.contentLength) {
+		if (!readBody(client, connection)) {
+			return;
+		}
 	}
 
-	switch (response.responseCode) {
-		case 100:
-			client.write_P(PSTR_AND_LEN("100 Continue\r\n"));
-			break;
-		case 101:
-			client.write_P(PSTR_AND_LEN("101 Switching Protocols\r\n"));
-			break;
-		case 102:
-			client.write_P(PSTR_AND_LEN("102 Processing\r\n"));
-			break;
-		case 103:
-			client.write_P(PSTR_AND_LEN("103 Early Hints\r\n"));
-			break;
-		case 200:
-			client.write_P(PSTR_AND_LEN("200 OK\r\n"));
-			break;
-		case 201:
-			client.write_P(PSTR_AND_LEN("201 Created\r\n"));
-			break;
-		case 202:
-			client.write_P(PSTR_AND_LEN("202 Accepted\r\n"));
-			break;
-		case 203:
-			client.write_P(PSTR_AND_LEN("203 Non-Authoritative Information\r\n"));
-			break;
-		case 204:
-			client.write_P(PSTR_AND_LEN("204 No Content\r\n"));
-			break;
-		case 205:
-			client.write_P(PSTR_AND_LEN("205 Reset Content\r\n"));
-			break;
-		case 206:
-			client.write_P(PSTR_AND_LEN("206 Partial Content\r\n"));
-			break;
-		case 207:
-			client.write_P(PSTR_AND_LEN("207 Multi-Status\r\n"));
-			break;
-		case 208:
-			client.write_P(PSTR_AND_LEN("208 Already Reported\r\n"));
-			break;
-		case 226:
-			client.write_P(PSTR_AND_LEN("204 IM Used\r\n"));
-			break;
-		case 300:
-			client.write_P(PSTR_AND_LEN("300 Multiple Choices\r\n"));
-			break;
-		case 301:
-			client.write_P(PSTR_AND_LEN("301 Moved Permanently\r\n"));
-			break;
-		case 302:
-			client.write_P(PSTR_AND_LEN("302 Found\r\n"));
-			break;
-		case 303:
-			client.write_P(PSTR_AND_LEN("303 See Other\r\n"));
-			break;
-		case 304:
-			client.write_P(PSTR_AND_LEN("304 Not Modified\r\n"));
-			break;
-		case 305:
-			client.write_P(PSTR_AND_LEN("305 Use Proxy\r\n"));
-			break;
-		case 306:
-			client.write_P(PSTR_AND_LEN("306 Switch Proxy\r\n"));
-			break;
-		case 307:
-			client.write_P(PSTR_AND_LEN("307 Temporary Redirect\r\n"));
-			break;
-		case 308:
-			client.write_P(PSTR_AND_LEN("308 Permanent Redirect\r\n"));
-			break;
-		case 400:
-			client.write_P(PSTR_AND_LEN("400 Bad Request\r\n"));
-			break;
-		case 401:
-			client.write_P(PSTR_AND_LEN("401 Unauthorized\r\n"));
-			break;
-		case 402:
-			client.write_P(PSTR_AND_LEN("402 Payment Required\r\n"));
-			break;
-		case 403:
-			client.write_P(PSTR_AND_LEN("403 Forbidden\r\n"));
-			break;
-		case 404:
-			client.write_P(PSTR_AND_LEN("404 Not Found\r\n"));
-			break;
-		case 405:
-			client.write_P(PSTR_AND_LEN("405 Method Not Allowed\r\n"));
-			break;
-		case 406:
-			client.write_P(PSTR_AND_LEN("406 Not Acceptable\r\n"));
-			break;
-		case 407:
-			client.write_P(PSTR_AND_LEN("407 Proxy Authentication Required\r\n"));
-			break;
-		case 408:
-			client.write_P(PSTR_AND_LEN("408 Request Timeout\r\n"));
-			break;
-		case 409:
-			client.write_P(PSTR_AND_LEN("409 Conflict\r\n"));
-			break;
-		case 410:
-			client.write_P(PSTR_AND_LEN("410 Gone\r\n"));
-			break;
-		case 411:
-			client.write_P(PSTR_AND_LEN("411 Length Required\r\n"));
-			break;
-		case 412:
-			client.write_P(PSTR_AND_LEN("412 Precondition Failed\r\n"));
-			break;
-		case 413:
-			client.write_P(PSTR_AND_LEN("413 Payload Too Large\r\n"));
-			break;
-		case 414:
-			client.write_P(PSTR_AND_LEN("414 URI Too Long\r\n"));
-			break;
-		case 415:
-			client.write_P(PSTR_AND_LEN("415 Unsupported Media Type\r\n"));
-			break;
-		case 416:
-			client.write_P(PSTR_AND_LEN("416 Range Not Satisfiable\r\n"));
-			break;
-		case 417:
-			client.write_P(PSTR_AND_LEN("417 Expectation Failed\r\n"));
-			break;
-		case 418:
-			client.write_P(PSTR_AND_LEN("418 I'm a teapot\r\n"));
-			break;
-		case 421:
-			client.write_P(PSTR_AND_LEN("421 Misdirected Request\r\n"));
-			break;
-		case 422:
-			client.write_P(PSTR_AND_LEN("422 Unprocessable Entity\r\n"));
-			break;
-		case 423:
-			client.write_P(PSTR_AND_LEN("423 Locked\r\n"));
-			break;
-		case 424:
-			client.write_P(PSTR_AND_LEN("424 Failed Dependency\r\n"));
-			break;
-		case 425:
-			client.write_P(PSTR_AND_LEN("425 Too Early\r\n"));
-			break;
-		case 426:
-			client.write_P(PSTR_AND_LEN("426 Upgrade Required\r\n"));
-			break;
-		case 428:
-			client.write_P(PSTR_AND_LEN("428 Precondition Required\r\n"));
-			break;
-		case 429:
-			client.write_P(PSTR_AND_LEN("429 Too Many Requests\r\n"));
-			break;
-		case 431:
-			client.write_P(PSTR_AND_LEN("431 Request Header Fields Too Large\r\n"));
-			break;
-		case 451:
-			client.write_P(PSTR_AND_LEN("451 Unavailable For Legal Reasons\r\n"));
-			break;
-		case 500:
-			client.write_P(PSTR_AND_LEN("500 Internal Server Error\r\n"));
-			break;
-		case 501:
-			client.write_P(PSTR_AND_LEN("501 Not Implemented\r\n"));
-			break;
-		case 502:
-			client.write_P(PSTR_AND_LEN("502 Bad Gateway\r\n"));
-			break;
-		case 503:
-			client.write_P(PSTR_AND_LEN("503 Service Unavailable\r\n"));
-			break;
-		case 504:
-			client.write_P(PSTR_AND_LEN("504 Gateway Timeout\r\n"));
-			break;
-		case 505:
-			client.write_P(PSTR_AND_LEN("505 HTTP Version Not Supported\r\n"));
+	// the whole frame has arrived - unmask it
+	const uint8_t* mask = header + frameHeaderLength(header[1]) - 4;
+	for (uint16_t i = 0; i < connection.request.contentLength; i++) {
+		connection.requestBody[i] ^= mask[i & 3];
+	}
+	connection.requestBody[connection.request.contentLength] = '\0';
+	switch (connection.field & 0x0F) {
+		case WEBSOCKET_OPCODE_TEXT:
+			connection.state = HTTPCLIENT_WS_RCVD_MESSAGE;
 			break;
-		case 506:
-			client.write_P(PSTR_AND_LEN("506 Variant Also Negotiates\r\n"));
+		case WEBSOCKET_OPCODE_PING:
+			connection.state = HTTPCLIENT_WS_RCVD_PING;
 			break;
-		case 507:
-			client.write_P(PSTR_AND_LEN("507 Insufficient Storage\r\n"));
+		case WEBSOCKET_OPCODE_PONG:
+			connection.position = 0; // nothing to do - on to the next frame
+			connection.state = HTTPCLIENT_WS_READING_HEADER;
 			break;
-		case 508:
-			client.write_P(PSTR_AND_LEN("508 Loop Detected\r\n"));
+		case WEBSOCKET_OPCODE_CLOSE:
+			closeWebSocket(connection, WEBSOCKET_CLOSE_NORMAL); // the client is closing the connection - answer in kind
 			break;
-		case 510:
-			client.write_P(PSTR_AND_LEN("510 Not Extended\r\n"));
+		default:
+			assert(0); // the header was validated above
 			break;
-		case 511:
-			client.write_P(PSTR_AND_LEN("511 Network Authentication Required\r\n"));
+	}
+}
+
+// Status lines, e.g. "404 Not Found\r\n", for writeResponse(). Kept in a PROGMEM table, sorted by code.
+#define MAKE_STATUS_LINE(code, reason)	static const char STATUS_##code##_STR[] PROGMEM = #code " " reason "\r\n"
+#define STATUS_METADATA(code)			{ code, STATUS_##code##_STR }
+
+MAKE_STATUS_LINE(100, "Continue");
+MAKE_STATUS_LINE(101, "Switching Protocols");
+MAKE_STATUS_LINE(102, "Processing");
+MAKE_STATUS_LINE(103, "Early Hints");
+MAKE_STATUS_LINE(200, "OK");
+MAKE_STATUS_LINE(201, "Created");
+MAKE_STATUS_LINE(202, "Accepted");
+MAKE_STATUS_LINE(203, "Non-Authoritative Information");
+MAKE_STATUS_LINE(204, "No Content");
+MAKE_STATUS_LINE(205, "Reset Content");
+MAKE_STATUS_LINE(206, "Partial Content");
+MAKE_STATUS_LINE(207, "Multi-Status");
+MAKE_STATUS_LINE(208, "Already Reported");
+MAKE_STATUS_LINE(226, "IM Used");
+MAKE_STATUS_LINE(300, "Multiple Choices");
+MAKE_STATUS_LINE(301, "Moved Permanently");
+MAKE_STATUS_LINE(302, "Found");
+MAKE_STATUS_LINE(303, "See Other");
+MAKE_STATUS_LINE(304, "Not Modified");
+MAKE_STATUS_LINE(305, "Use Proxy");
+MAKE_STATUS_LINE(306, "Switch Proxy");
+MAKE_STATUS_LINE(307, "Temporary Redirect");
+MAKE_STATUS_LINE(308, "Permanent Redirect");
+MAKE_STATUS_LINE(400, "Bad Request");
+MAKE_STATUS_LINE(401, "Unauthorized");
+MAKE_STATUS_LINE(402, "Payment Required");
+MAKE_STATUS_LINE(403, "Forbidden");
+MAKE_STATUS_LINE(404, "Not Found");
+MAKE_STATUS_LINE(405, "Method Not Allowed");
+MAKE_STATUS_LINE(406, "Not Acceptable");
+MAKE_STATUS_LINE(407, "Proxy Authentication Required");
+MAKE_STATUS_LINE(408, "Request Timeout");
+MAKE_STATUS_LINE(409, "Conflict");
+MAKE_STATUS_LINE(410, "Gone");
+MAKE_STATUS_LINE(411, "Length Required");
+MAKE_STATUS_LINE(412, "Precondition Failed");
+MAKE_STATUS_LINE(413, "Payload Too Large");
+MAKE_STATUS_LINE(414, "URI Too Long");
+MAKE_STATUS_LINE(415, "Unsupported Media Type");
+MAKE_STATUS_LINE(416, "Range Not Satisfiable");
+MAKE_STATUS_LINE(417, "Expectation Failed");
+MAKE_STATUS_LINE(418, "I'm a teapot");
+MAKE_STATUS_LINE(421, "Misdirected Request");
+MAKE_STATUS_LINE(422, "Unprocessable Entity");
+MAKE_STATUS_LINE(423, "Locked");
+MAKE_STATUS_LINE(424, "Failed Dependency");
+MAKE_STATUS_LINE(425, "Too Early");
+MAKE_STATUS_LINE(426, "Upgrade Required");
+MAKE_STATUS_LINE(428, "Precondition Required");
+MAKE_STATUS_LINE(429, "Too Many Requests");
+MAKE_STATUS_LINE(431, "Request Header Fields Too Large");
+MAKE_STATUS_LINE(451, "Unavailable For Legal Reasons");
+MAKE_STATUS_LINE(500, "Internal Server Error");
+MAKE_STATUS_LINE(501, "Not Implemented");
+MAKE_STATUS_LINE(502, "Bad Gateway");
+MAKE_STATUS_LINE(503, "Service Unavailable");
+MAKE_STATUS_LINE(504, "Gateway Timeout");
+MAKE_STATUS_LINE(505, "HTTP Version Not Supported");
+MAKE_STATUS_LINE(506, "Variant Also Negotiates");
+MAKE_STATUS_LINE(507, "Insufficient Storage");
+MAKE_STATUS_LINE(508, "Loop Detected");
+MAKE_STATUS_LINE(510, "Not Extended");
+MAKE_STATUS_LINE(511, "Network Authentication Required");
+
+static const struct {
+	uint16_t code;
+	const char* line; // PROGMEM
+} statusLines[] PROGMEM = {
+	STATUS_METADATA(100), STATUS_METADATA(101), STATUS_METADATA(102), STATUS_METADATA(103),
+	STATUS_METADATA(200), STATUS_METADATA(201), STATUS_METADATA(202), STATUS_METADATA(203), STATUS_METADATA(204),
+	STATUS_METADATA(205), STATUS_METADATA(206), STATUS_METADATA(207), STATUS_METADATA(208), STATUS_METADATA(226),
+	STATUS_METADATA(300), STATUS_METADATA(301), STATUS_METADATA(302), STATUS_METADATA(303), STATUS_METADATA(304),
+	STATUS_METADATA(305), STATUS_METADATA(306), STATUS_METADATA(307), STATUS_METADATA(308),
+	STATUS_METADATA(400), STATUS_METADATA(401), STATUS_METADATA(402), STATUS_METADATA(403), STATUS_METADATA(404),
+	STATUS_METADATA(405), STATUS_METADATA(406), STATUS_METADATA(407), STATUS_METADATA(408), STATUS_METADATA(409),
+	STATUS_METADATA(410), STATUS_METADATA(411), STATUS_METADATA(412), STATUS_METADATA(413), STATUS_METADATA(414),
+	STATUS_METADATA(415), STATUS_METADATA(416), STATUS_METADATA(417), STATUS_METADATA(418), STATUS_METADATA(421),
+	STATUS_METADATA(422), STATUS_METADATA(423), STATUS_METADATA(424), STATUS_METADATA(425), STATUS_METADATA(426),
+	STATUS_METADATA(428), STATUS_METADATA(429), STATUS_METADATA(431), STATUS_METADATA(451),
+	STATUS_METADATA(500), STATUS_METADATA(501), STATUS_METADATA(502), STATUS_METADATA(503), STATUS_METADATA(504),
+	STATUS_METADATA(505), STATUS_METADATA(506), STATUS_METADATA(507), STATUS_METADATA(508), STATUS_METADATA(510),
+	STATUS_METADATA(511)
+};
+
+// returns the PROGMEM status line for the given status code, or nullptr if the code is unknown
+static const char* getStatusLine(uint16_t code) {
+	for (uint8_t i = 0; i < sizeof(statusLines) / sizeof(statusLines[0]); i++) {
+		uint16_t entryCode = pgm_read_word(&statusLines[i].code);
+		if (entryCode == code) {
+			return reinterpret_cast<const char*>(pgm_read_ptr(&statusLines[i].line));
+		}
+		else if (entryCode > code) {
 			break;
-		default:
-			client.print(response.responseCode);
-			client.write_P(PSTR_AND_LEN(" (unknown status)\r\n"));
+		}
 	}
+	return nullptr;
+}
+
+// The status line and headers are assembled here, along with as much of the content as fits, so that a small response goes
+// out in a single write - and thus a single packet. The Ethernet library sends a packet for every write call, so writing
+// the status line, headers, and body separately would take 4-6 packets per response. The frame is only assembled once the
+// socket has room for all of it, so it's always sent right away, and can be shared by every connection.
+static char responseFrame[HTTP_RESPONSE_FRAME_SIZE];
+static size_t responseFrameLength = 0;
+
+// The longest status line, the handler's headers, and the server's own headers must all fit in the frame
+static_assert(HTTP_RESPONSE_FRAME_SIZE >= HTTP_RESPONSE_HEADERS_SIZE + 128, "HTTP_RESPONSE_FRAME_SIZE is too small");
+
+// Appends data (from RAM, or from PROGMEM if isProgmem is set) to the response frame. Anything that doesn't fit is dropped.
+static void appendToFrame(const char* data, size_t length, bool isProgmem) {
+	if (!length) {
+		return; // data may be null - e.g. the content of a 204 or 101 response
+	}
+	if (length > sizeof(responseFrame) - responseFrameLength) {
+		length = sizeof(responseFrame) - responseFrameLength;
+	}
+	if (isProgmem) {
+		memcpy_P(responseFrame + responseFrameLength, data, length);
+	}
+	else {
+		memcpy(responseFrame + responseFrameLength, data, length);
+	}
+	responseFrameLength += length;
+}
+
+static inline void appendToFrame_P(const char* data, size_t length) {
+	appendToFrame(data, length, true);
+}
+
+// returns true if the connection's response is streamed with chunked transfer encoding
+static inline bool isChunked(HttpConnection const& connection) {
+	return connection.response.writer && connection.request.version != HttpVersion::Http_10;
+}
+
+// Writes the status line and headers, followed by as much of the content as fits in the response frame (unless the content
+// is streamed). The socket must have room for HTTP_RESPONSE_FRAME_SIZE bytes.
+static void writeHead(EthernetClient& client, HttpConnection& connection, uint32_t now) {
+	HttpResponse& response = connection.response;
+	responseFrameLength = 0;
+	appendToFrame_P(response.version == HttpVersion::Http_10 ? HTTP_10_STR : HTTP_11_STR, HTTP_VERSION_STR_LEN);
+	appendToFrame_P(PSTR(" "), 1);
+
+	const char* statusLine = getStatusLine(response.responseCode);
+	if (statusLine) {
+		appendToFrame_P(statusLine, strlen_P(statusLine));
+	}
+	else {
+		char unknownStatus[sizeof("65535 (unknown status)\r\n")];
+		appendToFrame(unknownStatus,
+				snprintf_P(unknownStatus, sizeof(unknownStatus), PSTR("%u (unknown status)\r\n"), response.responseCode), false);
+	}
+
 	if (response.headers && response.headersLength) {
-		client.write(response.headers, response.headersLength);
+		appendToFrame(response.headers, response.headersLength, false);
+	}
+	// 1xx, 204, and 304 responses never have a body. Every other response gets a Content-Length, even if it's 0, so the client
+	// can tell where it ends on a persistent connection. Streamed content has no length up front; it's either chunked, or
+	// (for HTTP/1.0 clients) ends when the connection closes.
+	if (isChunked(connection)) {
+		appendToFrame_P(TRANSFER_ENCODING_CHUNKED_STR, TRANSFER_ENCODING_CHUNKED_STR_LEN);
 	}
-	if (response.contentLength) {
-		client.write_P(PSTR_AND_LEN("Content-Length: "));
-		client.print(response.contentLength);
-		client.write_P(PSTR_AND_LEN("\r\nConnection: Close\r\n\r\n"));
+	else if (!response.writer && response.responseCode >= 200 && response.responseCode != 204 && response.responseCode != 304) {
+		char contentLength[sizeof("Content-Length: 65535\r\n")];
+		appendToFrame(contentLength,
+				snprintf_P(contentLength, sizeof(contentLength), PSTR("Content-Length: %u\r\n"), static_cast<unsigned int>(response.contentLength)), false);
+	}
+	if (response.responseCode == 101) {
+		// accepting a WebSocket upgrade
+		char accept[WEBSOCKET_ACCEPT_SIZE + 1];
+		webSocketAccept(webSocketKey(connection), accept);
+		appendToFrame_P(CONNECTION_UPGRADE_STR, CONNECTION_UPGRADE_STR_LEN);
+		appendToFrame(accept, WEBSOCKET_ACCEPT_SIZE, false);
+		appendToFrame_P(PSTR_AND_LEN("\r\n\r\n"));
+	}
+	else if (connection.request.keepAlive) {
+		appendToFrame_P(CONNECTION_KEEP_ALIVE_STR, CONNECTION_KEEP_ALIVE_STR_LEN);
 	}
 	else {
-		// this else case is redundant but minimizes number of write calls, since each call results in a packet
-		client.write_P(PSTR_AND_LEN("Connection: Close\r\n\r\n"));
+		appendToFrame_P(CONNECTION_CLOSE_STR, CONNECTION_CLOSE_STR_LEN);
+	}
+
+	if (!response.writer) {
+		size_t length = response.contentLength;
+		if (length > sizeof(responseFrame) - responseFrameLength) {
+			length = sizeof(responseFrame) - responseFrameLength;
+		}
+		appendToFrame(response.content, length, response.isContentInProgmem);
+		connection.contentSent = length; // writeBody() sends the rest
 	}
+	client.write(reinterpret_cast<const uint8_t*>(responseFrame), responseFrameLength);
+	connection.lastActivity = now;
+}
 
-	if (response.content && response.contentLength) {
+// Sends as much of the rest of the content as the socket has room for, up to HTTP_RESPONSE_CONTENT_SIZE bytes at a time.
+// Returns true once all the content has been sent.
+static bool writeBody(EthernetClient& client, HttpConnection& connection, uint32_t now) {
+	HttpResponse& response = connection.response;
+	size_t length = response.contentLength - connection.contentSent;
+	int space = client.availableForWrite();
+	if (space <= 0) {
+		return !length;
+	}
+	if (length > static_cast<size_t>(space)) {
+		length = space;
+	}
+	if (length > HTTP_RESPONSE_CONTENT_SIZE) {
+		length = HTTP_RESPONSE_CONTENT_SIZE;
+	}
+	if (length) {
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(response.content + connection.contentSent);
 		if (response.isContentInProgmem) {
-			client.write_P(reinterpret_cast<const uint8_t*>(response.content), response.contentLength);
+			client.write_P(data, length);
 		}
 		else {
-			client.write(response.content, response.contentLength);
+			client.write(data, length);
 		}
+		connection.contentSent += length;
+		connection.lastActivity = now;
 	}
+	return connection.contentSent == response.contentLength;
+}
 
+// Sends the next piece of a streamed response, once the socket's send buffer has room for it. Over a WebSocket, each piece
+// is a continuation frame, and an empty one ends the reply. Returns true once all the content has been sent.
+static bool writeChunk(EthernetClient& client, HttpConnection& connection, uint32_t now) {
+	HttpResponse& response = connection.response;
+	int space = client.availableForWrite() - CHUNK_HEADER_SIZE - CHUNK_TRAILER_SIZE;
+	if (space < HTTP_MIN_CHUNK_SIZE) {
+		return false; // wait for the client to acknowledge some of what it's been sent
+	}
+	size_t size = HTTP_RESPONSE_CONTENT_SIZE - CHUNK_HEADER_SIZE - CHUNK_TRAILER_SIZE;
+	if (static_cast<size_t>(space) < size) {
+		size = space;
+	}
+	char* data = response.contentBuffer + CHUNK_HEADER_SIZE;
+	size_t length = response.writer(data, size, response.writerState);
+	if (connection.state == HTTPCLIENT_WS_WRITING_CHUNKS) {
+		uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+		uint8_t headerLength = webSocketFrameHeader(header, WEBSOCKET_OPCODE_CONTINUATION, !length, length);
+		memcpy(data - headerLength, header, headerLength);
+		client.write(reinterpret_cast<const uint8_t*>(data - headerLength), headerLength + length);
+	}
+	else if (!isChunked(connection)) {
+		if (length) {
+			client.write(reinterpret_cast<const uint8_t*>(data), length);
+		}
+	}
+	else if (length) {
+		char sizeLine[CHUNK_HEADER_SIZE + 1];
+		uint8_t sizeLineLength = snprintf_P(sizeLine, sizeof(sizeLine), PSTR("%X\r\n"), static_cast<unsigned int>(length));
+		memcpy(data - sizeLineLength, sizeLine, sizeLineLength);
+		data[length] = '\r';
+		data[length + 1] = '\n';
+		client.write(reinterpret_cast<const uint8_t*>(data - sizeLineLength), sizeLineLength + length + CHUNK_TRAILER_SIZE);
+	}
+	else {
+		client.write_P(reinterpret_cast<const uint8_t*>(LAST_CHUNK_STR), LAST_CHUNK_STR_LEN);
+	}
+	connection.lastActivity = now;
+	return !length;
 }
 
-//TODO if we ever support keep-alive, remove the hardcoded "Connection: Close" from each of these responses
-static void handleRequest(EthernetClient& client, HttpConnection& connection, HttpHandler* handler) {
-	HttpResponse response {};
-	memset(&response, 0, sizeof(response));
+// Sends the reply to a WebSocket message - the status code, and then a space and the content, if there is any - in a text
+// frame, once the socket has room for all of it. A streamed reply's frame holds only the status code; writeChunk() sends
+// the content after it. Returns true once the whole reply has been sent.
+static bool writeWebSocketReply(EthernetClient& client, HttpConnection& connection, uint32_t now) {
+	HttpResponse& response = connection.response;
+	bool isStreamed = response.writer;
+	char status[sizeof("65535 ")];
+	uint8_t statusLength = snprintf_P(status, sizeof(status), isStreamed || response.contentLength ? PSTR("%u ") : PSTR("%u"),
+			response.responseCode);
+	uint16_t payloadLength = statusLength + (isStreamed ? 0 : response.contentLength);
+	uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+	uint8_t headerLength = webSocketFrameHeader(header, WEBSOCKET_OPCODE_TEXT, !isStreamed, payloadLength);
+	if (client.availableForWrite() < headerLength + payloadLength) {
+		return false; // wait for room for the whole frame
+	}
+
+	// as much as fits goes out in one write, like writeHead()
+	responseFrameLength = 0;
+	appendToFrame(reinterpret_cast<const char*>(header), headerLength, false);
+	appendToFrame(status, statusLength, false);
+	if (!isStreamed) {
+		size_t length = response.contentLength;
+		if (length > sizeof(responseFrame) - responseFrameLength) {
+			length = sizeof(responseFrame) - responseFrameLength;
+		}
+		appendToFrame(response.content, length, response.isContentInProgmem);
+		connection.contentSent = length;
+	}
+	client.write(reinterpret_cast<const uint8_t*>(responseFrame), responseFrameLength);
+	if (!isStreamed && connection.contentSent < response.contentLength) {
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(response.content + connection.contentSent);
+		if (response.isContentInProgmem) {
+			client.write_P(data, response.contentLength - connection.contentSent);
+		}
+		else {
+			client.write(data, response.contentLength - connection.contentSent);
+		}
+	}
+	connection.lastActivity = now;
+	if (isStreamed) {
+		connection.state = HTTPCLIENT_WS_WRITING_CHUNKS;
+		return false;
+	}
+	return true;
+}
 
+// Sends a WebSocket control frame (e.g. a pong) with the given payload, once the socket has room for it. Returns false if it
+// has to wait.
+static bool writeControlFrame(EthernetClient& client, uint8_t opcode, const uint8_t* payload, uint8_t length) {
+	uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+	uint8_t headerLength = webSocketFrameHeader(header, opcode, true, length);
+	if (client.availableForWrite() < headerLength + length) {
+		return false;
+	}
+	responseFrameLength = 0;
+	appendToFrame(reinterpret_cast<const char*>(header), headerLength, false);
+	appendToFrame(reinterpret_cast<const char*>(payload), length, false);
+	client.write(reinterpret_cast<const uint8_t*>(responseFrame), responseFrameLength);
+	return true;
+}
+
+// Pushes a message with some of the state changes the WebSocket client hasn't seen yet, once the socket has room for a whole
+// frame. One message goes out per call, so a client with a lot to catch up on can't hog the main loop.
+static void pushState(EthernetClient& client, HttpConnection& connection, WebSocketPusher* pusher, uint32_t now) {
+	if (client.availableForWrite() < HTTP_RESPONSE_FRAME_SIZE) {
+		return;
+	}
+	// the message is written after room for the longest header, and the header is put just in front of it
+	char* message = responseFrame + WEBSOCKET_MAX_HEADER_SIZE;
+	size_t length = pusher(message, sizeof(responseFrame) - WEBSOCKET_MAX_HEADER_SIZE, connection.pendingPushes);
+	if (!length) {
+		connection.pendingPushes = 0; // whatever's left, the pusher doesn't know about
+		return;
+	}
+	uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+	uint8_t headerLength = webSocketFrameHeader(header, WEBSOCKET_OPCODE_TEXT, true, length);
+	memcpy(message - headerLength, header, headerLength);
+	client.write(reinterpret_cast<const uint8_t*>(message - headerLength), headerLength + length);
+	connection.lastActivity = now;
+}
+
+// Sends as much of the connection's response as the socket has room for. No write ever has to wait for room in the
+// socket's send buffer, so a client that reads slowly (or not at all) can't stall the main loop; the rest of the response
+// is sent over the next few calls to serve(). now is the time of the call, for recording activity on the connection.
+// Returns true once the whole response has been sent.
+static bool writeResponse(EthernetClient& client, HttpConnection& connection, uint32_t now) {
+	switch (connection.state) {
+		case HTTPCLIENT_WRITING_HEAD:
+			if (client.availableForWrite() < HTTP_RESPONSE_FRAME_SIZE) {
+				return false; // wait for room for the whole frame
+			}
+			writeHead(client, connection, now);
+			if (connection.response.writer) {
+				connection.state = HTTPCLIENT_WRITING_CHUNKS;
+				return false;
+			}
+			connection.state = HTTPCLIENT_WRITING_BODY;
+			return connection.contentSent == connection.response.contentLength;
+		case HTTPCLIENT_WRITING_BODY:
+			return writeBody(client, connection, now);
+		case HTTPCLIENT_WRITING_CHUNKS:
+		case HTTPCLIENT_WS_WRITING_CHUNKS:
+			return writeChunk(client, connection, now);
+		case HTTPCLIENT_WS_WRITING_REPLY:
+			return writeWebSocketReply(client, connection, now);
+		default:
+			assert(0);
+			return true;
+	}
+}
+
+// Sets the connection's response to the given PROGMEM string, which holds the entire response, status line and headers
+// included. The connection is closed once it's sent.
+static void setErrorResponse(HttpConnection& connection, const char* response, size_t length) {
+	connection.response.responseCode = 0; // the status line is in the content
+	connection.response.content = response;
+	connection.response.contentLength = length;
+	connection.response.isContentInProgmem = true;
+	connection.request.keepAlive = false;
+	connection.state = HTTPCLIENT_WRITING_BODY;
+}
+
+// Prepares the response to a received request, and moves the connection on to one of the writing states, for
+// writeResponse() to send it. The connection must hold a response buffer if it has received a valid request (see
+// HttpServer::acquireResponseBuffer()).
+static void handleRequest(HttpConnection& connection, HttpHandler* handler) {
 	switch (connection.state) {
 		case HTTPCLIENT_RCVD_REQUEST:
-			handler(connection.request, response);
-			writeResponse(client, response);
+			handler(connection.request, connection.response);
+			if (!connection.response.content) {
+				connection.response.contentLength = 0;
+			}
+			if (connection.response.writer && !isChunked(connection)) {
+				connection.request.keepAlive = false; // the connection has to close to end the content
+			}
+			connection.state = HTTPCLIENT_WRITING_HEAD;
 			break;
 		case HTTPCLIENT_RCVD_BAD_METHOD:
-			client.write_P(PSTR_AND_LEN("HTTP/1.1 405 Method Not Allowed\r\nConnection: Close\r\nContent-Length: 23\r\n\r\nERROR - unknown method."));
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 405 Method Not Allowed\r\n" CONNECTION_CLOSE_HEADER "Content-Length: 23\r\n\r\nERROR - unknown method."));
 			break;
 		case HTTPCLIENT_RCVD_BAD_VERSION:
-			client.write_P(PSTR_AND_LEN("HTTP/1.1 505 HTTP Version Not Supported\r\nConnection: Close\r\nContent-Length: 29\r\n\r\nERROR - unknown HTTP version."));
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 505 HTTP Version Not Supported\r\n" CONNECTION_CLOSE_HEADER "Content-Length: 29\r\n\r\nERROR - unknown HTTP version."));
 			break;
 		case HTTPCLIENT_RCVD_URI_TOO_LONG:
-			client.write_P(PSTR_AND_LEN("HTTP/1.1 414 URI Too Long\r\nConnection: Close\r\nContent-Length: 29\r\n\r\nERROR - Request URI too long."));
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 414 URI Too Long\r\n" CONNECTION_CLOSE_HEADER "Content-Length: 29\r\n\r\nERROR - Request URI too long."));
 			break;
 		case HTTPCLIENT_RCVD_HDRS_TOO_LONG:
-			client.write_P(PSTR_AND_LEN("HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: Close\r\nContent-Length: 40\r\n\r\nERROR - Request Header Fields Too Large."));
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 431 Request Header Fields Too Large\r\n" CONNECTION_CLOSE_HEADER "Content-Length: 40\r\n\r\nERROR - Request Header Fields Too Large."));
 			break;
 		case HTTPCLIENT_RCVD_BODY_TOO_LONG:
-			client.write_P(PSTR_AND_LEN("HTTP/1.1 413 Request Entity Too Large\r\nConnection: Close\r\nContent-Length: 33\r\n\r\nERROR - Request Entity Too Large."));
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 413 Request Entity Too Large\r\n" CONNECTION_CLOSE_HEADER "Content-Length: 33\r\n\r\nERROR - Request Entity Too Large."));
+			break;
+		case HTTPCLIENT_RCVD_BAD_REQUEST:
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 400 Bad Request\r\n" CONNECTION_CLOSE_HEADER "Content-Length: 31\r\n\r\nERROR - invalid Content-Length."));
+			break;
+		case HTTPCLIENT_RCVD_BAD_REQUEST_LINE:
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 400 Bad Request\r\n" CONNECTION_CLOSE_HEADER "Content-Length: 31\r\n\r\nERROR - malformed request line."));
+			break;
+		case HTTPCLIENT_RCVD_TIMEOUT:
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 408 Request Timeout\r\n" CONNECTION_CLOSE_HEADER "Content-Length: 26\r\n\r\nERROR - Request timed out."));
+			break;
+		case HTTPCLIENT_RCVD_NO_CONNECTION:
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 503 Service Unavailable\r\n" CONNECTION_CLOSE_HEADER "Retry-After: 1\r\nContent-Length: 37\r\n\r\nERROR - All connections are reserved."));
 			break;
 		default:
 			// can't hurt
-			client.write_P(PSTR_AND_LEN("HTTP/1.1 500 Internal Server Error\r\nConnection: Close\r\nContent-Length: 53\r\n\r\nUnknown connection state. Please talk to a developer."));
+			setErrorResponse(connection, PSTR_AND_LEN("HTTP/1.1 500 Internal Server Error\r\n" CONNECTION_CLOSE_HEADER "Content-Length: 53\r\n\r\nUnknown connection state. Please talk to a developer."));
 			break;
 	}
 }
 
-static void resetConnection(HttpConnection& connection) {
-	connection.leftovers = nullptr;
-	connection.leftoversLength = 0;
-	connection.parsePosition = 0;
-	connection.readPosition = 0;
-	connection.request.content = connection.requestBody;
-	connection.request.contentLength = 0;
-	HttpHeader* header = &connection.request.headers[0];
-	for (int i = 0; i < HTTP_HEADER_CNT; i++) {
-		header->key = nullptr;
-		header->keyLen = 0;
-		header->value = nullptr;
-		header->valueLen = 0;
-		header++;
-	}
-	connection.request.numHeaders = 0;
+// Prepares the reply to a text message received over a WebSocket. The message is handled like an HTTP/1.1 request: it's
+// "<method> <URI>", optionally followed by a line feed and the request body. The connection must hold a response buffer.
+static void handleMessage(HttpConnection& connection, HttpHandler* handler) {
+	HttpRequest& request = connection.request;
+	char* message = connection.requestBody;
+	connection.state = HTTPCLIENT_WS_WRITING_REPLY;
+
+	uint8_t method = NO_MATCH;
+	char* uri = strchr(message, ' ');
+	if (uri) {
+		*uri++ = '\0';
+		for (uint8_t i = 0; i < METHOD_CNT; i++) {
+			if (!strcmp_P(message, reinterpret_cast<const char*>(pgm_read_ptr(METHOD_STRS + i)))) {
+				method = i;
+				break;
+			}
+		}
+	}
+	char* content = uri ? strchr(uri, '\n') : nullptr;
+	size_t uriLength = uri ? (content ? content - uri : strlen(uri)) : 0;
+	if (uriLength && uri[uriLength - 1] == '\r') {
+		uriLength--; // the line ended in CRLF
+	}
+	if (method == NO_MATCH || !uriLength || uriLength + 1 > sizeof(connection.requestUri)) {
+		connection.response.responseCode = 400;
+		connection.response.content = PSTR("Expected \"<method> <URI>\"");
+		connection.response.contentLength = sizeof("Expected \"<method> <URI>\"") - 1;
+		connection.response.isContentInProgmem = true;
+		return;
+	}
+	// the URI is copied out, so the request looks just like one that came in over HTTP
+	memcpy(connection.requestUri, uri, uriLength);
+	connection.requestUri[uriLength] = '\0';
+	request.method = static_cast<HttpMethod>(method);
+	request.version = HttpVersion::Http_11;
+	request.uriLength = uriLength;
+	if (content) {
+		content++;
+		request.contentLength -= content - message;
+		request.content = content;
+	}
+	else {
+		request.contentLength = 0;
+		request.content = uri + strlen(uri); // the zero byte at the end of the message, past any trailing '\r'
+	}
+	request.keepAlive = true;
+
+	handler(request, connection.response);
+	assert(connection.response.responseCode != 101); // isWebSocketUpgrade is never set here
+	if (!connection.response.content) {
+		connection.response.contentLength = 0;
+	}
+}
+
+// clears the request data and parse state, in preparation for the next request on the same connection. Doesn't touch the
+// input buffer, which may already hold the start of the next request.
+static void resetRequest(HttpConnection& connection) {
+	connection.position = 0;
+	connection.headersLength = 0;
+	connection.field = HTTP_HEADER_OTHER;
+	connection.candidates = ALL_CANDIDATES(METHOD_CNT);
+	connection.connectionTokens = 0;
 	connection.request.method = HttpMethod::GET;
+	connection.request.version = HttpVersion::Http_10;
 	connection.request.uri = connection.requestUri;
 	connection.request.uriLength = 0;
-	connection.request.version = HttpVersion::Http_10;
-	memset(&connection.requestBody, 0, sizeof(connection.requestBody));
-	memset(&connection.requestHeaders, 0, sizeof(connection.requestHeaders));
-	memset(&connection.requestUri, 0, sizeof(connection.requestUri));
+	connection.request.content = connection.requestBody;
+	connection.request.contentLength = 0;
+	connection.request.keepAlive = false;
+	connection.request.isWebSocketUpgrade = false;
+	connection.contentSent = 0;
+	connection.isClassified = false;
+	// no need to clear the buffers - the parser zero-terminates the URI and body
+	connection.requestUri[0] = '\0';
+	connection.requestBody[0] = '\0';
+	*webSocketKey(connection) = '\0';
+}
+
+// clears all request data and parse state, and marks the connection as disconnected
+static void resetConnection(HttpConnection& connection) {
+	resetRequest(connection);
+	connection.inputStart = 0;
+	connection.inputEnd = 0;
+	connection.responseBuffer = HTTP_NO_RESPONSE_BUFFER;
+	connection.priority = HTTP_PRIORITY_UNKNOWN;
+	connection.pendingPushes = 0;
+	connection.lastActivity = 0;
 	connection.state = HTTPCLIENT_STATUS_DISCONNECTED;
 }
 
-void HttpServer::serve(void) {
+// Prepares a persistent connection for its next request. If the client sent the next request before getting the response to
+// this one (pipelining), its first few bytes may already be in the input buffer; parsing resumes on them.
+static void nextRequest(HttpConnection& connection) {
+	resetRequest(connection);
+	connection.state = HTTPCLIENT_READING_METHOD;
+}
+
+// Prepares a WebSocket connection for the client's next frame
+static void nextFrame(HttpConnection& connection) {
+	resetRequest(connection);
+	connection.state = HTTPCLIENT_WS_READING_HEADER;
+}
+
+// returns true if the WebSocket connection is reading a frame (as opposed to answering one)
+static inline bool isReadingFrame(HttpConnection const& connection) {
+	return connection.state == HTTPCLIENT_WS_READING_HEADER || connection.state == HTTPCLIENT_WS_READING_PAYLOAD;
+}
+
+// returns true if the WebSocket connection has something to send, that's waiting for room in the socket's send buffer
+static inline bool isWebSocketWriting(HttpConnection const& connection) {
+	return connection.state == HTTPCLIENT_WS_RCVD_PING || connection.state == HTTPCLIENT_WS_CLOSING
+			|| connection.state == HTTPCLIENT_WS_WRITING_REPLY || connection.state == HTTPCLIENT_WS_WRITING_CHUNKS
+			|| (isReadingFrame(connection) && connection.pendingPushes);
+}
+
+// returns true if the connection is waiting for its next request, and hasn't received any of it
+static inline bool isIdle(HttpConnection const& connection) {
+	return connection.state == HTTPCLIENT_READING_METHOD && !connection.position && connection.inputStart == connection.inputEnd;
+}
+
+void HttpServer::closeConnection(uint8_t index) {
+	clients[index].stop();
+	numConnections--;
+	if (connections[index].state & HTTPCLIENT_STATUS_WEBSOCKET) {
+		webSocketCount--;
+	}
+	releaseResponseBuffer(connections[index]);
+	// reset the connection state and clear all request data
+	resetConnection(connections[index]);
+}
+
+void HttpServer::serve(uint32_t now) {
 	// if we have enough room for more clients, look for and add them
 	if (numConnections < maxConnections) {
 		EthernetClient newClient = server.accept();
@@ -818,6 +1225,7 @@ void HttpServer::serve(void) {
 				if (!clients[i]) {
 					clients[i] = newClient;
 					connections[i].state = HTTPCLIENT_READING_METHOD;
+					connections[i].lastActivity = now;
 					numConnections++;
 					break;
 				}
@@ -830,36 +1238,194 @@ void HttpServer::serve(void) {
 		}
 	}
 
+	// look for state changes to push to the WebSocket clients
+	if (poller && webSocketCount && isElapsed(lastPoll + HTTP_WEBSOCKET_POLL_INTERVAL, now)) {
+		lastPoll = now;
+		uint16_t changes = poller(responseFrame, sizeof(responseFrame));
+		for (uint8_t i = 0; changes && i < maxConnections; i++) {
+			if (clients[i] && (connections[i].state & HTTPCLIENT_STATUS_WEBSOCKET)) {
+				if (!connections[i].pendingPushes) {
+					connections[i].lastActivity = now; // the changes start waiting for room in the socket now
+				}
+				connections[i].pendingPushes |= changes;
+			}
+		}
+	}
+
+	// read and time out each connection, answering urgent requests as they come in
 	for (int i = 0; i < maxConnections; i++) {
 		if (!clients[i]) {
 			continue;
 		}
 		if (!clients[i].connected()) {
-			clients[i].stop();
-			numConnections--;
-			resetConnection(connections[i]);
+			closeConnection(i);
+			continue;
+		}
+		if (connections[i].state & HTTPCLIENT_STATUS_READING) {
+			if (clients[i].available()) {
+				connections[i].lastActivity = now;
+			}
+			else if (isIdle(connections[i])) {
+				if (isElapsed(connections[i].lastActivity + HTTP_IDLE_TIMEOUT, now)) {
+					// the client has left the connection idle for too long - free up the socket
+					LOG_VERBOSE("Closing idle HTTP connection %d", i);
+					reclaimedConnections++;
+					closeConnection(i);
+					continue;
+				}
+			}
+			else if (connections[i].inputStart == connections[i].inputEnd
+					&& isElapsed(connections[i].lastActivity + HTTP_READ_TIMEOUT, now)) {
+				// the client stopped partway through a request - give up on it, and send a 408 (see handleRequest())
+				LOG_VERBOSE("HTTP connection %d timed out reading a request", i);
+				reclaimedConnections++;
+				connections[i].state = HTTPCLIENT_RCVD_TIMEOUT;
+				connections[i].lastActivity = now;
+			}
+		}
+		else if (connections[i].state & HTTPCLIENT_STATUS_WEBSOCKET) {
+			// a WebSocket stays open as long as the client wants it, so long as the client keeps reading what it's sent
+			if (isReadingFrame(connections[i]) && clients[i].available()) {
+				connections[i].lastActivity = now;
+			}
+			else if (isWebSocketWriting(connections[i]) && isElapsed(connections[i].lastActivity + HTTP_IDLE_TIMEOUT, now)) {
+				LOG_VERBOSE("Closing stalled WebSocket connection %d", i);
+				reclaimedConnections++;
+				closeConnection(i);
+				continue;
+			}
+			if (isReadingFrame(connections[i])) {
+				parseFrame(clients[i], connections[i]);
+			}
+		}
+		else if ((connections[i].state & HTTPCLIENT_STATUS_WRITING) && isElapsed(connections[i].lastActivity + HTTP_IDLE_TIMEOUT, now)) {
+			// the client has stopped reading the response, so there's no room to send the rest of it - free up the socket
+			LOG_VERBOSE("Closing stalled HTTP connection %d", i);
+			reclaimedConnections++;
+			closeConnection(i);
 			continue;
 		}
 		if (connections[i].state & HTTPCLIENT_STATUS_READING) {
 			parseRequest(clients[i], connections[i]);
+			if (connections[i].request.uriLength && !connections[i].isClassified) {
+				classifyRequest(i);
+			}
+		}
+		// urgent requests are answered right away; everything else waits until the next loop, so it can't hold them up
+		if (connections[i].priority == HTTP_PRIORITY_URGENT) {
+			respond(i, now);
+		}
+	}
+	for (uint8_t i = 0; i < maxConnections; i++) {
+		if (clients[i] && connections[i].priority != HTTP_PRIORITY_URGENT) {
+			respond(i, now);
+		}
+	}
+}
+
+void HttpServer::classifyRequest(uint8_t index) {
+	HttpConnection& connection = connections[index];
+	connection.isClassified = true;
+	if (classifier && classifier(connection.request)) {
+		connection.priority = HTTP_PRIORITY_URGENT;
+		return;
+	}
+	connection.priority = HTTP_PRIORITY_NORMAL;
+	if (!classifier || maxConnections <= HTTP_RESERVED_CONNECTIONS) {
+		return; // nothing is reserved
+	}
+	uint8_t normalConnections = 0;
+	for (uint8_t i = 0; i < maxConnections; i++) {
+		if (i != index && clients[i] && connections[i].priority == HTTP_PRIORITY_NORMAL) {
+			normalConnections++;
+		}
+	}
+	if (normalConnections + HTTP_RESERVED_CONNECTIONS >= maxConnections) {
+		// this connection is one of the reserved ones - turn the request away, so it's free for the next urgent one
+		LOG_VERBOSE("Rejecting normal HTTP request on reserved connection %d", index);
+		connection.state = HTTPCLIENT_RCVD_NO_CONNECTION;
+	}
+}
+
+void HttpServer::respond(uint8_t index, uint32_t now) {
+	HttpConnection& connection = connections[index];
+	if (connection.state & HTTPCLIENT_STATUS_WEBSOCKET) {
+		respondWebSocket(index, now);
+		return;
+	}
+	if (connection.state & HTTPCLIENT_STATUS_RCVD) {
+		if (connection.state == HTTPCLIENT_RCVD_REQUEST && !acquireResponseBuffer(connection)) {
+			return; // every response buffer is in use - try again on the next pass
 		}
-		if (connections[i].state & HTTPCLIENT_STATUS_RCVD) {
 #if LOG_LEVEL <= LOG_LEVEL_VERBOSE
-			LOG_VERBOSE("Received HTTP Message: State=[%d], Method=[%d], URI=[%s], Version=[%d]",
-							connections[i].state,
-							static_cast<uint8_t>(connections[i].request.method),
-							connections[i].request.uri,
-							static_cast<uint8_t>(connections[i].request.version));
-			Log.writeDetails_P(PSTR("Headers (%d)\n%s\n"), connections[i].request.numHeaders, connections[i].requestHeaders);
-			Log.writeDetails_P(PSTR("Request Body (len=%d):\n%s\n"), connections[i].request.contentLength, connections[i].request.content);
+		LOG_VERBOSE("Received HTTP Message: State=[%d], Method=[%d], URI=[%s], Version=[%d]",
+						connection.state,
+						static_cast<uint8_t>(connection.request.method),
+						connection.request.uri,
+						static_cast<uint8_t>(connection.request.version));
+		Log.writeDetails_P(PSTR("Request Body (len=%d):\n%s\n"), connection.request.contentLength, connection.request.content);
 #endif
-			// respond to the request using the provided handler, or a default error behavior.
-			handleRequest(clients[i], connections[i], handler);
-			// reset the connection state and clear all request data
-			resetConnection(connections[i]);
-			// disconnect from the client
-			clients[i].stop();
-			numConnections--;
+		// respond to the request using the provided handler, or a default error behavior.
+		handleRequest(connection, handler);
+	}
+	// The response is sent as the socket has room for it. The connection keeps its response buffer until it's all sent.
+	if ((connection.state & HTTPCLIENT_STATUS_WRITING) && writeResponse(clients[index], connection, now)) {
+		releaseResponseBuffer(connection);
+		if (connection.response.responseCode == 101) {
+			// the upgrade has been accepted - from here on, the client sends WebSocket frames
+			assert(connection.request.isWebSocketUpgrade);
+			LOG_VERBOSE("HTTP connection %d upgraded to a WebSocket", index);
+			nextFrame(connection);
+			connection.pendingPushes = pusher ? 0xFFFF : 0; // everything, so the client starts out with the whole state
+			connection.lastActivity = now;
+			webSocketCount++;
 		}
+		else if (connection.request.keepAlive) {
+			// keep the connection open, and start reading the next request. If it has already arrived, it is parsed on the
+			// next call to serve(), so requests are answered in order, and one connection can't hog the main loop.
+			nextRequest(connection);
+			connection.lastActivity = now;
+		}
+		else {
+			closeConnection(index);
+		}
+	}
+}
+
+void HttpServer::respondWebSocket(uint8_t index, uint32_t now) {
+	HttpConnection& connection = connections[index];
+	EthernetClient& client = clients[index];
+	switch (connection.state) {
+		case HTTPCLIENT_WS_RCVD_MESSAGE:
+			if (!acquireResponseBuffer(connection)) {
+				return; // every response buffer is in use - try again on the next pass
+			}
+			LOG_VERBOSE("Received WebSocket message on connection %d: %s", index, connection.requestBody);
+			handleMessage(connection, handler);
+			break;
+		case HTTPCLIENT_WS_RCVD_PING:
+			// the pong echoes the ping's payload, which is still in requestBody
+			if (writeControlFrame(client, WEBSOCKET_OPCODE_PONG, reinterpret_cast<const uint8_t*>(connection.requestBody),
+					connection.request.contentLength)) {
+				connection.lastActivity = now;
+				nextFrame(connection);
+			}
+			break;
+		case HTTPCLIENT_WS_CLOSING: {
+			uint8_t status[2] = { static_cast<uint8_t>(connection.response.responseCode >> 8), static_cast<uint8_t>(connection.response.responseCode) };
+			if (writeControlFrame(client, WEBSOCKET_OPCODE_CLOSE, status, sizeof(status))) {
+				LOG_VERBOSE("Closing WebSocket connection %d (status %u)", index, connection.response.responseCode);
+				closeConnection(index);
+			}
+		} return;
+	}
+	// the reply is sent as the socket has room for it, like an HTTP response
+	if ((connection.state == HTTPCLIENT_WS_WRITING_REPLY || connection.state == HTTPCLIENT_WS_WRITING_CHUNKS)
+			&& writeResponse(client, connection, now)) {
+		releaseResponseBuffer(connection);
+		nextFrame(connection);
+	}
+	if (isReadingFrame(connection) && connection.pendingPushes) {
+		pushState(client, connection, pusher, now);
 	}
 }
@@ -4,20 +4,54 @@
 
 #include <Ethernet.h>
 
-#define HTTP_HEADER_CNT			(8)
-
-// Size of buffer allocated by HTTP server for storing HTTP headers.
-// Any incoming request cannot overflow this buffer; if it does, a 431 is returned
-#define HTTP_INCOMING_REQUEST_HEADERS_SIZE		(256)
+// Maximum total size of the HTTP headers in a request. Headers aren't stored (only the few the server needs are parsed
+// as they arrive), but this keeps a client from tying up a connection with an endless header section. If exceeded, a 431
+// is returned.
+#define HTTP_INCOMING_REQUEST_HEADERS_SIZE		(512)
 // Size of buffer allocated by HTTP server for storing request URI.
 // Any incoming request cannot overflow this buffer; if it does, a 414 is returned
 #define HTTP_INCOMING_REQUEST_URI_SIZE			(40)
 // Size of buffer allocated by HTTP server for storing request body.
 // Any incoming request cannot overflow this buffer; if it does, a 413 is returned
 #define HTTP_INCOMING_REQUEST_BODY_SIZE			(256)
-
-// cannot be more than MAX_SOCK_NUM. Adjust as needed to save memory.
+// Size of the buffer each connection reads into while parsing everything up to the request body. Bigger means fewer reads
+// from the Ethernet chip per request, at the cost of RAM. At most 255.
+#define HTTP_INPUT_BUFFER_SIZE					(32)
+// Size of the buffer responses are assembled in. A response that fits goes out in a single packet; the rest of a bigger one
+// follows as the socket's send buffer has room for it. The server waits until the send buffer has room for this much before
+// it starts on a response.
+#define HTTP_RESPONSE_FRAME_SIZE				(256)
+
+// Each connection takes one of the Ethernet chip's sockets, and so does each UDP server (the weed commands and the state
+// broadcast take one each - see Sketch.cpp), so this cannot be more than MAX_SOCK_NUM less those. A W5200 or W5500 has 8
+// sockets, leaving room for all 4; a W5100 has only 4, so lower this to 2 on one. Adjust as needed to save memory.
 #define HTTP_MAX_CONNECTIONS		(4)
+// Number of connections kept free for urgent requests (see HttpClassifier). Once every other connection is taken by a
+// client making normal requests, any more normal requests get a 503 (Service Unavailable).
+#define HTTP_RESERVED_CONNECTIONS	(1)
+
+// Size of the buffers handlers build response headers and content in (see HttpResponse). A connection takes a pair from the
+// server's pool of HTTP_RESPONSE_BUFFER_CNT while it's handling a request, and gives them back when the response is sent.
+// If every buffer is in use, requests wait their turn. Each pair takes 576 bytes of RAM, and most responses are sent in a
+// single pass, so there are fewer pairs than connections. Raise the count for more concurrent responses. At most 8.
+#define HTTP_RESPONSE_HEADERS_SIZE		(64)
+#define HTTP_RESPONSE_CONTENT_SIZE		(512) // needs to hold the largest content that isn't streamed (GET /api/config, ~360B)
+#define HTTP_RESPONSE_BUFFER_CNT		(2)
+// Smallest piece of content a streamed response's writer is asked for (see HttpContentWriter). The server waits until the
+// socket's send buffer has room for at least this much.
+#define HTTP_MIN_CHUNK_SIZE				(128)
+
+// Time, in milliseconds, a connection may go without any activity before the server closes it. This frees up the socket
+// for other clients if a client disappears (or its link drops) without closing its connection.
+// HTTP_IDLE_TIMEOUT applies between requests (e.g. on a persistent connection, or a new one that hasn't sent anything yet),
+// and while a response is waiting for the client to read it. The connection is closed without a response.
+// HTTP_READ_TIMEOUT applies once part of a request has arrived. The client gets a 408 (Request Timeout) response.
+#define HTTP_IDLE_TIMEOUT			(5000)
+#define HTTP_READ_TIMEOUT			(2000)
+
+// Time, in milliseconds, between checks for changes to the state pushed to WebSocket clients (see WebSocketPoller). A client
+// gets each change at most this often, however often the state changes.
+#define HTTP_WEBSOCKET_POLL_INTERVAL	(100)
 
 enum class HttpMethod : uint8_t {
 	OPTIONS = 0,
@@ -34,48 +68,101 @@ enum class HttpVersion : uint8_t {
 	Http_11 = 1,
 };
 
-struct HttpHeader {
-	char *key;
-	char *value;
-	size_t valueLen;
-	size_t keyLen;
-};
-
 struct HttpRequest {
 	HttpMethod method;
 	HttpVersion version;
-	uint8_t numHeaders;
 	char *uri;
 	size_t uriLength;
-	HttpHeader headers[HTTP_HEADER_CNT];
+	// The request body: contentLength bytes, followed by a zero byte. Points into the connection's requestBody buffer,
+	// which the body is read into straight from the socket.
 	char* content;
 	size_t contentLength;
+	// true if the connection stays open for another request after the response is sent. This defaults to true for
+	// HTTP/1.1 and false for HTTP/1.0, and is overridden by a "Connection: close" or "Connection: keep-alive" header.
+	bool keepAlive;
+	// true if this is a WebSocket upgrade request: an HTTP/1.1 GET with no body, "Upgrade: websocket" and "Connection: Upgrade"
+	// headers, and a Sec-WebSocket-Key. The handler accepts the upgrade by setting the response code to 101, with no headers
+	// or content; the server adds the rest. Never set for a request that arrives over a WebSocket.
+	bool isWebSocketUpgrade;
 };
 
+// Writes the next piece of a streamed response's content into buf, which holds size bytes, and returns the number of bytes
+// written, or 0 once all the content has been written. size is always at least HTTP_MIN_CHUNK_SIZE. state starts at 0, and
+// is kept between calls, for the writer to keep track of where it left off.
+typedef size_t HttpContentWriter(char* buf, size_t size, uint16_t& state);
+
 struct HttpResponse {
-	char* headers;
+	char* headers; // HTTP_RESPONSE_HEADERS_SIZE bytes, for the handler to write any extra headers into, each ending in CRLF
 	size_t headersLength;
 	const char* content;
 	size_t contentLength;
+	char* contentBuffer; // HTTP_RESPONSE_CONTENT_SIZE bytes, for the handler to build content in. May be used as content.
 	uint16_t responseCode;
 	HttpVersion version;
 	bool isContentInProgmem;
+	// If set, content and contentLength are ignored, and the content is streamed instead: the server calls writer for one
+	// piece at a time, as room frees up in the socket's send buffer, and sends each piece as it's written. This is for
+	// content that may not fit in contentBuffer. HTTP/1.1 clients get it with chunked transfer encoding; HTTP/1.0 clients
+	// don't understand that, so for them the content ends when the connection is closed.
+	HttpContentWriter* writer;
+	uint16_t writerState;
+};
+
+struct HttpResponseBuffer {
+	char headers[HTTP_RESPONSE_HEADERS_SIZE];
+	char content[HTTP_RESPONSE_CONTENT_SIZE];
 };
 
 struct HttpConnection {
 	HttpRequest request;
-	char requestHeaders[HTTP_INCOMING_REQUEST_HEADERS_SIZE];
 	char requestUri[HTTP_INCOMING_REQUEST_URI_SIZE];
 	char requestBody[HTTP_INCOMING_REQUEST_BODY_SIZE];
-	char *leftovers;
-	size_t readPosition;
-	size_t parsePosition;
-	uint16_t leftoversLength;
+	char input[HTTP_INPUT_BUFFER_SIZE]; // bytes read from the socket, but not parsed yet
+	HttpResponse response;
+	uint32_t lastActivity; // millis() time that data last arrived or was sent
+	uint16_t position; // number of characters parsed so far in the current field
+	uint16_t headersLength; // total size of the headers parsed so far
+	uint16_t contentSent; // number of bytes of response content sent so far
+	uint8_t inputStart; // index of the next unparsed byte in input
+	uint8_t inputEnd; // index one past the last byte in input
+	uint8_t field; // which header is being parsed
+	uint8_t candidates; // bitmask of the strings (methods, versions, header names...) the current field could still match
+	uint8_t connectionTokens; // bitmask of the tokens seen in Connection and Upgrade headers
+	uint8_t responseBuffer; // index of the server's response buffer this connection holds, or HTTP_NO_RESPONSE_BUFFER
+	uint8_t priority; // priority of the connection's latest request. Kept between requests, so a persistent connection keeps its slot.
+	bool isClassified; // true once the current request's priority is known
+	uint16_t pendingPushes; // WebSocket connections only: the state changes not yet pushed to the client (see WebSocketPusher)
 	uint8_t state;
 };
 
+#define HTTP_NO_RESPONSE_BUFFER		(0xFF)
+
 typedef void HttpHandler(HttpRequest const &, HttpResponse &);
 
+// Returns true if the request is urgent, i.e. time-critical (e.g. a weed command). It's called as soon as the request's
+// method and URI have arrived, which may be before its headers and body, so it mustn't use anything else in the request.
+// It mustn't modify the request either, since the handler gets the same request later.
+// Urgent requests are answered before any others in each call to serve(), and have connections reserved for them (see
+// HTTP_RESERVED_CONNECTIONS).
+typedef bool HttpClassifier(HttpRequest const &);
+
+// Once a connection has been upgraded to a WebSocket (see HttpRequest::isWebSocketUpgrade), each text message the client
+// sends is a request - "<method> <URI>", optionally followed by a line feed and the body - and is passed to the HttpHandler
+// like any other. The reply is a text message holding the status code, and then a space and the content, if there is any.
+// The server also pushes changes to the application's state to the client, as they happen:
+
+// Checks for changes to the state pushed to WebSocket clients, and returns a bitmask of the parts of it that have changed
+// since the last call. What each bit stands for is up to the application. buf (size bytes) is scratch space. Called every
+// HTTP_WEBSOCKET_POLL_INTERVAL milliseconds, while any WebSocket clients are connected.
+typedef uint16_t WebSocketPoller(char* buf, size_t size);
+
+// Writes a message to a WebSocket client into buf, which holds size bytes, pushing some or all of the parts of the state in
+// pending (a bitmask from WebSocketPoller). Clears the bits for the parts it wrote, and returns the message's length, or 0 if
+// there's nothing to push. A new client starts with every bit set, so it gets the whole state.
+typedef size_t WebSocketPusher(char* buf, size_t size, uint16_t& pending);
+
+const char* httpMethodToString(HttpMethod); // Returns a PROGMEM string containing the name of the method (e.g. "GET")
+
 class HttpServer {
 	uint8_t numConnections;
 	uint8_t maxConnections;
@@ -85,11 +172,48 @@ class HttpServer {
 	EthernetClient clients[HTTP_MAX_CONNECTIONS];
 	HttpConnection connections[HTTP_MAX_CONNECTIONS];
 
+	HttpResponseBuffer responseBuffers[HTTP_RESPONSE_BUFFER_CNT];
+	uint8_t freeResponseBuffers; // bitmask
+
 	HttpHandler* handler;
+	HttpClassifier* classifier;
+	WebSocketPoller* poller;
+	WebSocketPusher* pusher;
+
+	uint32_t lastPoll; // millis() time the poller was last called
+	uint16_t reclaimedConnections;
+	uint8_t webSocketCount;
+
+	// Gives the connection a response buffer from the pool, and points its response at it. Returns false if they're all in use.
+	bool acquireResponseBuffer(HttpConnection&);
+	// Returns the connection's response buffer, if any, to the pool
+	void releaseResponseBuffer(HttpConnection&);
+	// Disconnects the client in the given slot, and frees the slot up for the next one
+	void closeConnection(uint8_t index);
+	// Sets the priority of the connection's request, once its method and URI have arrived. A normal request gets a 503 if
+	// it would take a reserved connection.
+	void classifyRequest(uint8_t index);
+	// Answers the request the connection has received, if any, and sends as much of the response as there's room for
+	void respond(uint8_t index, uint32_t now);
+	// Like respond(), for a WebSocket connection: answers the message or control frame it has received, if any, and pushes
+	// any state changes the client hasn't seen yet
+	void respondWebSocket(uint8_t index, uint32_t now);
 public:
-	HttpServer(EthernetServer& server, uint8_t maxConnections, HttpHandler* handler);
+	// If classifier is nullptr, every request is normal, and no connections are reserved. If poller or pusher is nullptr,
+	// WebSocket clients can still send requests, but nothing is pushed to them.
+	HttpServer(EthernetServer& server, uint8_t maxConnections, HttpHandler* handler, HttpClassifier* classifier = nullptr,
+			WebSocketPoller* poller = nullptr, WebSocketPusher* pusher = nullptr);
 	void begin(void);
-	void serve(void);
+	// Accepts new connections, and makes progress on every open one. now is the millis() time of the call.
+	void serve(uint32_t now);
+
+	// Returns the number of connections in use
+	inline uint8_t getConnectionCount(void) const { return numConnections; }
+	// Returns the number of connections that have been upgraded to WebSockets
+	inline uint8_t getWebSocketCount(void) const { return webSocketCount; }
+	// Returns the number of connections the server has closed because they timed out (see HTTP_IDLE_TIMEOUT). Wraps around
+	// at 65535.
+	inline uint16_t getReclaimedConnectionCount(void) const { return reclaimedConnections; }
 };
 
 // TODO: HttpClient??
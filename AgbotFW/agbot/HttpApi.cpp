@@ -22,196 +22,255 @@ static const char CONTENT_TYPE__TEXT_PLAIN[] PROGMEM = "Content-Type: text/plain
 
 //TODO: want to replace atoi() calls with strtol() or similar
 
-// TODO: this approach assumes each response is sent before the next message comes in
-static char responseHeaders[256] = {0};
-static char responseBody[256] = {0};
-
-// helper handlers called by httpHandler and its children
-static HttpHandler webpageHandler;
-static HttpHandler versionHandler;
-static HttpHandler apiHandler;
-static HttpHandler configHandler;
-static HttpHandler gpsHandler;
-static HttpHandler hitchHandler;
-static HttpHandler tillerHandler;
-static HttpHandler sprayerHandler;
-static HttpHandler weedHandler;
-static HttpHandler heightSensorsHandler;
-
-static HttpHandler notImplementedHandler;
-static HttpHandler notFoundHandler;
-static HttpHandler methodNotAllowedHandler;
+// Handles a request routed to it by httpHandler. param is the rest of the URI after the route's path and a '/', for routes
+// that take a parameter (e.g. "3" for "/api/tillers/3"), or nullptr if there isn't one. The query string is stripped.
+typedef void RouteHandler(HttpRequest const&, HttpResponse&, char* param);
+
+// route handlers called by httpHandler
+static RouteHandler webpageHandler;
+static RouteHandler versionHandler;
+static RouteHandler configHandler;
+static RouteHandler gpsHandler;
+static RouteHandler hitchHandler;
+static RouteHandler tillerHandler;
+static RouteHandler sprayerHandler;
+static RouteHandler weedHandler;
+static RouteHandler heightSensorsHandler;
+static RouteHandler metricsHandler;
+static RouteHandler httpMetricsHandler;
+static RouteHandler webSocketHandler;
+
+static RouteHandler notImplementedHandler;
+static void notFoundHandler(HttpResponse& response);
+static void methodNotAllowedHandler(HttpResponse& response, uint8_t allowedMethods);
 
 static void handleParseError(HttpRequest const& request, HttpResponse& response, ParseStatus error);
 
-void httpHandler(HttpRequest const& request, HttpResponse& response) {
-	*responseHeaders = '\0';
-	*responseBody = '\0';
-	response.headers = responseHeaders;
-	response.headersLength = 0;
+// streamed content writers (see HttpContentWriter)
+static HttpContentWriter tillersWriter;
+static HttpContentWriter sprayersWriter;
+static HttpContentWriter metricsWriter;
 
-	if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/api"))) {
-		apiHandler(request, response);
-	}
-	else if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/version"))) {
-		versionHandler(request, response);
-	}
-	else if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/"))) {
-		webpageHandler(request, response);
-	}
-	else {
-		notFoundHandler(request, response);
+// Route paths are hashed as they're looked up, one character at a time, so the URI is only scanned once. The hash of each
+// path in the route table is computed at compile time.
+static constexpr uint16_t routeHashStep(uint16_t hash, char c) {
+	return static_cast<uint16_t>(hash * 31 + static_cast<uint8_t>(c));
+}
+static constexpr uint16_t routeHash(const char* path, uint16_t hash = 0) {
+	return *path ? routeHash(path + 1, routeHashStep(hash, *path)) : hash;
+}
+
+#define ALLOW(method)					(1 << static_cast<uint8_t>(HttpMethod::method))
+#define MAKE_ROUTE_PATH(name, path)		static const char name##_PATH[] PROGMEM = path; \
+										static const uint16_t name##_HASH = routeHash(path)
+#define ROUTE_METADATA(name, methods, urgentMethods, hasParam, handler) \
+										{ name##_PATH, name##_HASH, sizeof(name##_PATH) - 1, methods, urgentMethods, hasParam, handler }
+
+MAKE_ROUTE_PATH(WEEDS, "/api/weeds");
+MAKE_ROUTE_PATH(TILLERS, "/api/tillers");
+MAKE_ROUTE_PATH(SPRAYERS, "/api/sprayers");
+MAKE_ROUTE_PATH(HITCH, "/api/hitch");
+MAKE_ROUTE_PATH(CONFIG, "/api/config");
+MAKE_ROUTE_PATH(HEIGHT_SENSORS, "/api/heightSensors");
+MAKE_ROUTE_PATH(GPS, "/api/gps");
+MAKE_ROUTE_PATH(METRICS, "/api/metrics/loop");
+MAKE_ROUTE_PATH(HTTP_METRICS, "/api/metrics/http");
+MAKE_ROUTE_PATH(WEBSOCKET, "/api/ws");
+MAKE_ROUTE_PATH(VERSION, "/version");
+MAKE_ROUTE_PATH(WEBPAGE, "/");
+
+// Every endpoint, with the methods it allows. A route matches if the URI path is exactly the route's path, or, if the
+// route has a parameter, the route's path followed by '/' and anything else. Ordered roughly by how often they're called.
+// Commands to the actuators are urgent (see httpClassifier); reading their state is not.
+static const struct Route {
+	const char* path; // PROGMEM
+	uint16_t hash; // routeHash(path)
+	uint8_t pathLength;
+	uint8_t methods; // bitmask of the allowed methods
+	uint8_t urgentMethods; // bitmask of the methods whose requests are urgent
+	bool hasParam;
+	RouteHandler* handler;
+} routes[] PROGMEM = {
+	ROUTE_METADATA(WEEDS, ALLOW(POST), ALLOW(POST), true, weedHandler),
+	ROUTE_METADATA(TILLERS, ALLOW(GET) | ALLOW(PUT), ALLOW(PUT), true, tillerHandler),
+	ROUTE_METADATA(SPRAYERS, ALLOW(GET) | ALLOW(PUT), ALLOW(PUT), true, sprayerHandler),
+	ROUTE_METADATA(HITCH, ALLOW(GET) | ALLOW(PUT), ALLOW(PUT), false, hitchHandler),
+	ROUTE_METADATA(CONFIG, ALLOW(GET) | ALLOW(PUT), 0, true, configHandler),
+	ROUTE_METADATA(HEIGHT_SENSORS, ALLOW(GET), 0, false, heightSensorsHandler),
+	ROUTE_METADATA(GPS, ALLOW(GET), 0, false, gpsHandler),
+	ROUTE_METADATA(METRICS, ALLOW(GET), 0, false, metricsHandler),
+	ROUTE_METADATA(HTTP_METRICS, ALLOW(GET), 0, false, httpMetricsHandler),
+	ROUTE_METADATA(WEBSOCKET, ALLOW(GET), 0, false, webSocketHandler),
+	ROUTE_METADATA(VERSION, ALLOW(GET), 0, false, versionHandler),
+	ROUTE_METADATA(WEBPAGE, ALLOW(GET), 0, false, webpageHandler),
+};
+static const uint8_t ROUTE_CNT = sizeof(routes) / sizeof(routes[0]);
+
+// Finds the route for the given URI path, in a single pass over it. The path is hashed as it's scanned; at the end of each
+// path segment, the hash is checked against the table. The path ends at the query string, if there is one, but the query
+// string is left in the URI, so strip it first if the route's parameter is needed. Stores the route's parameter (or
+// nullptr) in param. Returns the route's index, or ROUTE_CNT if there's no match.
+static uint8_t findRoute(char* path, char*& param) {
+	uint16_t hash = 0;
+	for (uint8_t i = 0; ; i++) {
+		char c = path[i] == '?' ? '\0' : path[i];
+		if (!c || (c == '/' && i)) {
+			// path[0:i] is a candidate route path
+			for (uint8_t j = 0; j < ROUTE_CNT; j++) {
+				if (pgm_read_word(&routes[j].hash) == hash && pgm_read_byte(&routes[j].pathLength) == i
+						&& (c ? pgm_read_byte(&routes[j].hasParam) : true)
+						&& !strncmp_P(path, reinterpret_cast<const char*>(pgm_read_ptr(&routes[j].path)), i)) {
+					param = c ? path + i + 1 : nullptr;
+					return j;
+				}
+			}
+			if (!c) {
+				return ROUTE_CNT;
+			}
+		}
+		hash = routeHashStep(hash, c);
 	}
 }
 
-static void webpageHandler(HttpRequest const& request, HttpResponse& response) {
-	notImplementedHandler(request, response);
+// Weed commands, and the other commands to the actuators, are urgent. Only looks at the method and URI, which may arrive
+// before the rest of the request. Leaves the request as it is - httpHandler strips the query string later.
+bool httpClassifier(HttpRequest const& request) {
+	char* param;
+	uint8_t route = findRoute(request.uri, param);
+	return route != ROUTE_CNT && (pgm_read_byte(&routes[route].urgentMethods) & (1 << static_cast<uint8_t>(request.method)));
 }
 
-static void versionHandler(HttpRequest const& request, HttpResponse& response) {
-	if (request.method == HttpMethod::GET) {
-		response.version = HttpVersion::Http_11;
-		response.responseCode = 200;
-		memccpy_P(responseHeaders + response.headersLength, CONTENT_TYPE__TEXT_PLAIN,
-					'\0', sizeof(responseHeaders) - response.headersLength);
-		response.headersLength = MIN(sizeof(responseHeaders), response.headersLength + sizeof(CONTENT_TYPE__TEXT_PLAIN) - 1);
+void httpHandler(HttpRequest const& request, HttpResponse& response) {
+	// ignore the query string
+	char *query = strchr(request.uri, '?');
+	if (query) {
+		*query = '\0';
+	}
 
-		response.content =         PSTR(AGBOTFW_VERSION " - built " __DATE__ " " __TIME__);
-		response.contentLength = sizeof(AGBOTFW_VERSION " - built " __DATE__ " " __TIME__) - 1;
-		response.isContentInProgmem = true;
+	char* param;
+	uint8_t route = findRoute(request.uri, param);
+	if (route == ROUTE_CNT) {
+		notFoundHandler(response);
+		return;
 	}
-	else {
-		methodNotAllowedHandler(request, response);
+	uint8_t allowedMethods = pgm_read_byte(&routes[route].methods);
+	if (!(allowedMethods & (1 << static_cast<uint8_t>(request.method)))) {
+		methodNotAllowedHandler(response, allowedMethods);
+		return;
 	}
+	RouteHandler* handler = reinterpret_cast<RouteHandler*>(pgm_read_ptr(&routes[route].handler));
+	handler(request, response, param);
 }
 
-static void apiHandler(HttpRequest const& request, HttpResponse& response) {
-	if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/api/weeds"))) {
-		weedHandler(request, response);
-	}
-	else if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/api/config"))) {
-		configHandler(request, response);
-	}
-	else if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/api/gps"))) {
-		gpsHandler(request, response);
-	}
-	else if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/api/tillers"))) {
-		tillerHandler(request, response);
-	}
-	else if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/api/sprayers"))) {
-		sprayerHandler(request, response);
-	}
-	else if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/api/hitch"))) {
-		hitchHandler(request, response);
-	}
-	else if (!strncmp_P(request.uri, PSTR_AND_LENGTH("/api/heightSensors"))) {
-		heightSensorsHandler(request, response);
-	}
-	else {
-		notFoundHandler(request, response);
-	}
+static void webpageHandler(HttpRequest const& request, HttpResponse& response, char* param) {
+	notImplementedHandler(request, response, param);
 }
 
+static void versionHandler(HttpRequest const& request, HttpResponse& response, char* param) {
+	response.version = HttpVersion::Http_11;
+	response.responseCode = 200;
+	memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__TEXT_PLAIN,
+				'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+	response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__TEXT_PLAIN) - 1);
+
+	response.content =         PSTR(AGBOTFW_VERSION " - built " __DATE__ " " __TIME__);
+	response.contentLength = sizeof(AGBOTFW_VERSION " - built " __DATE__ " " __TIME__) - 1;
+	response.isContentInProgmem = true;
+}
 
-static void configHandler(HttpRequest const& request, HttpResponse& response) {
-	if (request.method != HttpMethod::GET && request.method != HttpMethod::PUT) {
-		methodNotAllowedHandler(request, response);
+static void configHandler(HttpRequest const& request, HttpResponse& response, char* settingStr) {
+	response.version = HttpVersion::Http_11;
+	if (!settingStr && request.method == HttpMethod::GET) {
+		response.responseCode = 200;
+		memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+					'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+		response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
+		const char *format = PSTR("{\n"
+			"\t\"BroadcastGroup\": %u,\n"
+			"\t\"BroadcastPeriod\": %u,\n"
+			"\t\"HitchAccuracy\": %u,\n"
+			"\t\"HitchLoweredHeight\": %u,\n"
+			"\t\"HitchRaisedHeight\": %u,\n"
+			"\t\"Precision\": %u,\n"
+			"\t\"ResponseDelay\": %u,\n"
+			"\t\"SprayerMinOffTime\": %u,\n"
+			"\t\"TillerAccuracy\": %u,\n"
+			"\t\"TillerLoweredHeight\": %u,\n"
+			"\t\"TillerLowerTime\": %u,\n"
+			"\t\"TillerRaisedHeight\": %u,\n"
+			"\t\"TillerRaiseTime\": %u\n"
+		"}");
+		response.contentLength = snprintf_P(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE - 1, format,
+			config.get(Setting::BroadcastGroup),
+			config.get(Setting::BroadcastPeriod),
+			config.get(Setting::HitchAccuracy),
+			config.get(Setting::HitchLoweredHeight),
+			config.get(Setting::HitchRaisedHeight),
+			config.get(Setting::Precision),
+			config.get(Setting::ResponseDelay),
+			config.get(Setting::SprayerMinOffTime),
+			config.get(Setting::TillerAccuracy),
+			config.get(Setting::TillerLoweredHeight),
+			config.get(Setting::TillerLowerTime),
+			config.get(Setting::TillerRaisedHeight),
+			config.get(Setting::TillerRaiseTime));
+		response.content = response.contentBuffer;
 	}
-	else {
-		response.version = HttpVersion::Http_11;
-		const char* settingStr = request.uri + sizeof("/api/config") - 1;
-		if ((!*settingStr || *settingStr == '?') && request.method == HttpMethod::GET) {
+	else if (settingStr) {
+		Setting setting;
+
+		uint16_t minValue;
+		uint16_t maxValue;
+		if (stringToSetting(settingStr, setting)) {
+			minValue = minSettingValue(setting);
+			maxValue = maxSettingValue(setting);
+		} 
+		else {
+			response.responseCode = 400;
+			SET_STATIC_CONTENT(response, "Unknown configuration setting.");
+			return;
+		}
+		if (request.method == HttpMethod::GET) {
 			response.responseCode = 200;
-			memccpy_P(responseHeaders + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
-						'\0', sizeof(responseHeaders) - response.headersLength);
-			response.headersLength = MIN(sizeof(responseHeaders), response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
-			const char *format = PSTR("{\n"
-				"\t\"HitchAccuracy\": %u,\n"
-				"\t\"HitchLoweredHeight\": %u,\n"
-				"\t\"HitchRaisedHeight\": %u,\n"
-				"\t\"Precision\": %u,\n"
-				"\t\"ResponseDelay\": %u,\n"
-				"\t\"TillerAccuracy\": %u,\n"
-				"\t\"TillerLoweredHeight\": %u,\n"
-				"\t\"TillerLowerTime\": %u,\n"
-				"\t\"TillerRaisedHeight\": %u,\n"
-				"\t\"TillerRaiseTime\": %u\n"
-			"}");
-			response.contentLength = snprintf_P(responseBody, sizeof(responseBody) - 1, format,
-				config.get(Setting::HitchAccuracy),
-				config.get(Setting::HitchLoweredHeight),
-				config.get(Setting::HitchRaisedHeight),
-				config.get(Setting::Precision),
-				config.get(Setting::ResponseDelay),
-				config.get(Setting::TillerAccuracy),
-				config.get(Setting::TillerLoweredHeight),
-				config.get(Setting::TillerLowerTime),
-				config.get(Setting::TillerRaisedHeight),
-				config.get(Setting::TillerRaiseTime));
-			response.content = responseBody;
+			memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+						'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+			response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
+			response.contentLength = snprintf_P(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE - 1, PSTR("%u"), config.get(setting));
+			response.content = response.contentBuffer;
 		}
-		else if (*settingStr == '/') {
-			settingStr++;
-			// ignore the query string if necessary to make sure the URI path is null-terminated
-			char *query = strchr(settingStr, '?');
-			if (query) {
-				*query = '\0';
-			}
-			Setting setting;
-
-			uint16_t minValue;
-			uint16_t maxValue;
-			if (stringToSetting(settingStr, setting)) {
-				minValue = minSettingValue(setting);
-				maxValue = maxSettingValue(setting);
-			} 
-			else {
+		else { // request.method == HttpMethod::PUT
+			char *endPtr;
+			long lval = strtol(request.content, &endPtr, 10);
+			if (!*request.content || *endPtr || lval < (long) minValue || lval > (long) maxValue) {
 				response.responseCode = 400;
-				SET_STATIC_CONTENT(response, "Unknown configuration setting.");
-				return;
+				response.contentLength = snprintf_P(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE - 1, PSTR("%s must be an integer between %u and %u, not \"%s\""), settingStr, minValue, maxValue, request.content);
+				response.content = response.contentBuffer;
 			}
-			if (request.method == HttpMethod::GET) {
-				response.responseCode = 200;
-				memccpy_P(responseHeaders + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
-							'\0', sizeof(responseHeaders) - response.headersLength);
-				response.headersLength = MIN(sizeof(responseHeaders), response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
-				response.contentLength = snprintf_P(responseBody, sizeof(responseBody) - 1, PSTR("%u"), config.get(setting));
-				response.content = responseBody;
-			}
-			else { // request.method == HttpMethod::PUT
-				char *endPtr;
-				long lval = strtol(request.content, &endPtr, 10);
-				if (!*request.content || *endPtr || lval < (long) minValue || lval > (long) maxValue) {
-					response.responseCode = 400;
-					response.contentLength = snprintf_P(responseBody, sizeof(responseBody) - 1, PSTR("%s must be an integer between %u and %u, not \"%s\""), settingStr, minValue, maxValue, request.content);
-					response.content = responseBody;
-				}
-				else {
-					response.responseCode = 204;
-					config.set(setting, (uint16_t) lval);
-				}
+			else {
+				response.responseCode = 204;
+				config.set(setting, (uint16_t) lval);
 			}
 		}
-		else {
-			notFoundHandler(request, response);
-		}
+	}
+	else {
+		notFoundHandler(response);
 	}
 }
 
-static void gpsHandler(HttpRequest const& request, HttpResponse& response) {
-	notImplementedHandler(request, response);
+static void gpsHandler(HttpRequest const& request, HttpResponse& response, char* param) {
+	notImplementedHandler(request, response, param);
 }
 
-static void hitchHandler(HttpRequest const& request, HttpResponse& response) {
+static void hitchHandler(HttpRequest const& request, HttpResponse& response, char* param) {
 	response.version = HttpVersion::Http_11;
 	switch (request.method) {
 		case HttpMethod::GET:
 			response.responseCode = 200;
-			memccpy_P(responseHeaders + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
-						'\0', sizeof(responseHeaders) - response.headersLength);
-			response.headersLength = MIN(sizeof(responseHeaders), response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
-			response.contentLength = hitch.serialize(responseBody, sizeof(responseBody));
-			response.content = responseBody;
+			memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+						'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+			response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
+			response.contentLength = hitch.serialize(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE);
+			response.content = response.contentBuffer;
 		break;
 		case HttpMethod::PUT: {
 			PutHitch hitchCommand;
@@ -242,65 +301,49 @@ static void hitchHandler(HttpRequest const& request, HttpResponse& response) {
 			}
 		} break;
 		default:
-			methodNotAllowedHandler(request, response);
+			assert(0); // the route table only allows GET and PUT
 		break;
 	}
 }
 
-static void tillerHandler(HttpRequest const& request, HttpResponse& response) {
+static void tillerHandler(HttpRequest const& request, HttpResponse& response, char* idStr) {
 	response.version = HttpVersion::Http_11;
-	char* idStr = request.uri + sizeof("/api/tillers") - 1;
 	switch (request.method) {
 		case HttpMethod::GET: {
-			if (*idStr && *++idStr) {
+			if (idStr && *idStr) {
 				int id = atoi(idStr);
 				if (id < 0 || id >= Tiller::COUNT) {
 					response.responseCode = 400;
-					response.contentLength = snprintf_P(responseBody, sizeof(responseBody) - 1, PSTR("id must be between 0 and %d - was '%s'"), Tiller::COUNT - 1, idStr);
-					response.content = responseBody;
+					response.contentLength = snprintf_P(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE - 1, PSTR("id must be between 0 and %d - was '%s'"), Tiller::COUNT - 1, idStr);
+					response.content = response.contentBuffer;
 				}
 				else {
-					memccpy_P(responseHeaders + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
-								'\0', sizeof(responseHeaders) - response.headersLength);
-					response.headersLength = MIN(sizeof(responseHeaders), response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
-					response.contentLength = tillers[id].serialize(responseBody, sizeof(responseBody));
-					response.content = responseBody;
+					response.responseCode = 200;
+					memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+								'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+					response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
+					response.contentLength = tillers[id].serialize(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE);
+					response.content = response.contentBuffer;
 				}
 			}
 			else {
-				memccpy_P(responseHeaders + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
-							'\0', sizeof(responseHeaders) - response.headersLength);
-				response.headersLength = MIN(sizeof(responseHeaders), response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
-
-
-				size_t len = 1;
-				*responseBody = '['; // opening array element
-				for (int i = 0; i < Tiller::COUNT; i++) {
-					if (len < sizeof(responseBody) - 1) {
-						len += tillers[i].serialize(responseBody + len, sizeof(responseBody) - len);
-
-						if (len < sizeof(responseBody) - 1 && i + 1 < Tiller::COUNT) {
-							responseBody[len++] = ',';
-						}
-					}
-				}
-				if (len < sizeof(responseBody) - 1) {
-					responseBody[len++] = ']';
-				}
-				responseBody[len] = '\0';
+				response.responseCode = 200;
+				memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+							'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+				response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
 
-				response.contentLength = len;
-				response.content = responseBody;
+				// streamed, so the array is never truncated, however many tillers there are
+				response.writer = tillersWriter;
 			}
 		} break;
 		case HttpMethod::PUT: {
 			int id = -1;
-			if (*idStr && *++idStr) {
+			if (idStr && *idStr) {
 				id = atoi(idStr);
 				if (id < 0 || id >= Tiller::COUNT) {
 					response.responseCode = 400;
-					response.contentLength = snprintf_P(responseBody, sizeof(responseBody) - 1, PSTR("id must be between 0 and %d - was '%s'"), Tiller::COUNT - 1, idStr);
-					response.content = responseBody;
+					response.contentLength = snprintf_P(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE - 1, PSTR("id must be between 0 and %d - was '%s'"), Tiller::COUNT - 1, idStr);
+					response.content = response.contentBuffer;
 					return;
 				}
 			}
@@ -313,9 +356,10 @@ static void tillerHandler(HttpRequest const& request, HttpResponse& response) {
 					tillers[id].setHeight(tillerCommand.targetHeight, tillerCommand.delay);
 				}
 				else {
-					// do this for all tillers
+					// do this for all tillers, timed from the same instant
+					uint32_t now = micros();
 					for (id = 0; id < Tiller::COUNT; id++) {
-						tillers[id].setHeight(tillerCommand.targetHeight, tillerCommand.delay);
+						tillers[id].setHeight(tillerCommand.targetHeight, tillerCommand.delay, now);
 					}
 				}
 				// send a 204 No Content to indicate success
@@ -327,54 +371,37 @@ static void tillerHandler(HttpRequest const& request, HttpResponse& response) {
 				handleParseError(request, response, result);
 			}
 		} break;
-		default: methodNotAllowedHandler(request, response);
+		default: assert(0); // the route table only allows GET and PUT
 	}
 }
 
-static void sprayerHandler(HttpRequest const& request, HttpResponse& response) {
+static void sprayerHandler(HttpRequest const& request, HttpResponse& response, char* idStr) {
 	response.version = HttpVersion::Http_11;
-	char *idStr = request.uri + sizeof("/api/sprayers") - 1;
 	switch (request.method) {
 		case HttpMethod::GET: {
-			if (*idStr && *++idStr) {
+			if (idStr && *idStr) {
 				int id = atoi(idStr);
 				if (id < 0 || id >= Sprayer::COUNT) {
 					response.responseCode = 400;
-					response.contentLength = snprintf_P(responseBody, sizeof(responseBody) - 1, PSTR("id must be between 0 and %d - was '%s'"), Sprayer::COUNT - 1, idStr);
-					response.content = responseBody;
+					response.contentLength = snprintf_P(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE - 1, PSTR("id must be between 0 and %d - was '%s'"), Sprayer::COUNT - 1, idStr);
+					response.content = response.contentBuffer;
 					return;
 				}
 				response.responseCode = 200;
-				memccpy_P(responseHeaders + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
-							'\0', sizeof(responseHeaders) - response.headersLength);
-				response.headersLength = MIN(sizeof(responseHeaders), response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
-				response.contentLength = sprayers[id].serialize(responseBody, sizeof(responseBody));
-				response.content = responseBody;
+				memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+							'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+				response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
+				response.contentLength = sprayers[id].serialize(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE);
+				response.content = response.contentBuffer;
 			}
 			else {
 				response.responseCode = 200;
-				memccpy_P(responseHeaders + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
-							'\0', sizeof(responseHeaders) - response.headersLength);
-				response.headersLength = MIN(sizeof(responseHeaders), response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
-
-				size_t len = 1;
-				*responseBody = '['; // opening array element
-				for (int i = 0; i < Sprayer::COUNT; i++) {
-					if (len < sizeof(responseBody) - 1) {
-						len += sprayers[i].serialize(responseBody + len, sizeof(responseBody) - len);
-
-						if (len < sizeof(responseBody) - 1 && i + 1 < Sprayer::COUNT) {
-							responseBody[len++] = ',';
-						}
-					}
-				}
-				if (len < sizeof(responseBody) - 1) {
-					responseBody[len++] = ']';
-				}
-				responseBody[len] = '\0';
+				memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+							'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+				response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
 
-				response.contentLength = len;
-				response.content = responseBody;
+				// streamed, so the array is never truncated, however many sprayers there are
+				response.writer = sprayersWriter;
 			}
 		} break;
 		case HttpMethod::PUT: {
@@ -384,7 +411,7 @@ static void sprayerHandler(HttpRequest const& request, HttpResponse& response) {
 				// -2 means {id} == "left" (i.e. sprayers 0-3)
 				// -3 means {id} == "right" (i.e. sprayers 4-7)
 			int id = -1;
-			if (*idStr && *++idStr) {
+			if (idStr && *idStr) {
 				if (!strncmp_P(idStr, PSTR_AND_LENGTH("left"))) {
 					id = -2;
 				}
@@ -395,8 +422,8 @@ static void sprayerHandler(HttpRequest const& request, HttpResponse& response) {
 					id = atoi(idStr);
 					if (id < 0 || id >= Sprayer::COUNT) {
 						response.responseCode = 400;
-						response.contentLength = snprintf_P(responseBody, sizeof(responseBody) - 1, PSTR("id must be \"left\", \"right\", or between 0 and %d - was '%s'"), Sprayer::COUNT - 1, idStr);
-						response.content = responseBody;
+						response.contentLength = snprintf_P(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE - 1, PSTR("id must be \"left\", \"right\", or between 0 and %d - was '%s'"), Sprayer::COUNT - 1, idStr);
+						response.content = response.contentBuffer;
 						return;
 					}
 				}
@@ -409,8 +436,9 @@ static void sprayerHandler(HttpRequest const& request, HttpResponse& response) {
 				}
 				else {
 					uint8_t end = (id == -2 ? Sprayer::COUNT >> 1 : Sprayer::COUNT);
+					uint32_t now = micros(); // so the sprayers switch together
 					for (uint8_t i = (id == -3 ? Sprayer::COUNT >> 1 : 0); i < end; i++) {
-						sprayers[i].setStatus(sprayerCommand.status, sprayerCommand.delay);
+						sprayers[i].setStatus(sprayerCommand.status, sprayerCommand.delay, now);
 					}
 				}
 				response.responseCode = 204;
@@ -421,7 +449,7 @@ static void sprayerHandler(HttpRequest const& request, HttpResponse& response) {
 				handleParseError(request, response, result);
 			}
 		} break;
-		default: methodNotAllowedHandler(request, response);
+		default: assert(0); // the route table only allows GET and PUT
 	}
 }
 
@@ -437,15 +465,63 @@ static inline uint8_t parseHex(char nibble) {
 	}
 	return 255;
 }
-static void weedHandler(HttpRequest const& request, HttpResponse& response) {
-	if (request.method != HttpMethod::POST) {
-		methodNotAllowedHandler(request, response);
-		return;
+// Applies a batch of weeds from the body of a POST /api/weeds. The whole batch is parsed and validated before any of it is
+// applied, so a bad event rejects the batch rather than leaving half of it scheduled. Every event is then timed from the
+// same instant, and scheduled within this one call, so the weeds seen in a camera frame are killed together.
+static void weedBatchHandler(HttpRequest const& request, HttpResponse& response) {
+	uint32_t now = micros();
+	WeedBatch batch;
+	switch (parseWeedBatch(request.content, request.contentLength, millis(), batch)) {
+		case ParseStatus::SUCCESS:
+			break;
+		case ParseStatus::SYNTAX_ERROR:
+			SET_STATIC_CONTENT(response, "Malformed weed batch in request body");
+			response.responseCode = 400;
+			return;
+		case ParseStatus::BUFFER_OVERFLOW:
+			SET_STATIC_CONTENT(response, "Too many weeds in batch");
+			response.responseCode = 400;
+			return;
+		case ParseStatus::SEMANTIC_ERROR:
+			SET_STATIC_CONTENT(response, "Invalid weed in batch");
+			response.responseCode = 400;
+			return;
+		default:
+			assert(0);
+	}
+
+	uint16_t responseDelay = config.get(Setting::ResponseDelay);
+	for (uint8_t i = 0; i < batch.count; i++) {
+		WeedEvent const& event = batch.events[i];
+		if (hasWeedPassed(event, responseDelay)) {
+			LOG_WARNING("Weed %hhu in batch has already passed the implements - ignored", i);
+			continue;
+		}
+		uint32_t time = now + event.offset * 1000L;
+		for (uint8_t j = 0; j < Tiller::COUNT; j++) {
+			if (event.tillers & (1 << j)) {
+				tillers[j].killWeed(time);
+			}
+		}
+		for (uint8_t j = 0; j < Sprayer::COUNT; j++) {
+			if (event.sprayers & (1 << j)) {
+				sprayers[j].killWeed(time);
+			}
+		}
 	}
+	response.responseCode = 204;
+	response.contentLength = 0;
+	response.content = nullptr;
+}
+
+static void weedHandler(HttpRequest const& request, HttpResponse& response, char* cmdStr) {
 	// TODO consider returning "409 Conflict" if the hitch is up. Would need to document this decision
 	response.version = HttpVersion::Http_11;
-	char* cmdStr = request.uri + sizeof("/api/weeds") - 1;
-	bool cmdValid = *cmdStr == '/' && strlen(++cmdStr) == 5;
+	if (!cmdStr) {
+		weedBatchHandler(request, response);
+		return;
+	}
+	bool cmdValid = cmdStr && strlen(cmdStr) == 5;
 	if (cmdValid) {
 		for (int i = 0; i < 5; i++) {
 			if (parseHex(cmdStr[i]) > 0x0F) {
@@ -457,21 +533,25 @@ static void weedHandler(HttpRequest const& request, HttpResponse& response) {
 
 	if (!cmdValid) {
 		response.responseCode = 400;
-		response.contentLength = snprintf_P(responseBody, sizeof(responseBody) - 1, PSTR("Expected 5-character hex string in URL, not '%s'"), cmdStr);
-		response.content = responseBody;
+		response.contentLength = snprintf_P(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE - 1, PSTR("Expected 5-character hex string in URL, not '%s'"), cmdStr ? cmdStr : "");
+		response.content = response.contentBuffer;
 		return;
 	}
 	else {
+		// every implement in the command is timed from the same instant
+		uint32_t now = micros();
 		for (int i = 0; i < Tiller::COUNT; i++) {
 			if (parseHex(cmdStr[i << 1])) {
 				// tiller i is at index 2*i in the command string. If it is not '0', we should lower the tiller to kill whatever's in the row
-				tillers[i].killWeed();
+				tillers[i].killWeed(now);
 			}
 		}
+		// bit i is sprayer i, the same as in the SprayerBank. Every sprayer in the command gets the same timing, so their
+		// kill windows come due together, and the bank switches them all in the same flush.
 		uint8_t sprayerCmd = parseHex(cmdStr[1]) | (parseHex(cmdStr[3]) << 4);
 		for (int i = 0; i < Sprayer::COUNT; i++) {
 			if (sprayerCmd & (1 << i)) {
-				sprayers[i].killWeed();
+				sprayers[i].killWeed(now);
 			}
 		}
 		response.responseCode = 204;
@@ -480,39 +560,268 @@ static void weedHandler(HttpRequest const& request, HttpResponse& response) {
 	}
 }
 
-static void heightSensorsHandler(HttpRequest const& request, HttpResponse& response) {
-	if (request.method != HttpMethod::GET) {
-		methodNotAllowedHandler(request, response);
+static void heightSensorsHandler(HttpRequest const& request, HttpResponse& response, char* param) {
+	response.version = HttpVersion::Http_11;
+	response.responseCode = 200;
+	memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+				'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+	response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
+
+	response.contentLength = heightSensors.serialize(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE);
+	response.content = response.contentBuffer;
+}
+
+static void metricsHandler(HttpRequest const& request, HttpResponse& response, char* param) {
+	response.version = HttpVersion::Http_11;
+	response.responseCode = 200;
+	memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+				'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+	response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
+
+	// The report is too big for the content buffer, so it's streamed. Each bucket is cleared as it's written, so each read
+	// reports the timings since the previous one.
+	response.writer = metricsWriter;
+}
+
+static size_t metricsWriter(char* buf, size_t size, uint16_t& state) {
+	return scheduler.writeMetrics(buf, size, state);
+}
+
+// Serializes the element at the given index into str, like Tiller::serialize() and Sprayer::serialize()
+typedef size_t ElementSerializer(char* str, size_t n, uint8_t index);
+
+// Streams a JSON array of count elements, as many as fit in each piece. state is 0 for the opening bracket, 1 to count for
+// the elements, and count + 1 for the closing bracket. No element may be bigger than HTTP_MIN_CHUNK_SIZE - 2, so the next
+// one always fits in an empty piece.
+static size_t writeJsonArray(char* buf, size_t size, uint16_t& state, uint8_t count, ElementSerializer* serializeElement) {
+	size_t len = 0;
+	for (; state <= count + 1; state++) {
+		if (len + 1 >= size) {
+			break; // no more room - continue in the next piece
+		}
+		if (state == 0) {
+			buf[len++] = '[';
+		}
+		else if (state <= count) {
+			uint8_t separatorLen = state > 1 ? 1 : 0; // a comma before every element but the first
+			size_t elementLen = serializeElement(buf + len + separatorLen, size - len - separatorLen, state - 1);
+			if (len + separatorLen + elementLen >= size) {
+				break; // it was truncated - write it again in the next piece
+			}
+			if (separatorLen) {
+				buf[len] = ',';
+			}
+			len += separatorLen + elementLen;
+		}
+		else {
+			buf[len++] = ']';
+		}
+	}
+	return len;
+}
+
+static size_t serializeTiller(char* str, size_t n, uint8_t index) {
+	return tillers[index].serialize(str, n);
+}
+
+static size_t tillersWriter(char* buf, size_t size, uint16_t& state) {
+	return writeJsonArray(buf, size, state, Tiller::COUNT, serializeTiller);
+}
+
+static size_t serializeSprayer(char* str, size_t n, uint8_t index) {
+	return sprayers[index].serialize(str, n);
+}
+
+static size_t sprayersWriter(char* buf, size_t size, uint16_t& state) {
+	return writeJsonArray(buf, size, state, Sprayer::COUNT, serializeSprayer);
+}
+
+static void httpMetricsHandler(HttpRequest const& request, HttpResponse& response, char* param) {
+	response.version = HttpVersion::Http_11;
+	response.responseCode = 200;
+	memccpy_P(response.headers + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
+				'\0', HTTP_RESPONSE_HEADERS_SIZE - response.headersLength);
+	response.headersLength = MIN(HTTP_RESPONSE_HEADERS_SIZE, response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
+
+	response.contentLength = snprintf_P(response.contentBuffer, HTTP_RESPONSE_CONTENT_SIZE - 1,
+			PSTR("{\"connections\": %u, \"webSockets\": %u, \"reclaimed\": %u}"),
+			server.getConnectionCount(), server.getWebSocketCount(), server.getReclaimedConnectionCount());
+	response.content = response.contentBuffer;
+}
+
+static void webSocketHandler(HttpRequest const& request, HttpResponse& response, char* param) {
+	response.version = HttpVersion::Http_11;
+	if (request.isWebSocketUpgrade) {
+		response.responseCode = 101; // the server does the rest
+		return;
+	}
+	response.responseCode = 426;
+	strcpy_P(response.headers, PSTR("Upgrade: websocket\r\n"));
+	response.headersLength = sizeof("Upgrade: websocket\r\n") - 1;
+	SET_STATIC_CONTENT(response, "Expected a WebSocket upgrade request");
+}
+
+// The state pushed to WebSocket clients. Each bit in a client's pending pushes (see WebSocketPusher) is one item: a tiller,
+// a sprayer, the hitch, or the height sensors.
+#define PUSH_TILLERS			(0)
+#define PUSH_SPRAYERS			(PUSH_TILLERS + Tiller::COUNT)
+#define PUSH_HITCH				(PUSH_SPRAYERS + Sprayer::COUNT)
+#define PUSH_HEIGHT_SENSORS		(PUSH_HITCH + 1)
+#define PUSH_ITEM_CNT			(PUSH_HEIGHT_SENSORS + 1)
+static_assert(PUSH_ITEM_CNT <= 16, "Too many items to push to WebSocket clients");
+
+// The raw state of each item when it was last polled, to tell when it's changed. Comparing these is much cheaper than
+// serializing every item on every poll, and unlike a hash of the JSON, can't miss a change.
+struct ActuatorPushState {
+	uint8_t height;
+	int8_t dh;
+	uint8_t target;
+	bool operator!=(ActuatorPushState const& other) const {
+		return height != other.height || dh != other.dh || target != other.target;
+	}
+};
+struct SprayerPushState {
+	bool status;
+	uint16_t bridged;
+	uint16_t avoided;
+	bool operator!=(SprayerPushState const& other) const {
+		return status != other.status || bridged != other.bridged || avoided != other.avoided;
+	}
+};
+struct HeightSensorPushState {
+	bool paired;
+	uint16_t serial;
+	uint16_t height;
+	bool operator!=(HeightSensorPushState const& other) const {
+		return paired != other.paired || serial != other.serial || height != other.height;
+	}
+};
+static struct {
+	ActuatorPushState tillers[Tiller::COUNT];
+	SprayerPushState sprayers[Sprayer::COUNT];
+	ActuatorPushState hitch;
+	bool heightSensorConflict;
+	HeightSensorPushState heightSensors[LidarLiteBank::NUM_SENSORS];
+} pushedState;
+
+// Stores current in pushed, and returns true, if it's changed
+template<typename T>
+static inline bool updatePushState(T& pushed, T const& current) {
+	if (current != pushed) {
+		pushed = current;
+		return true;
+	}
+	return false;
+}
+
+// Serializes the item as its path, a space, and the same JSON a GET on the path returns; e.g. "/api/tillers/1 {...}". Like
+// the serialize() methods, returns the length it would be if it were truncated.
+static size_t serializePushItem(char* str, size_t n, uint8_t item) {
+	size_t len;
+	if (item < PUSH_SPRAYERS) {
+		len = snprintf_P(str, n, PSTR("%S/%u "), TILLERS_PATH, item - PUSH_TILLERS);
+		return len < n ? len + tillers[item - PUSH_TILLERS].serialize(str + len, n - len) : len;
+	}
+	else if (item < PUSH_HITCH) {
+		len = snprintf_P(str, n, PSTR("%S/%u "), SPRAYERS_PATH, item - PUSH_SPRAYERS);
+		return len < n ? len + sprayers[item - PUSH_SPRAYERS].serialize(str + len, n - len) : len;
+	}
+	else if (item == PUSH_HITCH) {
+		len = snprintf_P(str, n, PSTR("%S "), HITCH_PATH);
+		return len < n ? len + hitch.serialize(str + len, n - len) : len;
 	}
 	else {
-		response.version = HttpVersion::Http_11;
-		response.responseCode = 200;
-		memccpy_P(responseHeaders + response.headersLength, CONTENT_TYPE__APPLICATION_JSON,
-					'\0', sizeof(responseHeaders) - response.headersLength);
-		response.headersLength = MIN(sizeof(responseHeaders), response.headersLength + sizeof(CONTENT_TYPE__APPLICATION_JSON) - 1);
+		len = snprintf_P(str, n, PSTR("%S "), HEIGHT_SENSORS_PATH);
+		return len < n ? len + heightSensors.serialize(str + len, n - len) : len;
+	}
+}
 
-		response.headers = responseHeaders;
-		response.contentLength = heightSensors.serialize(responseBody, sizeof(responseBody));
-		response.content = responseBody;
+// Compares the raw state of every item to what it was at the last poll. Nothing is serialized until it's pushed, so buf
+// isn't needed.
+uint16_t webSocketPoller(char* buf, size_t size) {
+	uint16_t changes = 0;
+	for (uint8_t i = 0; i < Tiller::COUNT; i++) {
+		Tiller const& tiller = tillers[i];
+		ActuatorPushState current = { tiller.getActualHeight(), tiller.getDH(), tiller.getTargetHeight() };
+		if (updatePushState(pushedState.tillers[i], current)) {
+			changes |= 1U << (PUSH_TILLERS + i);
+		}
+	}
+	for (uint8_t i = 0; i < Sprayer::COUNT; i++) {
+		Sprayer const& sprayer = sprayers[i];
+		SprayerPushState current = { sprayer.getStatus(), sprayer.getBridgedGaps(), sprayer.getAvoidedToggles() };
+		if (updatePushState(pushedState.sprayers[i], current)) {
+			changes |= 1U << (PUSH_SPRAYERS + i);
+		}
+	}
+	ActuatorPushState hitchState = { hitch.getActualHeight(), hitch.getDH(), hitch.getTargetHeight() };
+	if (updatePushState(pushedState.hitch, hitchState)) {
+		changes |= 1U << PUSH_HITCH;
+	}
+	bool heightSensorsChanged = updatePushState(pushedState.heightSensorConflict, heightSensors.hasAddressConflict());
+	for (uint8_t i = 0; i < LidarLiteBank::NUM_SENSORS; i++) {
+		LidarLiteSensor& sensor = heightSensors[i];
+		HeightSensorPushState current = { sensor.isPaired(), sensor.getSerial(), sensor.getHeight() };
+		heightSensorsChanged |= updatePushState(pushedState.heightSensors[i], current);
+	}
+	if (heightSensorsChanged) {
+		changes |= 1U << PUSH_HEIGHT_SENSORS;
 	}
+	return changes;
 }
 
+// Pushes as many of the pending items as fit, one per line
+size_t webSocketPusher(char* buf, size_t size, uint16_t& pending) {
+	size_t len = 0;
+	pending &= static_cast<uint16_t>((1UL << PUSH_ITEM_CNT) - 1);
+	for (uint8_t i = 0; i < PUSH_ITEM_CNT; i++) {
+		if (!(pending & (1U << i))) {
+			continue;
+		}
+		uint8_t separatorLen = len ? 1 : 0; // a line feed before every item but the first
+		size_t itemLen = serializePushItem(buf + len + separatorLen, size - len - separatorLen, i);
+		if (len + separatorLen + itemLen >= size) {
+			if (len) {
+				break; // it was truncated - push it in the next message
+			}
+			LOG_WARNING("WebSocket push item %hhu is too big to push", i);
+			pending &= ~(1U << i);
+			continue;
+		}
+		if (separatorLen) {
+			buf[len] = '\n';
+		}
+		len += separatorLen + itemLen;
+		pending &= ~(1U << i);
+	}
+	return len;
+}
 
-static void notImplementedHandler(HttpRequest const& request, HttpResponse& response) {
+static void notImplementedHandler(HttpRequest const& request, HttpResponse& response, char* param) {
 	response.version = HttpVersion::Http_11;
 	response.responseCode = 501;
 	SET_STATIC_CONTENT(response, "Endpoint not implemented");
 }
 
-static void notFoundHandler(HttpRequest const& request, HttpResponse& response) {
+static void notFoundHandler(HttpResponse& response) {
 	response.version = HttpVersion::Http_11;
 	response.responseCode = 404;
 	SET_STATIC_CONTENT(response, "Requested resource not found.");
 }
 
-static void methodNotAllowedHandler(HttpRequest const& request, HttpResponse& response) {
+// Responds with a 405, and an Allow header listing the route's allowed methods (a bitmask of HttpMethods)
+static void methodNotAllowedHandler(HttpResponse& response, uint8_t allowedMethods) {
 	response.version = HttpVersion::Http_11;
 	response.responseCode = 405;
+	strcpy_P(response.headers, PSTR("Allow: "));
+	response.headersLength = sizeof("Allow: ") - 1;
+	for (uint8_t method = 0; allowedMethods >> method; method++) {
+		if (allowedMethods & (1 << method)) {
+			response.headersLength += snprintf_P(response.headers + response.headersLength, HTTP_RESPONSE_HEADERS_SIZE - response.headersLength,
+					PSTR("%S, "), httpMethodToString(static_cast<HttpMethod>(method)));
+		}
+	}
+	strcpy_P(response.headers + response.headersLength - 2, PSTR("\r\n")); // replace the last ", "
 	SET_STATIC_CONTENT(response, "Method not allowed");
 }
 
@@ -524,7 +833,7 @@ static void handleParseError(HttpRequest const& request, HttpResponse& response,
 			SET_STATIC_CONTENT(response, "Malformed JSON in request body");
 			break;
 		case ParseStatus::BUFFER_OVERFLOW:
-			SET_STATIC_CONTENT(response, "Too many JSON tokens");
+			SET_STATIC_CONTENT(response, "JSON nested too deeply");
 			break;
 		case ParseStatus::SEMANTIC_ERROR:
 			SET_STATIC_CONTENT(response, "Invalid JSON request");
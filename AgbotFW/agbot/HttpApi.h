@@ -10,3 +10,6 @@
 #include "Http.h"
 
 HttpHandler httpHandler;
+HttpClassifier httpClassifier;
+WebSocketPoller webSocketPoller;
+WebSocketPusher webSocketPusher;
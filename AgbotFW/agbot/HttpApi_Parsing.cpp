@@ -7,220 +7,178 @@
 
 #include "HttpApi_Parsing.h"
 
-#define JSMN_HEADER
-#define JSMN_PARENT_LINKS
-#include "jsmn.h"
-
-#define NUM_JSON_TOKENS 12
-static jsmn_parser jsonParser;
-static jsmntok_t jsonBuffer[NUM_JSON_TOKENS];
-
 #include "Tiller.h"
 #include "Hitch.h"
 
-// TODO watch out - this leads to a separate PSTR allocation for each call. May be wasteful if you compare against the same string in multiple places.
-#define TOKEN_IS(json, tok, s) ((tok).type == JSMN_STRING && (tok).end - (tok).start == sizeof(s) - 1 && !strncmp_P((json) + (tok).start, PSTR(s), sizeof(s) - 1))
+// Field names and enum strings shared by the schemas below
+static const char TARGET_HEIGHT_KEY[] PROGMEM = "targetHeight";
+static const char DELAY_KEY[] PROGMEM = "delay";
+static const char STATUS_KEY[] PROGMEM = "status";
+static const char STOP_STR[] PROGMEM = "STOP";
+static const char UP_STR[] PROGMEM = "UP";
+static const char DOWN_STR[] PROGMEM = "DOWN";
+static const char LOWERED_STR[] PROGMEM = "LOWERED";
+static const char RAISED_STR[] PROGMEM = "RAISED";
+static const char ON_STR[] PROGMEM = "ON";
+static const char OFF_STR[] PROGMEM = "OFF";
+
+static const JsonEnumValue TILLER_COMMANDS[] PROGMEM = {
+	{ STOP_STR, TillerCommand::STOP },
+	{ UP_STR, TillerCommand::UP },
+	{ DOWN_STR, TillerCommand::DOWN },
+	{ LOWERED_STR, TillerCommand::LOWERED },
+	{ RAISED_STR, TillerCommand::RAISED },
+};
+static const JsonField PUT_TILLER_FIELDS[] PROGMEM = {
+	JSON_UINT_OR_ENUM_FIELD(PutTiller, targetHeight, TARGET_HEIGHT_KEY, Tiller::MAX_HEIGHT, TILLER_COMMANDS, true),
+	JSON_UINT_FIELD(PutTiller, delay, DELAY_KEY, CommandQueue::MAX_DELAY, false),
+};
 
 ParseStatus parsePutTillerCmd(char* jsonString, size_t n, struct PutTiller& result) {
-	jsmn_init(&jsonParser);
-	int nTok = jsmn_parse(&jsonParser, jsonString, n, jsonBuffer, NUM_JSON_TOKENS);
-	
-	if (nTok < 0) {
-		switch (nTok) {
-			case JSMN_ERROR_NOMEM:
-				return ParseStatus::BUFFER_OVERFLOW;
-			default: // case JSMN_ERROR_INVAL: case JSMN_ERROR_PART:
-				return ParseStatus::SYNTAX_ERROR;
-		}
-	}
-	else if (jsonBuffer[0].type != JSMN_OBJECT) {
-		return ParseStatus::SEMANTIC_ERROR;
-	}
-	
-	bool hasTargetHeight = false;
-	bool hasDelay = false;
 	result.delay = 0;
+	return parseJsonObject(jsonString, n, PUT_TILLER_FIELDS, &result);
+}
 
-	for (int i = 1; i < nTok - 1; i++) {
-		jsmntok_t* tok = jsonBuffer + i;
-		if (tok->parent > 0) {
-			continue; // skip past any child objects, etc. We only care about direct children of the root
-		}
+static const JsonEnumValue SPRAYER_STATUSES[] PROGMEM = {
+	{ ON_STR, true },
+	{ OFF_STR, false },
+};
+static const JsonField PUT_SPRAYER_FIELDS[] PROGMEM = {
+	JSON_ENUM_FIELD(PutSprayer, status, STATUS_KEY, SPRAYER_STATUSES, true),
+	JSON_UINT_FIELD(PutSprayer, delay, DELAY_KEY, CommandQueue::MAX_DELAY, false),
+};
 
-		if (TOKEN_IS(jsonString, *tok, "targetHeight")) {
-			if (hasTargetHeight) {
-				return ParseStatus::SEMANTIC_ERROR;
-			}
-			tok++;
-			i++;
-			hasTargetHeight = true;
-			if (tok->type == JSMN_PRIMITIVE && *(jsonString + tok->start) >= '0' && *(jsonString + tok->start) <= '9') {
-				// jsonString is not null-terminated, but atoi() is safe here, as the string must be valid JSON ending with '}',
-				// and atoi stops at the first non-numeric character
-				int cmd = atoi(jsonString + tok->start);
-				if (cmd < 0 || cmd > Tiller::MAX_HEIGHT) {
-					return ParseStatus::SEMANTIC_ERROR;
-				}
-				result.targetHeight = static_cast<uint8_t>(cmd);
-			}
-			else if (TOKEN_IS(jsonString, *tok, "STOP")) {
-				result.targetHeight = static_cast<uint8_t>(TillerCommand::STOP);
-			}
-			else if (TOKEN_IS(jsonString, *tok, "UP")) {
-				result.targetHeight = static_cast<uint8_t>(TillerCommand::UP);
-			}
-			else if (TOKEN_IS(jsonString, *tok, "DOWN")) {
-				result.targetHeight = static_cast<uint8_t>(TillerCommand::DOWN);
-			}
-			else if (TOKEN_IS(jsonString, *tok, "LOWERED")) {
-				result.targetHeight = static_cast<uint8_t>(TillerCommand::LOWERED);
-			}
-			else if (TOKEN_IS(jsonString, *tok, "RAISED")) {
-				result.targetHeight = static_cast<uint8_t>(TillerCommand::RAISED);
-			}
-			else {
-				return ParseStatus::SEMANTIC_ERROR;
-			}
-		}
-		else if (TOKEN_IS(jsonString, *tok, "delay")) {
-			if (hasDelay) {
-				return ParseStatus::SEMANTIC_ERROR;
-			}
-			tok++;
-			i++;
-			hasDelay = true;
-			if (tok->type == JSMN_PRIMITIVE && *(jsonString + tok->start) >= '0' && *(jsonString + tok->start) <= '9') {
-				// jsonString is not null-terminated, but atol() is safe here, as the string must be valid JSON ending with '}',
-				// and atol stops at the first non-numeric character
-				result.delay = atol(jsonString + tok->start);
-			}
-			else {
-				return ParseStatus::SEMANTIC_ERROR;
-			}
-		}
-	}
+ParseStatus parsePutSprayerCmd(char* jsonString, size_t n, struct PutSprayer& result) {
+	result.delay = 0;
+	return parseJsonObject(jsonString, n, PUT_SPRAYER_FIELDS, &result);
+}
+
+static const JsonEnumValue HITCH_COMMANDS[] PROGMEM = {
+	{ STOP_STR, HITCH_CMD__STOP },
+	{ UP_STR, HITCH_CMD__UP },
+	{ DOWN_STR, HITCH_CMD__DOWN },
+};
+static const JsonField PUT_HITCH_FIELDS[] PROGMEM = {
+	JSON_UINT_OR_ENUM_FIELD(PutHitch, targetHeight, TARGET_HEIGHT_KEY, Hitch::MAX_HEIGHT, HITCH_COMMANDS, true),
+};
 
-	return hasTargetHeight ? ParseStatus::SUCCESS : ParseStatus::SEMANTIC_ERROR;
+ParseStatus parsePutHitchCmd(char* jsonString, size_t n, struct PutHitch& result) {
+	return parseJsonObject(jsonString, n, PUT_HITCH_FIELDS, &result);
 }
 
-ParseStatus parsePutSprayerCmd(char* jsonString, size_t n, struct PutSprayer& result) {
-	jsmn_init(&jsonParser);
-	int nTok = jsmn_parse(&jsonParser, jsonString, n, jsonBuffer, NUM_JSON_TOKENS);
-	
-	if (nTok < 0) {
-		switch (nTok) {
-			case JSMN_ERROR_NOMEM:
-			return ParseStatus::BUFFER_OVERFLOW;
-			default: // case JSMN_ERROR_INVAL: case JSMN_ERROR_PART
-			return ParseStatus::SYNTAX_ERROR;
-		}
+static const uint8_t WEED_BATCH_HEADER_SIZE = 2; // version and event count
+static const uint8_t WEED_BATCH_EVENT_SIZE = 6; // tiller bitmask (and flags), sprayer bitmask, and time (4 bytes)
+
+// Checks an event's fields, and stores them in event. time is the offset, or the absolute millis() time if isAbsolute.
+static ParseStatus makeWeedEvent(uint32_t tillers, uint32_t sprayers, uint32_t time, bool isAbsolute, uint32_t now,
+		struct WeedEvent& event) {
+	if (tillers >> Tiller::COUNT || sprayers > 0xFF) {
+		return ParseStatus::SEMANTIC_ERROR;
 	}
-	else if (jsonBuffer[0].type != JSMN_OBJECT) {
+	int32_t offset = static_cast<int32_t>(isAbsolute ? time - now : time);
+	if (offset < -WEED_MAX_OFFSET || offset > WEED_MAX_OFFSET) {
 		return ParseStatus::SEMANTIC_ERROR;
 	}
-	
-	bool hasStatus = false;
-	bool hasDelay = false;
-	result.delay = 0;
-	
-	for (int i = 1; i < nTok - 1; i++) {
-		jsmntok_t* tok = jsonBuffer + i;
-		if (tok->parent > 0) {
-			continue; // skip past any child objects, etc. We only care about direct children of the root
-		}
-		
-		if (TOKEN_IS(jsonString, *tok, "status")) {
-			if (hasStatus) {
-				return ParseStatus::SEMANTIC_ERROR;
-			}
-			tok++;
-			i++;
-			hasStatus = true;
-			if (TOKEN_IS(jsonString, *tok, "ON")) {
-				result.status = true;
-			}
-			else if (TOKEN_IS(jsonString, *tok, "OFF")) {
-				result.status = false;
-			}
-			else {
-				return ParseStatus::SEMANTIC_ERROR;
-			}
-		}
-		else if (TOKEN_IS(jsonString, *tok, "delay")) {
-			if (hasDelay) {
-				return ParseStatus::SEMANTIC_ERROR;
-			}
-			tok++;
-			i++;
-			hasDelay = true;
-			if (tok->type == JSMN_PRIMITIVE && *(jsonString + tok->start) >= '0' && *(jsonString + tok->start) <= '9') {
-				// jsonString is not null-terminated, but atol() is safe here, as the string must be valid JSON ending with '}',
-				// and atol stops at the first non-numeric character
-				result.delay = atol(jsonString + tok->start);
-			}
-			else {
-				return ParseStatus::SEMANTIC_ERROR;
-			}
+	event.tillers = tillers;
+	event.sprayers = sprayers;
+	event.offset = offset;
+	return ParseStatus::SUCCESS;
+}
+
+static ParseStatus parseWeedBatchBinary(const uint8_t* body, size_t n, uint32_t now, struct WeedBatch& result) {
+	if (n < WEED_BATCH_HEADER_SIZE) {
+		return ParseStatus::SYNTAX_ERROR;
+	}
+	uint8_t count = body[1];
+	if (count > WEED_BATCH_MAX_EVENTS) {
+		return ParseStatus::BUFFER_OVERFLOW;
+	}
+	if (n != static_cast<size_t>(WEED_BATCH_HEADER_SIZE + count * WEED_BATCH_EVENT_SIZE)) {
+		return ParseStatus::SYNTAX_ERROR;
+	}
+	const uint8_t* event = body + WEED_BATCH_HEADER_SIZE;
+	for (result.count = 0; result.count < count; result.count++, event += WEED_BATCH_EVENT_SIZE) {
+		uint32_t time = event[2] | static_cast<uint32_t>(event[3]) << 8 | static_cast<uint32_t>(event[4]) << 16
+				| static_cast<uint32_t>(event[5]) << 24;
+		ParseStatus status = makeWeedEvent(event[0] & ~WEED_EVENT_ABSOLUTE, event[1], time, event[0] & WEED_EVENT_ABSOLUTE,
+				now, result.events[result.count]);
+		if (status != ParseStatus::SUCCESS) {
+			return status;
 		}
 	}
-	
-	return hasStatus ? ParseStatus::SUCCESS : ParseStatus::SEMANTIC_ERROR;
+	return ParseStatus::SUCCESS;
 }
 
-ParseStatus parsePutHitchCmd(char* jsonString, size_t n, struct PutHitch& result) {
-	jsmn_init(&jsonParser);
-	int nTok = jsmn_parse(&jsonParser, jsonString, n, jsonBuffer, NUM_JSON_TOKENS);
-
-	if (nTok < 0) {
-		switch (nTok) {
-			case JSMN_ERROR_NOMEM:
-			return ParseStatus::BUFFER_OVERFLOW;
-			default: // case JSMN_ERROR_INVAL: case JSMN_ERROR_PART:
-			return ParseStatus::SYNTAX_ERROR;
-		}
+// A weed event, as it's given in JSON. Either the offset or the time may be given, not both.
+struct JsonWeedEvent {
+	uint8_t tillers;
+	uint8_t sprayers;
+	int32_t offset;
+	uint32_t time;
+};
+static const char TILLERS_KEY[] PROGMEM = "tillers";
+static const char SPRAYERS_KEY[] PROGMEM = "sprayers";
+static const char OFFSET_KEY[] PROGMEM = "offset";
+static const char TIME_KEY[] PROGMEM = "time";
+static const JsonField WEED_EVENT_FIELDS[] PROGMEM = {
+	JSON_UINT_FIELD(JsonWeedEvent, tillers, TILLERS_KEY, (1 << Tiller::COUNT) - 1, false),
+	JSON_UINT_FIELD(JsonWeedEvent, sprayers, SPRAYERS_KEY, 0xFF, false),
+	JSON_INT_FIELD(JsonWeedEvent, offset, OFFSET_KEY, WEED_MAX_OFFSET, false),
+	JSON_UINT_FIELD(JsonWeedEvent, time, TIME_KEY, 0xFFFFFFFF, false),
+};
+static const uint8_t WEED_EVENT_FIELD_CNT = sizeof(WEED_EVENT_FIELDS) / sizeof(WEED_EVENT_FIELDS[0]);
+// bits set by scanJsonObject() if the offset or time was given
+static const uint8_t WEED_EVENT_HAS_OFFSET = 1 << 2;
+static const uint8_t WEED_EVENT_HAS_TIME = 1 << 3;
+
+static ParseStatus parseWeedBatchJson(const char* p, const char* end, uint32_t now, struct WeedBatch& result) {
+	skipJsonWhitespace(p, end);
+	if (p == end || *p++ != '[') {
+		return ParseStatus::SYNTAX_ERROR;
 	}
-	else if (jsonBuffer[0].type != JSMN_OBJECT) {
-		return ParseStatus::SEMANTIC_ERROR;
+	skipJsonWhitespace(p, end);
+	if (p < end && *p == ']') {
+		p++;
 	}
-
-	bool hasTargetHeight = false;
-
-	for (int i = 1; i < nTok - 1; i++) {
-		jsmntok_t* tok = jsonBuffer + i;
-		if (tok->parent > 0) {
-			continue; // skip past any child objects, etc. We only care about direct children of the root
+	else while (true) {
+		if (result.count == WEED_BATCH_MAX_EVENTS) {
+			return ParseStatus::BUFFER_OVERFLOW;
 		}
-
-		if (TOKEN_IS(jsonString, *tok, "targetHeight")) {
-			if (hasTargetHeight) {
-				return ParseStatus::SEMANTIC_ERROR;
-			}
-			tok++;
-			i++;
-			hasTargetHeight = true;
-			if (tok->type == JSMN_PRIMITIVE && *(jsonString + tok->start) >= '0' && *(jsonString + tok->start) <= '9') {
-				// jsonString is not null-terminated, but atoi() is safe here, as the string must be valid JSON ending with '}',
-				// and atoi stops at the first non-numeric character
-				int cmd = atoi(jsonString + tok->start);
-				if (cmd < 0 || cmd > Hitch::MAX_HEIGHT) {
-					return ParseStatus::SEMANTIC_ERROR;
-				}
-				result.targetHeight = static_cast<uint8_t>(cmd);
-			}
-			else if (TOKEN_IS(jsonString, *tok, "STOP")) {
-				result.targetHeight = HITCH_CMD__STOP;
-			}
-			else if (TOKEN_IS(jsonString, *tok, "UP")) {
-				result.targetHeight = HITCH_CMD__UP;
-			}
-			else if (TOKEN_IS(jsonString, *tok, "DOWN")) {
-				result.targetHeight = HITCH_CMD__DOWN;
-			}
-			else {
+		JsonWeedEvent event = {};
+		uint8_t fieldsFound;
+		ParseStatus status = scanJsonObject(p, end, WEED_EVENT_FIELDS, WEED_EVENT_FIELD_CNT, &event, fieldsFound);
+		if (status == ParseStatus::SUCCESS) {
+			if ((fieldsFound & WEED_EVENT_HAS_OFFSET) && (fieldsFound & WEED_EVENT_HAS_TIME)) {
 				return ParseStatus::SEMANTIC_ERROR;
 			}
+			bool isAbsolute = fieldsFound & WEED_EVENT_HAS_TIME;
+			status = makeWeedEvent(event.tillers, event.sprayers, isAbsolute ? event.time : event.offset, isAbsolute, now,
+					result.events[result.count++]);
+		}
+		if (status != ParseStatus::SUCCESS) {
+			return status;
+		}
+		skipJsonWhitespace(p, end);
+		if (p == end) {
+			return ParseStatus::SYNTAX_ERROR;
 		}
+		char c = *p++;
+		if (c == ']') {
+			break;
+		}
+		else if (c != ',') {
+			return ParseStatus::SYNTAX_ERROR;
+		}
+		skipJsonWhitespace(p, end);
 	}
+	skipJsonWhitespace(p, end);
+	return p == end ? ParseStatus::SUCCESS : ParseStatus::SYNTAX_ERROR;
+}
 
-	return hasTargetHeight ? ParseStatus::SUCCESS : ParseStatus::SEMANTIC_ERROR;
+ParseStatus parseWeedBatch(char* body, size_t n, uint32_t now, struct WeedBatch& result) {
+	result.count = 0;
+	if (n && static_cast<uint8_t>(body[0]) == WEED_BATCH_VERSION) {
+		return parseWeedBatchBinary(reinterpret_cast<const uint8_t*>(body), n, now, result);
+	}
+	return parseWeedBatchJson(body, body + n, now, result);
 }
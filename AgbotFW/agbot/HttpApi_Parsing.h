@@ -9,12 +9,7 @@
 
 #include <Arduino.h>
 
-enum ParseStatus : uint8_t {
-	SUCCESS,
-	SYNTAX_ERROR,
-	BUFFER_OVERFLOW,
-	SEMANTIC_ERROR
-};
+#include "JsonParser.h"
 
 struct PutTiller {
 	uint8_t targetHeight;
@@ -40,3 +35,33 @@ struct PutHitch {
 };
 
 ParseStatus parsePutHitchCmd(char* jsonString, size_t n, struct PutHitch& result);
+
+
+// A batch of weeds, e.g. every weed seen in a camera frame, sent in the body of a POST /api/weeds. It's either a JSON array
+// of events, or, if its first byte is WEED_BATCH_VERSION, the binary form. See api.md for both.
+#define WEED_BATCH_VERSION		1
+#define WEED_BATCH_MAX_EVENTS	32
+// Furthest an event may be timed from when the batch arrives, in milliseconds, either way
+#define WEED_MAX_OFFSET			30000
+// Set in the tiller bitmask of a binary event whose time is absolute
+#define WEED_EVENT_ABSOLUTE		0x80
+
+struct WeedEvent {
+	uint8_t tillers; // bit i is tiller i
+	uint8_t sprayers; // bit i is sprayer i
+	int32_t offset; // time the weed was seen, in milliseconds after the batch arrived (negative if before)
+};
+
+struct WeedBatch {
+	uint8_t count;
+	struct WeedEvent events[WEED_BATCH_MAX_EVENTS];
+};
+
+// Parses and validates every event in the batch, in a single pass, before any of them are applied. Absolute times are
+// converted to offsets from now, the millis() time the batch arrived.
+ParseStatus parseWeedBatch(char* body, size_t n, uint32_t now, struct WeedBatch& result);
+
+// Returns true if the weed has already passed the implements, given the ResponseDelay setting, so it's too late to kill
+inline bool hasWeedPassed(struct WeedEvent const& event, uint16_t responseDelay) {
+	return event.offset < -static_cast<int32_t>(responseDelay);
+}
@@ -0,0 +1,290 @@
+/*
+ * JsonParser.cpp
+ * Implements the schema-driven JSON parser defined in JsonParser.h.
+ * See JsonParser.h for more info.
+ * Created: 10/16/2026 10:18:52 PM
+ *  Author: troy.honegger
+ */
+
+#include <string.h>
+
+#include "JsonParser.h"
+
+static inline bool isDigit(char c) { return '0' <= c && c <= '9'; }
+
+void skipJsonWhitespace(const char*& p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+		p++;
+	}
+}
+
+// Scans the string at p, and points str at its contents, which are length characters long. Escape sequences are skipped
+// over, but not decoded, so a string with escapes never matches a field name or enum value.
+static ParseStatus scanString(const char*& p, const char* end, const char*& str, size_t& length) {
+	if (p == end || *p != '"') {
+		return ParseStatus::SYNTAX_ERROR;
+	}
+	str = ++p;
+	for (; p < end && *p != '"'; p++) {
+		if (*p == '\\' && ++p == end) {
+			break;
+		}
+	}
+	if (p == end) {
+		return ParseStatus::SYNTAX_ERROR;
+	}
+	length = p++ - str;
+	return ParseStatus::SUCCESS;
+}
+
+// Scans the number at p into its magnitude and sign. Returns SEMANTIC_ERROR if it's well-formed, but has a fraction or an
+// exponent, or its magnitude doesn't fit in 32 bits. Leading zeros aren't valid JSON. "-0" is, and reads as 0, so it's
+// accepted wherever 0 is.
+static ParseStatus scanInteger(const char*& p, const char* end, uint32_t& magnitude, bool& negative) {
+	negative = p < end && *p == '-';
+	if (negative) {
+		p++;
+	}
+	const char* digits = p;
+	bool isInteger = true;
+	magnitude = 0;
+	for (; p < end && isDigit(*p); p++) {
+		uint8_t digit = *p - '0';
+		if (magnitude > (0xFFFFFFFF - digit) / 10) {
+			isInteger = false; // too big - keep scanning, to tell it apart from a syntax error
+		}
+		else {
+			magnitude = magnitude * 10 + digit;
+		}
+	}
+	if (p == digits || (*digits == '0' && p - digits > 1)) {
+		return ParseStatus::SYNTAX_ERROR;
+	}
+	if (p < end && *p == '.') {
+		digits = ++p;
+		while (p < end && isDigit(*p)) {
+			p++;
+		}
+		if (p == digits) {
+			return ParseStatus::SYNTAX_ERROR;
+		}
+		isInteger = false;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '+' || *p == '-')) {
+			p++;
+		}
+		digits = p;
+		while (p < end && isDigit(*p)) {
+			p++;
+		}
+		if (p == digits) {
+			return ParseStatus::SYNTAX_ERROR;
+		}
+		isInteger = false;
+	}
+	if (!isInteger) {
+		return ParseStatus::SEMANTIC_ERROR;
+	}
+	negative = negative && magnitude;
+	return ParseStatus::SUCCESS;
+}
+
+// Skips over the value at p, which isn't in the schema. Strings and nesting are followed, to find the end of the value,
+// but the contents of nested objects and arrays aren't checked any further.
+static ParseStatus skipValue(const char*& p, const char* end) {
+	if (p == end) {
+		return ParseStatus::SYNTAX_ERROR;
+	}
+	const char* str;
+	size_t length;
+	if (*p == '"') {
+		return scanString(p, end, str, length);
+	}
+	else if (*p == '{' || *p == '[') {
+		uint8_t depth = 0;
+		do {
+			if (p == end) {
+				return ParseStatus::SYNTAX_ERROR;
+			}
+			else if (*p == '"') {
+				if (scanString(p, end, str, length) != ParseStatus::SUCCESS) {
+					return ParseStatus::SYNTAX_ERROR;
+				}
+				continue;
+			}
+			else if (*p == '{' || *p == '[') {
+				if (++depth > JSON_MAX_DEPTH) {
+					return ParseStatus::BUFFER_OVERFLOW;
+				}
+			}
+			else if (*p == '}' || *p == ']') {
+				depth--;
+			}
+			p++;
+		} while (depth);
+		return ParseStatus::SUCCESS;
+	}
+	else if (*p == '-' || isDigit(*p)) {
+		uint32_t magnitude;
+		bool negative;
+		ParseStatus status = scanInteger(p, end, magnitude, negative);
+		return status == ParseStatus::SEMANTIC_ERROR ? ParseStatus::SUCCESS : status; // any number will do
+	}
+	// the only values left are true, false, and null
+	static const char TRUE_STR[] PROGMEM = "true";
+	static const char FALSE_STR[] PROGMEM = "false";
+	static const char NULL_STR[] PROGMEM = "null";
+	static const char* const LITERALS[] PROGMEM = { TRUE_STR, FALSE_STR, NULL_STR };
+	for (uint8_t i = 0; i < sizeof(LITERALS) / sizeof(LITERALS[0]); i++) {
+		const char* literal = reinterpret_cast<const char*>(pgm_read_ptr(&LITERALS[i]));
+		length = strlen_P(literal);
+		if (static_cast<size_t>(end - p) >= length && !strncmp_P(p, literal, length)) {
+			p += length;
+			return ParseStatus::SUCCESS;
+		}
+	}
+	return ParseStatus::SYNTAX_ERROR;
+}
+
+// Scans the value at p, and stores it in result as the field describes
+static ParseStatus scanField(const char*& p, const char* end, JsonField const& field, void* result) {
+	uint32_t value;
+	if (p < end && *p == '"' && field.enumCount) {
+		const char* str;
+		size_t length;
+		if (scanString(p, end, str, length) != ParseStatus::SUCCESS) {
+			return ParseStatus::SYNTAX_ERROR;
+		}
+		uint8_t i = 0;
+		for (; i < field.enumCount; i++) {
+			const char* name = reinterpret_cast<const char*>(pgm_read_ptr(&field.enumValues[i].name));
+			if (strlen_P(name) == length && !strncmp_P(str, name, length)) {
+				value = pgm_read_byte(&field.enumValues[i].value);
+				break;
+			}
+		}
+		if (i == field.enumCount) {
+			return ParseStatus::SEMANTIC_ERROR;
+		}
+	}
+	else if (p < end && (*p == '-' || isDigit(*p)) && field.type != JsonType::ENUM) {
+		bool negative;
+		ParseStatus status = scanInteger(p, end, value, negative);
+		if (status != ParseStatus::SUCCESS) {
+			return status;
+		}
+		if (value > field.max || (negative && field.type != JsonType::INT)) {
+			return ParseStatus::SEMANTIC_ERROR;
+		}
+		if (negative) {
+			value = -value;
+		}
+	}
+	else {
+		// the wrong type, if it's JSON at all
+		ParseStatus status = skipValue(p, end);
+		return status == ParseStatus::SUCCESS ? ParseStatus::SEMANTIC_ERROR : status;
+	}
+
+	uint8_t* member = static_cast<uint8_t*>(result) + field.offset;
+	switch (field.size) {
+		case sizeof(uint8_t):
+			*member = value;
+			break;
+		case sizeof(uint16_t):
+			*reinterpret_cast<uint16_t*>(member) = value;
+			break;
+		case sizeof(uint32_t):
+			*reinterpret_cast<uint32_t*>(member) = value;
+			break;
+		default:
+			assert(0);
+	}
+	return ParseStatus::SUCCESS;
+}
+
+ParseStatus scanJsonObject(const char*& p, const char* end, const JsonField* fields, uint8_t fieldCount, void* result,
+		uint8_t& fieldsFound) {
+	assert(fieldCount <= 8); // one bit of fieldsFound each
+	fieldsFound = 0;
+	skipJsonWhitespace(p, end);
+	if (p == end || *p != '{') {
+		// either not JSON, or JSON that isn't an object
+		ParseStatus status = skipValue(p, end);
+		return status == ParseStatus::SUCCESS ? ParseStatus::SEMANTIC_ERROR : status;
+	}
+	p++;
+	skipJsonWhitespace(p, end);
+	if (p < end && *p == '}') {
+		p++;
+	}
+	else while (true) {
+		const char* key;
+		size_t keyLength;
+		if (scanString(p, end, key, keyLength) != ParseStatus::SUCCESS) {
+			return ParseStatus::SYNTAX_ERROR;
+		}
+		skipJsonWhitespace(p, end);
+		if (p == end || *p++ != ':') {
+			return ParseStatus::SYNTAX_ERROR;
+		}
+		skipJsonWhitespace(p, end);
+
+		uint8_t i = 0;
+		for (; i < fieldCount; i++) {
+			const char* name = reinterpret_cast<const char*>(pgm_read_ptr(&fields[i].name));
+			if (strlen_P(name) == keyLength && !strncmp_P(key, name, keyLength)) {
+				break;
+			}
+		}
+		ParseStatus status;
+		if (i == fieldCount) {
+			status = skipValue(p, end); // not in the schema - ignore it
+		}
+		else if (fieldsFound & (1 << i)) {
+			return ParseStatus::SEMANTIC_ERROR;
+		}
+		else {
+			fieldsFound |= 1 << i;
+			JsonField field;
+			memcpy_P(&field, &fields[i], sizeof(field));
+			status = scanField(p, end, field, result);
+		}
+		if (status != ParseStatus::SUCCESS) {
+			return status;
+		}
+
+		skipJsonWhitespace(p, end);
+		if (p == end) {
+			return ParseStatus::SYNTAX_ERROR;
+		}
+		char c = *p++;
+		if (c == '}') {
+			break;
+		}
+		else if (c != ',') {
+			return ParseStatus::SYNTAX_ERROR;
+		}
+		skipJsonWhitespace(p, end);
+	}
+
+	for (uint8_t i = 0; i < fieldCount; i++) {
+		if (pgm_read_byte(&fields[i].isRequired) && !(fieldsFound & (1 << i))) {
+			return ParseStatus::SEMANTIC_ERROR;
+		}
+	}
+	return ParseStatus::SUCCESS;
+}
+
+ParseStatus parseJsonObject(const char* json, size_t n, const JsonField* fields, uint8_t fieldCount, void* result) {
+	const char* end = json + n;
+	uint8_t fieldsFound;
+	ParseStatus status = scanJsonObject(json, end, fields, fieldCount, result, fieldsFound);
+	if (status != ParseStatus::SUCCESS) {
+		return status;
+	}
+	skipJsonWhitespace(json, end);
+	return json == end ? ParseStatus::SUCCESS : ParseStatus::SYNTAX_ERROR;
+}
@@ -0,0 +1,99 @@
+/*
+ * JsonParser.h
+ * A single-pass JSON parser driven by a declarative schema, for the small, flat JSON objects the API accepts.
+ *
+ * Each kind of object is described by a table of JsonFields in PROGMEM, one per field: its name, its type, where in a
+ * struct to store it, and its range or the strings it may take (a table of JsonEnumValues, also in PROGMEM). The JSON_*_FIELD
+ * macros fill in a field's offset and size from the struct member it's stored in, so the table is built entirely at compile
+ * time. Adding an endpoint is then a matter of declaring a struct and a table.
+ *
+ * The parser scans the JSON once, from start to finish, storing each field as it's reached. Unlike a tokenizer such as
+ * jsmn, it doesn't build a token array first, so there's no limit on the size of the object, and no RAM to set aside for
+ * tokens. Fields that aren't in the table are skipped, whatever their value, as are nested objects and arrays (up to
+ * JSON_MAX_DEPTH deep).
+ *
+ * Usage example:
+ *	struct PutHitch { uint8_t targetHeight; };
+ *	static const char TARGET_HEIGHT_KEY[] PROGMEM = "targetHeight";
+ *	static const char STOP_STR[] PROGMEM = "STOP";
+ *	static const JsonEnumValue HITCH_COMMANDS[] PROGMEM = { { STOP_STR, 255 } };
+ *	static const JsonField PUT_HITCH_FIELDS[] PROGMEM = {
+ *		JSON_UINT_OR_ENUM_FIELD(PutHitch, targetHeight, TARGET_HEIGHT_KEY, 100, HITCH_COMMANDS, true)
+ *	};
+ *	PutHitch result;
+ *	ParseStatus status = parseJsonObject(json, length, PUT_HITCH_FIELDS, &result); // {"targetHeight": "STOP"}
+ *
+ * Created: 10/16/2026 10:03:28 PM
+ *  Author: troy.honegger
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "Common.h"
+
+enum ParseStatus : uint8_t {
+	SUCCESS,
+	SYNTAX_ERROR,
+	BUFFER_OVERFLOW, // the JSON is nested too deeply, or has too many elements
+	SEMANTIC_ERROR // the JSON is well-formed, but isn't what the schema asks for
+};
+
+// Nested objects and arrays that deep are skipped; any deeper, and parsing fails with a BUFFER_OVERFLOW.
+#define JSON_MAX_DEPTH	(8)
+
+enum class JsonType : uint8_t {
+	UINT, // an integer from 0 to max
+	INT, // an integer from -max to max
+	ENUM, // one of the strings in enumValues
+	UINT_OR_ENUM // either of the above
+};
+
+struct JsonEnumValue {
+	const char* name; // PROGMEM
+	uint8_t value;
+};
+
+struct JsonField {
+	const char* name; // PROGMEM
+	JsonType type;
+	uint8_t offset; // of the struct member the value is stored in
+	uint8_t size; // of that member: 1, 2, or 4 bytes
+	bool isRequired;
+	uint32_t max;
+	const JsonEnumValue* enumValues; // PROGMEM
+	uint8_t enumCount;
+};
+
+#define JSON_UINT_FIELD(type, member, name, max, isRequired) \
+	{ name, JsonType::UINT, offsetof(type, member), sizeof(type::member), isRequired, max, nullptr, 0 }
+#define JSON_INT_FIELD(type, member, name, max, isRequired) \
+	{ name, JsonType::INT, offsetof(type, member), sizeof(type::member), isRequired, max, nullptr, 0 }
+#define JSON_ENUM_FIELD(type, member, name, enumValues, isRequired) \
+	{ name, JsonType::ENUM, offsetof(type, member), sizeof(type::member), isRequired, 0, enumValues, \
+		sizeof(enumValues) / sizeof(enumValues[0]) }
+#define JSON_UINT_OR_ENUM_FIELD(type, member, name, max, enumValues, isRequired) \
+	{ name, JsonType::UINT_OR_ENUM, offsetof(type, member), sizeof(type::member), isRequired, max, enumValues, \
+		sizeof(enumValues) / sizeof(enumValues[0]) }
+
+// Advances p past any whitespace, up to end
+void skipJsonWhitespace(const char*& p, const char* end);
+
+// Scans the JSON object at p (after any whitespace), storing each of the fields (fieldCount of them, at most 8, in PROGMEM)
+// in result, and advances p past the object. Fields missing from the object are left alone. Sets bit i of fieldsFound if
+// fields[i] was in the object.
+// returns: SUCCESS; SYNTAX_ERROR if it isn't valid JSON; BUFFER_OVERFLOW if it's nested too deeply; SEMANTIC_ERROR if it
+// isn't an object, a field has the wrong type or is out of range, a field is given twice, or a required field is missing.
+// Scanning stops at the first error, so p is left somewhere in the middle.
+ParseStatus scanJsonObject(const char*& p, const char* end, const JsonField* fields, uint8_t fieldCount, void* result,
+		uint8_t& fieldsFound);
+
+// Parses json (n characters), which must hold a single JSON object, as scanJsonObject() does.
+ParseStatus parseJsonObject(const char* json, size_t n, const JsonField* fields, uint8_t fieldCount, void* result);
+
+template<uint8_t N>
+inline ParseStatus parseJsonObject(const char* json, size_t n, const JsonField (&fields)[N], void* result) {
+	static_assert(N <= 8, "fieldsFound has one bit per field, so a schema has at most 8 fields");
+	return parseJsonObject(json, n, fields, N, result);
+}
@@ -0,0 +1,125 @@
+/*
+ * KillWindows.cpp
+ * Implements the KillWindows class defined in KillWindows.h for merging the time windows in which implements kill weeds.
+ * See KillWindows.h for more info.
+ * Created: 10/16/2026 3:20:41 PM
+ *  Author: troy.honegger
+ */
+
+#include <string.h>
+
+#include "Common.h"
+#include "KillWindows.h"
+
+void KillWindows::erase(uint8_t index, uint8_t n) {
+	memmove(windows + index, windows + index + n, (count - index - n) * sizeof(Window));
+	count -= n;
+}
+
+// Returns true if a window ending at end and a window starting at start should be kept separate, rather than merged.
+static inline bool isSeparate(uint32_t end, uint32_t start, uint32_t minGap) {
+	return timeCmp(start, end) > 0 && start - end >= minGap;
+}
+
+uint8_t KillWindows::add(uint32_t start, uint32_t end, uint32_t minGap, uint8_t* bridged) {
+	uint8_t merged = 0;
+	if (bridged) {
+		*bridged = 0;
+	}
+	Window window = { start, end };
+	// skip the windows that end before this one starts
+	uint8_t i = 0;
+	while (i < count && isSeparate(windows[i].end, window.start, minGap)) {
+		i++;
+	}
+	if (i == 0 && isActive && count && isSeparate(window.end, windows[0].start, minGap)) {
+		return 0; // this window ends before the active window started - it's already over
+	}
+	// absorb every window this one overlaps, touches, or comes within minGap of
+	uint8_t j = i;
+	while (j < count && !isSeparate(window.end, windows[j].start, minGap)) {
+		if (bridged && (timeCmp(windows[j].end, window.start) < 0 || timeCmp(window.end, windows[j].start) < 0)) {
+			(*bridged)++;
+		}
+		if (timeCmp(windows[j].start, window.start) < 0) { window.start = windows[j].start; }
+		if (timeCmp(windows[j].end, window.end) > 0) { window.end = windows[j].end; }
+		merged++;
+		j++;
+	}
+	if (i == j) {
+		memmove(windows + i + 1, windows + i, (count - i) * sizeof(Window));
+		count++;
+	}
+	else {
+		erase(i + 1, j - i - 1);
+	}
+	windows[i] = window;
+
+	if (count > CAPACITY) {
+		// out of room - close the smallest gap
+		uint8_t k = 0;
+		for (uint8_t m = 1; m < count - 1; m++) {
+			if (windows[m + 1].start - windows[m].end < windows[k + 1].start - windows[k].end) {
+				k = m;
+			}
+		}
+		windows[k].end = windows[k + 1].end;
+		erase(k + 1, 1);
+		merged++;
+	}
+
+	if (hasOverride) {
+		// the overridden window may have been extended by the merge, in which case it should end normally
+		bool found = false;
+		for (uint8_t m = 0; m < count; m++) {
+			found |= windows[m].end == overrideTime;
+		}
+		hasOverride = found;
+	}
+	return merged;
+}
+
+void KillWindows::truncate(uint32_t time) {
+	while (count && timeCmp(windows[count - 1].start, time) >= 0) {
+		count--;
+	}
+	if (!count) {
+		isActive = false;
+	}
+	else if (timeCmp(windows[count - 1].end, time) > 0) {
+		windows[count - 1].end = time;
+		hasOverride = true;
+		overrideTime = time;
+	}
+}
+
+bool KillWindows::getNextEdge(uint32_t& time) const {
+	if (!count) {
+		return false;
+	}
+	time = isActive ? windows[0].end : windows[0].start;
+	return true;
+}
+
+KillWindows::Edge KillWindows::advance(uint32_t time) {
+	if (!count) {
+		return NONE;
+	}
+	if (!isActive) {
+		if (timeCmp(time, windows[0].start) < 0) {
+			return NONE;
+		}
+		isActive = true;
+		return START;
+	}
+	if (timeCmp(time, windows[0].end) < 0) {
+		return NONE;
+	}
+	bool isOverridden = hasOverride && windows[0].end == overrideTime;
+	if (isOverridden) {
+		hasOverride = false;
+	}
+	erase(0, 1);
+	isActive = false;
+	return isOverridden ? NONE : END;
+}
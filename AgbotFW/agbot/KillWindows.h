@@ -0,0 +1,78 @@
+/*
+ * KillWindows.h
+ * Tracks the upcoming time windows in which an implement (a tiller or sprayer) should be activated to kill weeds.
+ *
+ * Every sighted weed adds an [start, end) window. Times are on the micros() clock, like the CommandQueue's. Windows that
+ * overlap or touch are merged as they are added, so a dense weed patch collapses into one long window, and the implement
+ * only switches on and off once for the whole patch.
+ * Optionally, windows separated by less than a minimum gap are merged as well (see Setting::SprayerMinOffTime). At
+ * most CAPACITY separate windows are stored; if a new window would exceed that, the two windows with the smallest gap
+ * between them are merged. This may keep the implement active a little longer than necessary, but it never misses a
+ * window, and it never leaves the implement stuck on.
+ *
+ * The owner drives the windows from the CommandQueue (see Common.h): it keeps one command in the queue for the time
+ * returned by getNextEdge(), and when that command fires, calls advance() to find out whether to activate or deactivate
+ * the implement.
+ *
+ * Usage example:
+ *	KillWindows windows;
+ *	windows.add(micros() + 100000, micros() + 200000);
+ *	uint32_t time;
+ *	if (windows.getNextEdge(time)) { ... } // schedule a call to advance() at time
+ *	switch (windows.advance(time)) { case KillWindows::START: ...; case KillWindows::END: ...; }
+ *
+ * Created: 10/16/2026 3:02:18 PM
+ *  Author: troy.honegger
+ */
+
+#pragma once
+
+#include "Common.h"
+
+class KillWindows {
+	public:
+		static const uint8_t CAPACITY = 4;
+
+		enum Edge : uint8_t {
+			NONE = 0, // nothing changed
+			START = 1, // the implement should activate
+			END = 2 // the implement should deactivate
+		};
+	private:
+		struct Window {
+			uint32_t start;
+			uint32_t end;
+		};
+		Window windows[CAPACITY + 1]; // sorted, with no two windows overlapping or touching. The extra slot is used by add().
+		uint8_t count;
+		bool isActive; // true if windows[0] has started
+		bool hasOverride; // true if the window ending at overrideTime was cut short by truncate()
+		uint32_t overrideTime;
+
+		void erase(uint8_t index, uint8_t n);
+	public:
+		KillWindows() : count(0), isActive(false), hasOverride(false), overrideTime(0) {}
+
+		// Adds a window (in microseconds), merging it with any windows it overlaps or touches. Windows separated by a gap shorter
+		// than minGap (also in microseconds) are bridged, i.e. merged as well; if bridged is given, the number of gaps bridged is
+		// stored there.
+		// returns: the number of existing windows the new one was merged with. Only the bridged gaps save the implement from
+		// switching off and back on; the other merges are windows that overlapped or touched.
+		uint8_t add(uint32_t start, uint32_t end, uint32_t minGap = 0, uint8_t* bridged = nullptr);
+
+		// Cuts every window short at the given time, because another command overrides them from then on. Windows that
+		// start at or after time are dropped. A window that spans time ends there, but advance() will not report its END, so
+		// the overriding command is left in control.
+		void truncate(uint32_t time);
+
+		// If any windows are pending, stores the time of the next START or END in time, and returns true. Otherwise, returns
+		// false.
+		bool getNextEdge(uint32_t& time) const;
+
+		// Moves past the next edge, if it is due at the given time, and returns it. Only one edge is returned per call; call
+		// this until getNextEdge() returns a time after the current one to catch up.
+		Edge advance(uint32_t time);
+
+		inline bool isEmpty(void) const { return !count; }
+		inline uint8_t getCount(void) const { return count; }
+};
@@ -110,7 +110,7 @@ void LidarLiteSensor::begin(uint8_t id) {
 	enterState_Unpaired();
 }
 
-void LidarLiteSensor::update(void) {
+void LidarLiteSensor::update(uint32_t now) {
 	switch (state) {
 		case LIDAR_STATE__UNPAIRED:
 			if (paired) {
@@ -126,7 +126,7 @@ void LidarLiteSensor::update(void) {
 			}
 		break;
 		case LIDAR_STATE__WAITFORREAD:
-			if (timer.isUp()) {
+			if (timer.isUp(now)) {
 				bool success = enterState_Read();
 				if (success) {
 					enterState_WaitForRead();
@@ -213,7 +213,7 @@ void LidarLiteBank::begin(void) {
 #define ADDRESS_CONFLICT_RETRY_DELAY			1000 /* ms */
 
 
-void LidarLiteBank::update(void) {	
+void LidarLiteBank::update(uint32_t now) {	
 	uint8_t newNumPaired = 0;
 	switch (state) {
 		case LIDARBANK_STATE__WAITING:
@@ -239,7 +239,7 @@ void LidarLiteBank::update(void) {
 				enterState_SensorPowerCycle();
 				LOG_STATE_TRANSITION("LidarLiteBank: SensorPowerCycle->SensorPowerCycle");
 			}
-			else if (timer.isUp()) {
+			else if (timer.isUp(now)) {
 				enterState_ConflictCheck();
 				LOG_STATE_TRANSITION("LidarLiteBank: SensorPowerCycle->ConflictCheck");
 				if (success) {
@@ -253,13 +253,13 @@ void LidarLiteBank::update(void) {
 			}
 		break;
 		case LIDARBANK_STATE__ADDRESS_CONFLICT:
-			if (timer.isUp()) {
+			if (timer.isUp(now)) {
 				enterState_Waiting();
 				LOG_STATE_TRANSITION("LidarLiteBank: AddressConflict->Waiting");
 			}
 		break;
 		case LIDARBANK_STATE__NODE_STARTUP:
-			if (timer.isUp()) {
+			if (timer.isUp(now)) {
 				enterState_NodePair();
 				LOG_STATE_TRANSITION("LidarLiteBank: NodeStartup->NodePair");
 			}
@@ -281,7 +281,7 @@ void LidarLiteBank::update(void) {
 	}
 
 	for (int i = 0; i < NUM_SENSORS; i++) {
-		sensors[i].update();
+		sensors[i].update(now);
 	}
 }
 
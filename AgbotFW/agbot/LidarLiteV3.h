@@ -17,7 +17,7 @@
  *   at any time: LidarLiteBank dynamically reconnects to them once they come back up.
  *
  * Call LidarLiteBank::begin() on startup. This automatically calls begin() on all LidarLiteSensor's.
- * Then call LidarLiteBank::update() to run the control logic. If a sensor is paired (i.e.
+ * Then call LidarLiteBank::update(now) to run the control logic. If a sensor is paired (i.e.
  * lidarLiteBank[i].isPaired() returns true), call lidarLiteBank[i].getHeight()
  * to grab the latest measurement.
  *
@@ -83,8 +83,8 @@ class LidarLiteSensor {
 
 	// Initializes the class. Call before calling any other member functions.
 	void begin(uint8_t id);
-	// Runs the state machine. Call every iteration of the main controller loop.
-	void update(void);
+	// Runs the state machine. Call every iteration of the main controller loop, with the current time in milliseconds.
+	void update(uint32_t now);
 
 	// Writes the information pertaining to this height sensor to the given string. Writes at most n characters, including the null
 	// terminator, and returns the number of characters in the serialized string, excluding the null terminator. If the string length
@@ -131,10 +131,13 @@ class LidarLiteBank {
 	//   sensors[1].getHeight();
 	LidarLiteSensor& operator[](int i) { return sensors[i]; }
 
+	// returns true if the sensors couldn't be paired because two of them answered on the same I2C address
+	inline bool hasAddressConflict(void) const { return addrConflict; }
+
 	// Initializes the class. Call before calling any other member functions.
 	void begin(void);
-	// Runs the state machine. Call every iteration of the main controller loop.
-	void update(void);
+	// Runs the state machine. Call every iteration of the main controller loop, with the current time in milliseconds.
+	void update(uint32_t now);
 	
 	// Writes the information pertaining to the height sensors to the given string. Writes at most n characters, including the null
 	// terminator, and returns the number of characters in the serialized string, excluding the null terminator. If the string length
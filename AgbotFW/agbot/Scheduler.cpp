@@ -0,0 +1,166 @@
+/*
+ * Scheduler.cpp
+ * Implements the Scheduler class defined in Scheduler.h for running the main controller loop.
+ * See Scheduler.h for more info.
+ * Created: 10/16/2026 9:40:02 AM
+ *  Author: troy.honegger
+ */
+
+#include "Common.h"
+#include "Scheduler.h"
+
+static_assert(Scheduler::MAX_TASKS <= 16, "Scheduler::run() tracks completed tasks in a uint16_t");
+
+void DurationHistogram::record(uint32_t duration) {
+	uint8_t i = 0;
+	while (duration && i < NUM_BUCKETS - 1) { // compute the bit length of duration, i.e. ceil(log2(duration + 1))
+		duration >>= 1;
+		i++;
+	}
+	if (counts[i] != 0xFFFF) {
+		counts[i]++;
+	}
+}
+
+void DurationHistogram::reset(void) {
+	memset(counts, 0, sizeof(counts));
+}
+
+bool Scheduler::add(SchedulerTask* task, const char* name, uint8_t priority, uint32_t period, uint32_t budget) {
+	if (numTasks == MAX_TASKS) {
+		return false;
+	}
+	// insert after all tasks of equal or higher priority, to keep the list sorted
+	uint8_t index = numTasks;
+	while (index && tasks[index - 1].priority > priority) {
+		tasks[index] = tasks[index - 1];
+		index--;
+	}
+	tasks[index].run = task;
+	tasks[index].name = name;
+	tasks[index].runtimes.reset();
+	tasks[index].priority = priority;
+	tasks[index].period = period;
+	tasks[index].budget = budget;
+	tasks[index].nextRun = clock().us;
+	numTasks++;
+	return true;
+}
+
+bool Scheduler::isReady(uint8_t index, uint32_t now) const {
+	Task const& task = tasks[index];
+	if (timeCmp(now, task.nextRun) < 0) {
+		return false;
+	}
+	if (now - task.nextRun >= MAX_DEFERRAL) {
+		return true; // we've put this off long enough
+	}
+	for (uint8_t i = 0; i < index && tasks[i].priority < task.priority; i++) {
+		if (static_cast<int32_t>(tasks[i].nextRun - now) < static_cast<int32_t>(task.budget)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Scheduler::run(void) {
+	Timestamp now = clock(); // the time given to the tasks
+	if (lastCycleStart) {
+		uint32_t cycleTime = now.us - lastCycleStart;
+		cycleTimes.record(cycleTime);
+		if (cycleTime > maxCycleTime) {
+			maxCycleTime = cycleTime;
+		}
+	}
+	lastCycleStart = now.us;
+
+	uint32_t start = now.us; // when the next task starts - the scheduler itself works from the live clock
+	uint16_t done = 0; // bit i is set once tasks[i] has run on this pass
+	uint8_t i = 0;
+	while (i < numTasks) {
+		if (!(done & (1U << i)) && isReady(i, start)) {
+			Task& task = tasks[i];
+			task.run(now);
+			Timestamp end = clock();
+			task.runtimes.record(end.us - start);
+			done |= 1U << i;
+			// schedule relative to the last deadline to avoid drift, unless we've fallen a whole period behind;
+			// in that case, skip the missed runs rather than running the task back-to-back to catch up.
+			task.nextRun += task.period;
+			if (timeCmp(start, task.nextRun) >= 0) {
+				task.nextRun = start + task.period;
+			}
+			// more urgent tasks may have come due while this one ran - check them first, and give them the current time
+			if (task.priority > tasks[0].priority) {
+				now = end;
+			}
+			start = end.us;
+			i = 0;
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+// The state kept by writeMetrics() between calls. The histograms are numbered from 0 (the loop) to numTasks (the last task),
+// and each is written in NUM_BUCKETS + 2 steps: its name, then each bucket, then its closing brace. After the last histogram
+// comes the object's closing brace.
+#define METRICS_STEP_MASK			(0x1F)
+#define METRICS_HISTOGRAM_SHIFT		(5)
+#define METRICS_HAS_BUCKETS			(0x8000) // set once a bucket of the current histogram has been written
+static_assert(DurationHistogram::NUM_BUCKETS + 1 <= METRICS_STEP_MASK, "the step doesn't fit in the writeMetrics() state");
+
+size_t Scheduler::writeMetrics(char* buf, size_t size, uint16_t& state) {
+	size_t len = 0;
+	while (true) {
+		uint8_t histogram = (state & ~METRICS_HAS_BUCKETS) >> METRICS_HISTOGRAM_SHIFT;
+		uint8_t step = state & METRICS_STEP_MASK;
+		if (histogram > numTasks + 1) {
+			break; // all done
+		}
+		uint16_t* written = nullptr; // the bucket being written, if any
+		size_t room = size - len;
+		size_t tokenLen = 0;
+		if (histogram == numTasks + 1) {
+			tokenLen = snprintf_P(buf + len, room, PSTR("}"));
+		}
+		else if (step == 0) {
+			tokenLen = snprintf_P(buf + len, room, histogram ? PSTR(",\"%S\":{") : PSTR("{\"%S\":{"),
+					histogram ? tasks[histogram - 1].name : PSTR("loop"));
+		}
+		else if (step <= DurationHistogram::NUM_BUCKETS) {
+			uint16_t* bucket = (histogram ? tasks[histogram - 1].runtimes : cycleTimes).counts + step - 1;
+			if (*bucket) {
+				written = bucket;
+				tokenLen = snprintf_P(buf + len, room, state & METRICS_HAS_BUCKETS ? PSTR(",\"%hhu\":%u") : PSTR("\"%hhu\":%u"),
+						step - 1, *bucket);
+			}
+		}
+		else {
+			tokenLen = snprintf_P(buf + len, room, PSTR("}"));
+		}
+		if (tokenLen >= room) {
+			break; // no more room - continue in the next piece
+		}
+		len += tokenLen;
+
+		if (written) {
+			*written = 0;
+			state |= METRICS_HAS_BUCKETS;
+		}
+		if (step > DurationHistogram::NUM_BUCKETS || histogram == numTasks + 1) {
+			state = (histogram + 1) << METRICS_HISTOGRAM_SHIFT; // on to the next histogram
+		}
+		else {
+			state++;
+		}
+	}
+	return len;
+}
+
+uint32_t Scheduler::takeMaxCycleTime(void) {
+	uint32_t result = maxCycleTime;
+	maxCycleTime = 0;
+	return result;
+}
@@ -0,0 +1,118 @@
+/*
+ * Scheduler.h
+ * A small cooperative, deadline-aware task scheduler for the main controller loop.
+ *
+ * Each module registers a task with a priority, a period, and a worst-case budget (the latter two in microseconds).
+ * Every call to run() executes the tasks whose period has elapsed, most urgent priority first. Before a task is started,
+ * the scheduler checks that its budget fits in the slack before the next deadline of every more urgent task; if it
+ * doesn't, the task is deferred to a later pass. This keeps the actuators (e-stop, hitch, tillers, sprayers) on time, and
+ * lets housekeeping (HTTP, LIDAR, throttle) fill the gaps between them, rather than running everything in a fixed order
+ * where one slow HTTP request delays every actuator behind it.
+ *
+ * After any task runs, the scheduler re-checks the more urgent tasks before moving on, so an actuator deadline that came
+ * due during a long housekeeping task is serviced before the next housekeeping task starts. Each task runs at most once
+ * per call to run().
+ *
+ * To keep housekeeping from starving when the actuators leave no slack, a task that has been waiting for longer than
+ * MAX_DEFERRAL runs regardless of its budget.
+ *
+ * The clock is read once at the start of each pass, and that same Timestamp is handed to every task in the pass, so the
+ * actuators all work from the same "now". It is only read again for the tasks after a less urgent one has run, since a long
+ * housekeeping task would leave it stale. The clock can be swapped out for a fake one, to test the scheduling
+ * deterministically.
+ *
+ * The scheduler also times every task it runs, along with the full loop cycle, and keeps a log2 histogram of each.
+ * This is always on - recording a sample costs one micros() call and an increment - so writeMetrics() can report where
+ * the cycle budget is going in production, without reflashing a debug build.
+ *
+ * Usage example:
+ *	Scheduler scheduler;
+ *	void updateHitch(Timestamp const& now) { ... }
+ *	scheduler.add(updateHitch, PSTR("hitch"), Scheduler::PRIORITY_ACTUATOR, 1000, 50); // run every 1ms; takes up to 50us
+ *	scheduler.run(); // call this every iteration of loop()
+ *	uint16_t state = 0;
+ *	while (size_t len = scheduler.writeMetrics(buf, size, state)) { ... } // report (and clear) the timing histograms
+ *
+ * Created: 10/16/2026 9:12:37 AM
+ *  Author: troy.honegger
+ */
+
+#pragma once
+
+#include "Common.h"
+
+// Every task is given the time the scheduler read at the start of the pass (see Scheduler::run()).
+typedef void SchedulerTask(Timestamp const& now);
+
+// Counts durations (in microseconds) on a log2 scale. Bucket i counts durations that are i bits long; that is,
+// durations in [2^(i-1), 2^i). The last bucket also catches anything longer. Counts saturate rather than overflow.
+struct DurationHistogram {
+	static const uint8_t NUM_BUCKETS = 18; // up to 2^17us, or about 131ms
+
+	uint16_t counts[NUM_BUCKETS];
+
+	void record(uint32_t duration);
+	void reset(void);
+
+	DurationHistogram() { reset(); }
+};
+
+class Scheduler {
+	public:
+		static const uint8_t MAX_TASKS = 10; // cannot exceed 16, as run() tracks completed tasks in a uint16_t
+		// Priorities - lower values are more urgent
+		static const uint8_t PRIORITY_ACTUATOR = 0;
+		static const uint8_t PRIORITY_HOUSEKEEPING = 1;
+		// The longest time, in microseconds, a task may be deferred for lack of slack before it runs anyway.
+		static const uint32_t MAX_DEFERRAL = 20000;
+	private:
+		struct Task {
+			SchedulerTask* run;
+			const char* name; // PROGMEM
+			DurationHistogram runtimes;
+			uint32_t period;
+			uint32_t budget;
+			uint32_t nextRun;
+			uint8_t priority;
+		};
+
+		Task tasks[MAX_TASKS]; // sorted by priority, most urgent first
+		uint8_t numTasks;
+		Clock* clock;
+
+		DurationHistogram cycleTimes;
+		uint32_t lastCycleStart;
+		uint32_t maxCycleTime; // longest loop cycle since the last call to takeMaxCycleTime()
+
+		// Returns true if the task at the given index is due, and its budget fits before the next deadline of every more urgent task.
+		bool isReady(uint8_t index, uint32_t now) const;
+
+		// disallow copy constructor
+		void operator=(Scheduler const&) {}
+		Scheduler(Scheduler const&) {}
+	public:
+		// Creates a scheduler that reads the time from the given clock. This should be readClock, except in tests.
+		Scheduler(Clock* clock = readClock) : numTasks(0), clock(clock), lastCycleStart(0), maxCycleTime(0) {}
+
+		// Registers a task under the given name (a PROGMEM string, used by writeMetrics()). The task first runs on the next call
+		// to run(), and then every period microseconds after that. A period of 0 runs the task on every call to run() (slack
+		// permitting). budget is the task's worst-case runtime in microseconds. Tasks with equal priority run in the order
+		// they were added.
+		// returns: true on success; false if there are already MAX_TASKS tasks.
+		bool add(SchedulerTask* task, const char* name, uint8_t priority, uint32_t period, uint32_t budget);
+
+		// Runs every task that is ready. This should be called every iteration of the main controller loop.
+		void run(void);
+
+		// Writes the runtime histogram of every task, plus the full loop cycle (under "loop"), as a JSON object. Each histogram
+		// maps its non-empty buckets to their counts (e.g. {"3":1200,"9":4}). The object can be far bigger than any one buffer,
+		// so it's written a piece at a time, like an HttpContentWriter: each call writes as much as fits in buf (size bytes,
+		// including a null terminator), and returns its length, or 0 once it's all been written. state starts at 0, and is kept
+		// between calls. Each bucket is cleared once it's been written, so samples recorded while the object is written
+		// aren't lost - they're reported next time.
+		size_t writeMetrics(char* buf, size_t size, uint16_t& state);
+
+		// Returns the longest loop cycle, in microseconds, since the last call, and starts over. Unlike the histograms, this
+		// isn't cleared by writeMetrics(), so it can be sampled on its own schedule.
+		uint32_t takeMaxCycleTime(void);
+};
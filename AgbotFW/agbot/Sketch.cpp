@@ -1,10 +1,14 @@
 ﻿#include <Arduino.h>
 
+#include "ActuatorTimer.h"
 #include "Common.h"
 #include "Devices.h"
 #include "Http.h"
 #include "HttpApi.h"
 #include "Log.h"
+#include "Scheduler.h"
+#include "StateBroadcast.h"
+#include "WeedUdp.h"
 
 #include <string.h>
 #include <SparkFun_Ublox_Arduino_Library.h>
@@ -17,11 +21,53 @@ Sprayer sprayers[Sprayer::COUNT];
 Throttle throttle;
 LidarLiteBank heightSensors;
 
+// The UDP servers' sockets come out of the same MAX_SOCK_NUM as the HTTP connections' (see HTTP_MAX_CONNECTIONS)
+#define UDP_SOCKET_CNT (2)
+static_assert(HTTP_MAX_CONNECTIONS + UDP_SOCKET_CNT <= MAX_SOCK_NUM, "not enough sockets for the HTTP and UDP servers");
+
 EthernetServer ethernetSrvr(80);
-HttpServer server(ethernetSrvr, 4, httpHandler);
+HttpServer server(ethernetSrvr, HTTP_MAX_CONNECTIONS, httpHandler, httpClassifier, webSocketPoller, webSocketPusher);
+EthernetUDP weedSocket;
+WeedUdpServer weedServer(weedSocket, WEED_UDP_PORT);
+EthernetUDP stateSocket;
+StateBroadcaster stateBroadcaster(stateSocket, STATE_BROADCAST_PORT);
+
+Scheduler scheduler;
 
 #ifndef BENCH_TESTS
 
+// Tasks run by the scheduler. See setup() for their priorities, periods, and budgets. Each is given the time the scheduler
+// read at the start of the pass, so every actuator updated in the same pass works from the same time.
+static void serveHttp(Timestamp const& now) { server.serve(now.ms); }
+static void serveUdp(Timestamp const&) { weedServer.serve(); }
+static void broadcastState(Timestamp const& now) { stateBroadcaster.update(now.ms); }
+static void updateEstop(Timestamp const& now) { estop.update(now.ms); }
+static void updateHitch(Timestamp const&) {
+	hitch.getActualHeight();
+	if (hitch.needsUpdate()) { hitch.update(); }
+}
+static void updateTillers(Timestamp const&) {
+	for (uint8_t i = 0; i < Tiller::COUNT; i++) { tillers[i].update(); }
+}
+#ifndef ACTUATOR_ISR
+// fires every scheduled tiller and sprayer command that has come due (if ACTUATOR_ISR is defined, the actuator timer
+// interrupt does this instead)
+static void dispatchCommands(Timestamp const& now) {
+	commandQueue.dispatch(now.us);
+	sprayerBank.flush(); // switch every sprayer that came due together
+}
+#endif
+static void updateThrottle(Timestamp const&) {
+	// throttle up if the hitch or any tillers are moving (but NOT if the sprayers or the
+	// clutch are active - they shouldn't suck too much power)
+	int8_t throttleUp = hitch.getDH();
+	for (uint8_t i = 0; i < Tiller::COUNT; i++) { throttleUp |= tillers[i].getDH(); }
+	if (throttleUp) { throttle.up(); }
+	else { throttle.down(); }
+	throttle.update();
+}
+static void updateHeightSensors(Timestamp const& now) { heightSensors.update(now.ms); }
+
 void setup() {
 #if LOG_LEVEL != LOG_LEVEL_OFF
 	Serial.begin(115200);
@@ -39,6 +85,9 @@ void setup() {
 		sprayers[i].begin(i, &config);
 	}
 	throttle.begin();
+#ifdef ACTUATOR_ISR
+	actuatorTimer.begin();
+#endif
 
 	uint8_t mac[6] = { 0xA8, 0x61, 0x0A, 0xAE, 0x11, 0xF6 };
 	uint8_t controllerIP[4] = {172, 21, 2, 1};//TODO - should be { 192, 168, 4, 2 };
@@ -46,7 +95,12 @@ void setup() {
 	// adjust these two settings to taste
 	Ethernet.setRetransmissionCount(3);
 	Ethernet.setRetransmissionTimeout(150);
+	if (Ethernet.hardwareStatus() == EthernetW5100 && HTTP_MAX_CONNECTIONS + UDP_SOCKET_CNT > 4) {
+		LOG_WARNING("The W5100 only has 4 sockets - lower HTTP_MAX_CONNECTIONS to %d", 4 - UDP_SOCKET_CNT);
+	}
 	server.begin();
+	weedServer.begin();
+	stateBroadcaster.begin(&config);
 
 	Wire.begin();
 	Wire.setClock(400000L);
@@ -54,76 +108,29 @@ void setup() {
 
 	estop.begin();
 
+	// Actuators run every millisecond, ahead of everything else. Housekeeping fills the slack in between. Without
+	// ACTUATOR_ISR, commands are only dispatched when the commands task runs, so they fire up to 1ms after the time on
+	// their micros() timers; running it more often would leave housekeeping no slack (see Scheduler::isReady()). Budgets
+	// are worst-case runtimes in microseconds - adjust these to taste if the modules change. (The tillers are dominated by
+	// one analogRead() per tiller.)
+	scheduler.add(updateEstop, PSTR("estop"), Scheduler::PRIORITY_ACTUATOR, 1000, 20);
+#ifndef ACTUATOR_ISR
+	scheduler.add(dispatchCommands, PSTR("commands"), Scheduler::PRIORITY_ACTUATOR, 1000, 50);
+#endif
+	scheduler.add(updateTillers, PSTR("tillers"), Scheduler::PRIORITY_ACTUATOR, 1000, 400);
+	scheduler.add(updateHitch, PSTR("hitch"), Scheduler::PRIORITY_ACTUATOR, 1000, 50);
+	scheduler.add(serveUdp, PSTR("udp"), Scheduler::PRIORITY_HOUSEKEEPING, 0, 400);
+	scheduler.add(broadcastState, PSTR("broadcast"), Scheduler::PRIORITY_HOUSEKEEPING, 1000, 300);
+	scheduler.add(serveHttp, PSTR("serve"), Scheduler::PRIORITY_HOUSEKEEPING, 0, 500);
+	scheduler.add(updateHeightSensors, PSTR("heightSensors"), Scheduler::PRIORITY_HOUSEKEEPING, 1000, 500);
+	scheduler.add(updateThrottle, PSTR("throttle"), Scheduler::PRIORITY_HOUSEKEEPING, 10000, 150);
+
 	LOG_INFO("Setup complete.");
 }
 
 
-//#define TIMING_ANALYSIS
-#ifdef TIMING_ANALYSIS
-static uint32_t starttime;
-static uint32_t lastprint;
-static uint32_t ncycles;
-// counts measures response times on a log scale.
-static uint32_t counts[33];
-#endif
-
 void loop() {
-#ifdef TIMING_ANALYSIS
-	if (!starttime) { // should run on first loop only
-		starttime = micros();
-		if (!lastprint) {
-			lastprint = starttime;
-		}
-	}
-#endif
-
-	server.serve();
-	
-	estop.update();
-
-	hitch.getActualHeight();
-	if (hitch.needsUpdate()) { hitch.update(); }
-	for (uint8_t i = 0; i < Tiller::COUNT; i++) { tillers[i].update(); }
-	for (uint8_t i = 0; i < Sprayer::COUNT; i++) { sprayers[i].update(); }
-
-	// throttle up if the hitch or any tillers are moving (but NOT if the sprayers or the
-	// clutch are active - they shouldn't suck too much power)
-	int8_t throttleUp = hitch.getDH();
-	for (uint8_t i = 0; i < Tiller::COUNT; i++) { throttleUp |= tillers[i].getDH(); }
-	if (throttleUp) { throttle.up(); }
-	else { throttle.down(); }
-	throttle.update();
-
-	heightSensors.update();
-
-#ifdef TIMING_ANALYSIS
-	{
-		ncycles++;
-		uint32_t time = micros() - starttime;
-		starttime += time;
-		uint8_t i = 0;
-		while (time) { // compute ceil(log2(time)) for logging
-			time >>= 1;
-			i++;
-		}
-		counts[i]++;
-		if (starttime - lastprint >= 1000000UL) {
-			// get median cycle time by computing a cumulative sum until n = ncycles/2
-			uint32_t n;
-			for (i = 0, n = 0; n < (ncycles >> 1); i++) {
-				n += counts[i];
-			}
-			// get max cycle time by scanning counts from the back
-			uint8_t maxi;
-			for (maxi = 32; maxi && !counts[maxi]; maxi--);
-			LOG_INFO("Cycles: %ldHz; max 2^%dus, median 2^%dus", ncycles, maxi, i);
-
-			memset(counts, 0, sizeof(counts));
-			lastprint = starttime;
-			ncycles = 0;
-		}
-	}
-#endif
+	scheduler.run();
 }
 
 #endif // BENCH_TESTS
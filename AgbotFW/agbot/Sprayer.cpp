@@ -6,89 +6,177 @@
  *  Author: troy.honegger
  */
 
+#include "ActuatorTimer.h"
 #include "Common.h"
 #include "Config.h"
+#include "FastGpio.h"
+#include "Log.h"
 #include "Sprayer.h"
 
-#define SET_BIT(x, i)		((x) |=  (1<<(i)))
-#define UNSET_BIT(x, i)		((x) &= ~(1<<(i)))
-#define IS_SET(x, i)		(!!((x) & (1<<(i))))
+#include <util/atomic.h>
+
+// sprayerBank.flush() relies on this mapping of sprayers to port bits
+static_assert(StaticPin<SprayerBank::FIRST_PIN>::PORT == GPIO_PORTD && StaticPin<SprayerBank::FIRST_PIN>::MASK == _BV(7),
+		"sprayer 0 should be on PD7");
+static_assert(StaticPin<SprayerBank::FIRST_PIN + 1>::PORT == GPIO_PORTG && StaticPin<SprayerBank::FIRST_PIN + 1>::MASK == _BV(2)
+		&& StaticPin<SprayerBank::FIRST_PIN + 3>::PORT == GPIO_PORTG && StaticPin<SprayerBank::FIRST_PIN + 3>::MASK == _BV(0),
+		"sprayers 1-3 should be on PG2-PG0");
+static_assert(StaticPin<SprayerBank::FIRST_PIN + 4>::PORT == GPIO_PORTL && StaticPin<SprayerBank::FIRST_PIN + 4>::MASK == _BV(7)
+		&& StaticPin<SprayerBank::FIRST_PIN + 7>::PORT == GPIO_PORTL && StaticPin<SprayerBank::FIRST_PIN + 7>::MASK == _BV(4),
+		"sprayers 4-7 should be on PL7-PL4");
+
+SprayerBank sprayerBank;
+
+void SprayerBank::begin(uint8_t id) {
+	CachedPin pin;
+	pin.begin(FIRST_PIN + id);
+	pin.write(OFF_VOLTAGE);
+	pin.output();
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		outputs &= ~(1 << id);
+		pending &= ~(1 << id);
+	}
+}
+
+void SprayerBank::end(uint8_t id) {
+	CachedPin pin;
+	pin.begin(FIRST_PIN + id);
+	pin.input();
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		outputs &= ~(1 << id);
+		pending &= ~(1 << id);
+	}
+}
+
+void SprayerBank::flush(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t changed = outputs ^ pending;
+		if (!changed) {
+			return;
+		}
+		uint8_t levels = ON_VOLTAGE ? pending : ~pending;
+		// sprayer 0 is on PD7
+		uint8_t maskD = (changed & 0x01) << 7;
+		// sprayers 1-3 are on PG2-PG0, in reverse order
+		uint8_t maskG = ((changed & 0x02) << 1) | (changed & 0x04) | ((changed & 0x08) >> 3);
+		uint8_t levelsG = ((levels & 0x02) << 1) | (levels & 0x04) | ((levels & 0x08) >> 3);
+		// sprayers 4-7 are on PL7-PL4, in reverse order
+		uint8_t maskL = ((changed & 0x10) << 3) | ((changed & 0x20) << 1) | ((changed & 0x40) >> 1) | ((changed & 0x80) >> 3);
+		uint8_t levelsL = ((levels & 0x10) << 3) | ((levels & 0x20) << 1) | ((levels & 0x40) >> 1) | ((levels & 0x80) >> 3);
+		if (maskD) {
+			PORTD = (PORTD & ~maskD) | ((levels << 7) & maskD);
+		}
+		if (maskG) {
+			PORTG = (PORTG & ~maskG) | (levelsG & maskG);
+		}
+		if (maskL) {
+			PORTL = (PORTL & ~maskL) | (levelsL & maskL);
+		}
+		outputs = pending;
+	}
+}
 
 void Sprayer::begin(uint8_t id, Config const* config) {
-	UNSET_BIT(state, 7); // status = OFF
-	state = id & 0xF;
+	state = id & 0xF; // status = OFF
+	bridgedGaps = 0;
+	avoidedToggles = 0;
 	assert(config);
 	this->config = config;
-	pinMode(getPin(), OUTPUT);
-	digitalWrite(getPin(), OFF_VOLTAGE);
+	sprayerBank.begin(id);
 }
 
 Sprayer::~Sprayer() {
 	setActualStatus(OFF);
-	pinMode(getPin(), INPUT);
+	sprayerBank.end(getId());
 }
 
 inline void Sprayer::setActualStatus(bool status) {
 	if (getStatus() != status) {
 		if (status == ON) {
 			state |= 0x80;
-			digitalWrite(getPin(), ON_VOLTAGE);
 		}
 		else {
 			state &= 0x7F;
-			digitalWrite(getPin(), OFF_VOLTAGE);
 		}
+		sprayerBank.set(getId(), status);
 	}
 }
 
-bool Sprayer::setStatus(bool status, uint32_t delay) {
-	uint32_t triggerTime = millis() + delay;
-	for (unsigned int i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
-		if (timers[i].isSet && timeCmp(triggerTime, timers[i].time) <= 0) {
-			timers[i].stop();
+bool Sprayer::setStatus(bool status, uint32_t delay, uint32_t now) {
+	assert(delay <= CommandQueue::MAX_DELAY);
+	bool success = true;
+	ACTUATOR_ATOMIC {
+		uint32_t triggerTime = now + delay * 1000;
+		// cancel all commands that are triggered to fire after this one
+		commandQueue.cancel(this, triggerTime);
+		killWindows.truncate(triggerTime);
+		scheduleKillEdge();
+		if (delay) {
+			success = commandQueue.push(this, status, triggerTime);
 		}
-	}
-	if (delay) {
-		for (unsigned int i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
-			if (!timers[i].isSet) {
-				timers[i].start(delay);
-				if (status) { SET_BIT(commandList, i); }
-				else { UNSET_BIT(commandList, i); }
-				goto foundSlot;
-			}
+		else {
+			setActualStatus(status);
+			sprayerBank.flush();
 		}
-		// error - didn't find a slot to put the command
-		return false;
-		foundSlot: ;
 	}
-	else {
-		setActualStatus(status);
+#ifdef ACTUATOR_ISR
+	actuatorTimer.rearm();
+#endif
+	return success;
+}
+
+bool Sprayer::killWeed(uint32_t now) {
+	// the settings are in milliseconds, and the kill windows are in microseconds
+	uint32_t onDelay = config->get(Setting::ResponseDelay) * 1000L - config->get(Setting::Precision) * 500L;
+	uint32_t offDelay = config->get(Setting::ResponseDelay) * 1000L + config->get(Setting::Precision) * 500L;
+	uint32_t minOffTime = config->get(Setting::SprayerMinOffTime) * 1000L;
+	bool success;
+	ACTUATOR_ATOMIC {
+		uint8_t bridged;
+		killWindows.add(now + onDelay, now + offDelay, minOffTime, &bridged);
+		// saturate rather than overflow. Only a bridged gap saves an OFF and an ON: a window that overlaps another adds no
+		// switches of its own, and a merge forced by a full KillWindows isn't a choice the setting made.
+		bridgedGaps = bridgedGaps > 0xFFFF - bridged ? 0xFFFF : bridgedGaps + bridged;
+		avoidedToggles = avoidedToggles > 0xFFFF - 2 * bridged ? 0xFFFF : avoidedToggles + 2 * bridged;
+		success = scheduleKillEdge();
 	}
-	return true;
+#ifdef ACTUATOR_ISR
+	actuatorTimer.rearm();
+#endif
+	if (!success) {
+		LOG_WARNING("Sprayer %hhu: command queue is full - weed kill not scheduled", getId());
+	}
+	return success;
 }
 
-// NOWNOW make sure there's enough room to store two commands - if we only have
-// room for one, (which may be quite likely) the sprayer will lock on forever
-void Sprayer::killWeed() {
-	setStatus(ON, config->get(Setting::ResponseDelay) - config->get(Setting::Precision) / 2);
-	setStatus(OFF, config->get(Setting::ResponseDelay) + config->get(Setting::Precision) / 2);
+bool Sprayer::scheduleKillEdge() {
+	// The sprayer never has more than one KILL_EDGE in the queue, and execute() is only called after its command has been
+	// removed from the queue, so once a window has started, there is always room to schedule its END.
+	commandQueue.cancelCommand(this, KILL_EDGE);
+	uint32_t time;
+	return !killWindows.getNextEdge(time) || commandQueue.push(this, KILL_EDGE, time);
 }
 
-void Sprayer::update() {
-	// see if any commands are done waiting and ready to be executed.
-	for (unsigned int i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
-		if (timers[i].isUp()) {
-			setActualStatus(IS_SET(commandList, i));
-			break;
+void Sprayer::execute(uint8_t command, uint32_t time) {
+	if (command == KILL_EDGE) {
+		switch (killWindows.advance(time)) {
+			case KillWindows::START:
+				setActualStatus(ON);
+				break;
+			case KillWindows::END:
+				setActualStatus(OFF);
+				break;
+			default:
+				break;
 		}
+		scheduleKillEdge();
+	}
+	else {
+		setActualStatus(command);
 	}
 }
 
 size_t Sprayer::serialize(char* str, size_t n) const {
-	if (getStatus()) {
-		return snprintf_P(str, n, PSTR("{\"status\": \"ON\"}"));
-	}
-	else {
-		return snprintf_P(str, n, PSTR("{\"status\": \"OFF\"}"));
-	}
+	return snprintf_P(str, n, PSTR("{\"status\": \"%S\", \"bridged\": %u, \"avoided\": %u}"),
+		getStatus() ? PSTR("ON") : PSTR("OFF"), bridgedGaps, avoidedToggles);
 }
@@ -6,14 +6,16 @@
  * The sprayer class breaks from C++ RAII pattern, to allow for its instantiation as a global variable before main() runs.
  * Accordingly, you must call begin() on every sprayer before using it.
  * 
- * sprayer.update() must be called every loop iteration. Most operations are scheduled, not immediate,
- * so failing to call update() will result in the physical I/O points not being activated
+ * Most operations are scheduled in the shared CommandQueue (see Common.h), not immediate, so commandQueue.dispatch() must
+ * be called every loop iteration; otherwise, the physical I/O points will not be activated. Scheduled commands only update
+ * the SprayerBank, so every sprayer due at the same time switches together - call sprayerBank.flush() after dispatching.
  * 
  * Usage example:
  *	Sprayer sprayer;
  *	sprayer.begin(0, &config); // requires pre-initialized configuration - see Config.h
  *	sprayer.killWeed();
- *	sprayer.update(); // call this repeatedly so sprayer can turn on when ready
+ *	commandQueue.dispatch(micros()); // call these repeatedly so sprayer can turn on when ready
+ *	sprayerBank.flush();
  * 
  * Created: 3/4/2019 1:00:05 PM
  *  Author: troy.honegger
@@ -25,30 +27,72 @@
 #include <Arduino.h>
 #include "Common.h"
 #include "Config.h"
+#include "KillWindows.h"
 
+// Drives the valves of all the sprayers together. The sprayer pins (38-45) span three ports: pin 38 is on PORTD, 39-41 are
+// on PORTG, and 42-45 are on PORTL. The bank keeps the status of every valve as one bitmask (bit i for sprayer i), and
+// flush() writes only the ports with valves that changed, one after another with interrupts disabled. This way, every
+// valve that changes in the same flush switches at the same instant, give or take a few clock cycles.
+class SprayerBank {
+	public:
+		static const uint8_t FIRST_PIN = 38; // sprayer i is on pin FIRST_PIN + i
+		static const uint8_t ON_VOLTAGE = LOW; // TODO: toggle this if sprayers are active high
+		static const uint8_t OFF_VOLTAGE = !ON_VOLTAGE;
+	private:
+		uint8_t outputs; // the valves as they are now
+		uint8_t pending; // the valves as they will be after the next flush()
+
+		// disallow copy constructor
+		void operator=(SprayerBank const&) {}
+		SprayerBank(SprayerBank const&) {}
+	public:
+		SprayerBank() : outputs(0), pending(0) {}
+
+		// Sets up the given sprayer's pin as an output, and turns its valve off immediately.
+		void begin(uint8_t id);
+		// Returns the given sprayer's pin to an input, and turns its valve off immediately.
+		void end(uint8_t id);
+
+		// Sets the status of the given sprayer's valve (true is on) at the next flush().
+		inline void set(uint8_t id, bool status) {
+			if (status) { pending |= 1 << id; }
+			else { pending &= ~(1 << id); }
+		}
+		// Sets the status of every valve at the next flush(). Bit i of mask is set to turn sprayer i on.
+		inline void setAll(uint8_t mask) { pending = mask; }
+
+		// Writes every valve that has changed since the last flush() to the port registers.
+		void flush(void);
+
+		// Returns the valves as they are now. Bit i is set if sprayer i is on.
+		inline uint8_t getOutputs(void) const { return outputs; }
+};
 
-class Sprayer {
+extern SprayerBank sprayerBank;
+
+class Sprayer : public Actuator {
 	public:
 		static const uint8_t COUNT = 8; // number of sprayers on the machine.
 		static const bool ON = true;
 		static const bool OFF = false;
 	private:
-		static const uint8_t ON_VOLTAGE = LOW; // TODO: toggle this if sprayers are active high
-		static const uint8_t OFF_VOLTAGE = !ON_VOLTAGE;
-		static const uint8_t COMMAND_LIST_SIZE = 4; // cannot exceed 8 as each command occupies a bit in a uint8_t
-
-		Timer timers[COMMAND_LIST_SIZE];
+		static const uint8_t KILL_EDGE = 2; // scheduled in place of ON/OFF at the next edge of killWindows
 
 		Config const* config;
 
 		// To save space, encodes ID in bits 0-3 and status in bit 7 (where bit 0 is LSB)
 		uint8_t state;
-		uint8_t commandList;
 
-		// Physically turns the sprayer on or off.
+		KillWindows killWindows;
+		uint16_t bridgedGaps; // number of off-times shorter than Setting::SprayerMinOffTime that were skipped
+		uint16_t avoidedToggles; // number of times the valve didn't have to switch because a gap was bridged
+
+		// Turns the sprayer on or off in the SprayerBank. This takes effect at the next sprayerBank.flush().
 		void setActualStatus(bool status);
 
-		inline uint8_t getPin() const { return getId() + 38; }
+		// Replaces the KILL_EDGE command in the CommandQueue with one for the next edge of killWindows.
+		// returns: false if the queue is full.
+		bool scheduleKillEdge(void);
 
 		// disallow copy constructor since Sprayer interacts with hardware, so duplicate instances are a bad idea
 		void operator=(Sprayer const&) {}
@@ -70,18 +114,32 @@ class Sprayer {
 		inline uint8_t getId() const { return state & 0x0F; }
 		// Retrieves the status (ON or OFF) of the sprayer
 		inline bool getStatus() const { return state & 0x80 ? ON : OFF; }
-
-		// Tells the sprayer to turn ON or OFF after a delay. Cancels all operations already scheduled to occur after that delay.
-		// returns: true if there is room in the command list to schedule the operation; false if the command list is full.
-		bool setStatus(bool status, uint32_t delay = 0);
+		// Retrieves the number of off-times skipped because they were shorter than Setting::SprayerMinOffTime
+		inline uint16_t getBridgedGaps() const { return bridgedGaps; }
+		// Retrieves the number of valve switches saved by merging kill windows
+		inline uint16_t getAvoidedToggles() const { return avoidedToggles; }
+
+		// Tells the sprayer to turn ON or OFF after a delay. If there is no delay, the valve switches immediately. Cancels all
+		// operations (including weed kills) already scheduled to occur after that delay.
+		// returns: true if there is room in the CommandQueue to schedule the operation; false if the queue is full.
+		bool setStatus(bool status, uint32_t delay = 0) { return setStatus(status, delay, micros()); }
+		// same as setStatus(), but counts the delay (still in milliseconds) from the given micros() time.
+		bool setStatus(bool status, uint32_t delay, uint32_t now);
 
 		// Signals to the sprayer that a weed has been sighted up ahead and the sprayer should turn on at some point in the future.
 		// The exact time is computed from the configuration settings. This command should be issued for every weed that is sighted,
 		// even if the sprayer is already on. If enough time passes after sending this command, the sprayer will turn back off.
-		void killWeed(void);
-
-		// Checks for and performs any scheduled spray operations. This should be called every iteration of the main controller loop.
-		void update();
+		// Overlapping kills are merged, so the sprayer stays on through a patch of weeds rather than switching on and off for each.
+		// Likewise, if the sprayer would turn off for less than Setting::SprayerMinOffTime between two weeds, it stays on.
+		// The timing is computed from now (a micros() time), to the microsecond, so sprayers killing the same weeds should be given
+		// the same time, to make sure they switch together.
+		// returns: true if the kill was scheduled; false if the command queue is full.
+		bool killWeed(uint32_t now);
+		inline bool killWeed(void) { return killWeed(micros()); }
+
+		// Turns the sprayer ON or OFF (command is the status), or follows the kill windows. Called by the CommandQueue when a
+		// scheduled command comes due. This only updates the SprayerBank, and is cheap enough to call from an interrupt.
+		void execute(uint8_t command, uint32_t time);
 
 		// Writes the information pertaining to this sprayer to the given string. Writes at most n characters, including the null
 		// terminator, and returns the number of characters in the serialized string, excluding the null terminator. If the string length
@@ -0,0 +1,85 @@
+/*
+ * StateBroadcast.cpp
+ * Implements the StateBroadcaster class defined in StateBroadcast.h for multicasting the controller's state over UDP.
+ * See StateBroadcast.h for more info.
+ * Created: 10/16/2026 9:04:46 PM
+ *  Author: troy.honegger
+ */
+
+#include "Devices.h"
+#include "StateBroadcast.h"
+
+static inline uint8_t* put16(uint8_t* frame, uint16_t value) {
+	frame[0] = value;
+	frame[1] = value >> 8;
+	return frame + 2;
+}
+
+static inline uint8_t* put32(uint8_t* frame, uint32_t value) {
+	return put16(put16(frame, value), value >> 16);
+}
+
+void StateBroadcaster::begin(Config const* config) {
+	StateBroadcaster::config = config;
+}
+
+IPAddress StateBroadcaster::groupAddress(uint16_t group) {
+	return IPAddress(239, 255, group >> 8, group & 0xFF);
+}
+
+void StateBroadcaster::update(uint32_t now) {
+	uint16_t period = config->get(Setting::BroadcastPeriod);
+	uint16_t newGroup = config->get(Setting::BroadcastGroup);
+	if (isOpen && (!period || newGroup != group)) {
+		// the broadcast was turned off, or moved to another group - give the socket back until it's needed
+		udp.stop();
+		isOpen = false;
+	}
+	if (!period || now - lastBroadcast < period) {
+		return;
+	}
+	if (!isOpen) {
+		group = newGroup;
+		if (!udp.beginMulticast(groupAddress(group), port)) {
+			return; // no free socket - try again next period
+		}
+		isOpen = true;
+	}
+	lastBroadcast = now;
+
+	uint8_t frame[FRAME_SIZE];
+	buildFrame(frame, now);
+	udp.beginPacket(groupAddress(group), port);
+	udp.write(frame, FRAME_SIZE);
+	udp.endPacket();
+	sequence++;
+}
+
+void StateBroadcaster::buildFrame(uint8_t* frame, uint32_t now) {
+	uint8_t* p = frame;
+	*p++ = VERSION;
+	p = put16(p, sequence);
+	p = put32(p, now);
+	for (uint8_t i = 0; i < Tiller::COUNT; i++) {
+		*p++ = tillers[i].getActualHeight();
+		*p++ = tillers[i].getTargetHeight();
+		*p++ = static_cast<uint8_t>(tillers[i].getDH());
+	}
+	static_assert(Sprayer::COUNT <= 8, "the sprayers' statuses are sent as a one-byte mask");
+	uint8_t sprayerMask = 0;
+	for (uint8_t i = 0; i < Sprayer::COUNT; i++) {
+		if (sprayers[i].getStatus() == Sprayer::ON) {
+			sprayerMask |= 1 << i;
+		}
+	}
+	*p++ = sprayerMask;
+	*p++ = hitch.getActualHeight();
+	*p++ = hitch.getTargetHeight();
+	*p++ = static_cast<uint8_t>(hitch.getDH());
+	for (uint8_t i = 0; i < LidarLiteBank::NUM_SENSORS; i++) {
+		p = put16(p, heightSensors[i].isPaired() ? heightSensors[i].getHeight() : 0xFFFF);
+	}
+	uint32_t maxCycleTime = scheduler.takeMaxCycleTime();
+	p = put16(p, maxCycleTime > 0xFFFF ? 0xFFFF : maxCycleTime);
+	assert(p == frame + FRAME_SIZE);
+}
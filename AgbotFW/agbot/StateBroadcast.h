@@ -0,0 +1,66 @@
+/*
+ * StateBroadcast.h
+ * Multicasts a snapshot of the controller's state over UDP, at a fixed rate, in a compact binary frame.
+ *
+ * Polling the HTTP API (or holding a WebSocket open) costs each observer a TCP connection, and the controller a response per
+ * observer. A multicast frame is sent once, however many observers are listening, and is small enough to send many times a
+ * second: every tiller's and the hitch's height, the sprayers, the LIDAR heights, and the main loop's longest cycle. A lost
+ * frame is simply superseded by the next one, so nothing is acked or retransmitted.
+ *
+ * The broadcast is off unless the BroadcastPeriod setting is non-zero. The frames go to port STATE_BROADCAST_PORT of the
+ * multicast group set by the BroadcastGroup setting. Both can be changed on the fly. See api.md for the frame format.
+ *
+ * Usage example:
+ *	EthernetUDP stateSocket;
+ *	StateBroadcaster stateBroadcaster(stateSocket, STATE_BROADCAST_PORT);
+ *	stateBroadcaster.begin(&config); // in setup(), after Ethernet.begin()
+ *	stateBroadcaster.update(millis()); // call this repeatedly to send a frame whenever one is due
+ *
+ * Created: 10/16/2026 8:52:17 PM
+ *  Author: troy.honegger
+ */
+
+#pragma once
+
+#include <Ethernet.h>
+
+#include "Common.h"
+#include "Config.h"
+#include "LidarLiteV3.h"
+#include "Sprayer.h"
+#include "Tiller.h"
+
+// UDP port the state frames are sent to
+#define STATE_BROADCAST_PORT		(5001)
+
+class StateBroadcaster {
+	public:
+		static const uint8_t VERSION = 1; // first byte of every frame
+		// version, sequence, time, each tiller's height, target, and dh, the sprayer mask, the hitch's height, target, and dh,
+		// each LIDAR height, and the longest cycle time
+		static const uint8_t FRAME_SIZE = 1 + 2 + 4 + 3 * Tiller::COUNT + 1 + 3 + 2 * LidarLiteBank::NUM_SENSORS + 2;
+	private:
+		EthernetUDP& udp;
+		uint16_t port;
+		Config const* config;
+
+		uint32_t lastBroadcast; // millis() time the last frame was sent
+		uint16_t sequence; // sequence number of the next frame
+		uint16_t group; // BroadcastGroup setting the socket was opened for
+		bool isOpen;
+
+		// Returns the multicast address the given BroadcastGroup setting stands for
+		static IPAddress groupAddress(uint16_t group);
+		// Fills in a frame with the current state
+		void buildFrame(uint8_t* frame, uint32_t now);
+	public:
+		StateBroadcaster(EthernetUDP& udp, uint16_t port) : udp(udp), port(port), config(nullptr), lastBroadcast(0), sequence(0),
+				group(0), isOpen(false) {}
+
+		// Sets the config the broadcast settings are read from. Ethernet must already be initialized.
+		void begin(Config const* config);
+
+		// Sends a frame if BroadcastPeriod milliseconds have passed since the last one. now is the time in milliseconds.
+		// Call this repeatedly.
+		void update(uint32_t now);
+};
@@ -7,14 +7,15 @@
 
 #include <Arduino.h>
 #include "Common.h"
+#include "FastGpio.h"
 #include "Throttle.h"
 
 void Throttle::begin() {
-	pinMode(XTD_PIN, OUTPUT);
-	digitalWrite(XTD_PIN, OFF_VOLTAGE);
-	pinMode(RET_PIN, OUTPUT);
-	digitalWrite(RET_PIN, OFF_VOLTAGE);
-	pinMode(SENSOR_PIN, INPUT);
+	StaticPin<XTD_PIN>::output();
+	StaticPin<XTD_PIN>::write(OFF_VOLTAGE);
+	StaticPin<RET_PIN>::output();
+	StaticPin<RET_PIN>::write(OFF_VOLTAGE);
+	StaticPin<SENSOR_PIN>::input();
 }
 
 void Throttle::updateActuatorLength() const {
@@ -56,16 +57,16 @@ void Throttle::update() {
 		dl = newDL;
 		switch (newDL) {
 			case 1:
-				digitalWrite(RET_PIN, OFF_VOLTAGE);
-				digitalWrite(XTD_PIN, ON_VOLTAGE);
+				StaticPin<RET_PIN>::write(OFF_VOLTAGE);
+				StaticPin<XTD_PIN>::write(ON_VOLTAGE);
 				break;
 			case -1:
-				digitalWrite(XTD_PIN, OFF_VOLTAGE);
-				digitalWrite(RET_PIN, ON_VOLTAGE);
+				StaticPin<XTD_PIN>::write(OFF_VOLTAGE);
+				StaticPin<RET_PIN>::write(ON_VOLTAGE);
 				break;
 			default:
-				digitalWrite(XTD_PIN, OFF_VOLTAGE);
-				digitalWrite(RET_PIN, OFF_VOLTAGE);
+				StaticPin<XTD_PIN>::write(OFF_VOLTAGE);
+				StaticPin<RET_PIN>::write(OFF_VOLTAGE);
 				break;
 		}
 	}
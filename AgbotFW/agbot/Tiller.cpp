@@ -8,8 +8,10 @@
 
 #include <Arduino.h>
 
+#include "ActuatorTimer.h"
 #include "Common.h"
 #include "Config.h"
+#include "Log.h"
 #include "Tiller.h"
 
 #include <string.h>
@@ -19,71 +21,107 @@ void Tiller::begin(uint8_t id, Config const* config) {
 	assert(config);
 	targetHeight = STOP;
 	this->config = config;
-	pinMode(getRaisePin(), OUTPUT);
-	digitalWrite(getRaisePin(), getOffVoltage());
-	pinMode(getLowerPin(), OUTPUT);
-	digitalWrite(getLowerPin(), getOffVoltage());
-	pinMode(getHeightSensorPin(), INPUT);
+	raisePin.begin(getRaisePin());
+	raisePin.output();
+	raisePin.write(getOffVoltage());
+	lowerPin.begin(getLowerPin());
+	lowerPin.output();
+	lowerPin.write(getOffVoltage());
+	CachedPin heightSensorPin;
+	heightSensorPin.begin(getHeightSensorPin());
+	heightSensorPin.input();
 
 	updateActualHeight();
 }
 
 Tiller::~Tiller() {
-	pinMode(getRaisePin(), INPUT);
-	pinMode(getLowerPin(), INPUT);
+	raisePin.input();
+	lowerPin.input();
 }
 
 inline void Tiller::updateActualHeight() const { actualHeight = map(analogRead(getHeightSensorPin()), 1023, 204, 0, MAX_HEIGHT); }
 
-bool Tiller::setHeight(uint8_t command, uint32_t delay) {
-	uint32_t triggerTime = millis() + delay;
-	// stop all timers that are triggered to fire after this timer
-	for (unsigned int i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
-		if (timers[i].isSet && timeCmp(triggerTime, timers[i].time) <= 0) {
-			timers[i].stop();
+bool Tiller::setHeight(uint8_t command, uint32_t delay, uint32_t now) {
+	assert(delay <= CommandQueue::MAX_DELAY);
+	bool success = true;
+	ACTUATOR_ATOMIC {
+		uint32_t triggerTime = now + delay * 1000;
+		// cancel all commands that are triggered to fire after this one
+		commandQueue.cancel(this, triggerTime);
+		killWindows.truncate(triggerTime);
+		scheduleKillEdge();
+		if (delay) {
+			success = commandQueue.push(this, command, triggerTime);
 		}
-	}
-	if (delay) {
-		for (unsigned int i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
-			if (!timers[i].isSet) {
-				timers[i].start(delay);
-				commandList[i] = command;
-				goto foundSlot;
-			}
+		else {
+			targetHeight = command;
 		}
-		// error - didn't find a slot to put the command
-		return false;
-		foundSlot: ;
 	}
-	else {
-		targetHeight = command;
+#ifdef ACTUATOR_ISR
+	actuatorTimer.rearm();
+#endif
+	return success;
+}
+
+bool Tiller::killWeed(uint32_t now) {
+	// lowerTime = now + responseDelay - (raisedHeight - loweredHeight)*tillerLowerTime/100 - precision/2
+	// The settings are in milliseconds, and the kill windows are in microseconds. The delays are computed in microseconds
+	// from the start, so none of the fractions are rounded off.
+	uint32_t lowerDelay = config->get(Setting::ResponseDelay) * 1000L
+		- (config->get(Setting::TillerRaisedHeight) - config->get(Setting::TillerLoweredHeight)) * static_cast<long>(config->get(Setting::TillerLowerTime)) * 10L
+		- config->get(Setting::Precision) * 500L;
+	uint32_t raiseDelay = config->get(Setting::ResponseDelay) * 1000L + config->get(Setting::Precision) * 500L;
+	bool success;
+	ACTUATOR_ATOMIC {
+		killWindows.add(now + lowerDelay, now + raiseDelay);
+		success = scheduleKillEdge();
 	}
-	return true;
+#ifdef ACTUATOR_ISR
+	actuatorTimer.rearm();
+#endif
+	if (!success) {
+		LOG_WARNING("Tiller %hhu: command queue is full - weed kill not scheduled", getId());
+	}
+	return success;
 }
 
-// NOWNOW make sure there's enough room to store two commands - if we only have
-// room for one, (which may be quite likely) the tiller will stay down forever
-void Tiller::killWeed() {
-	uint32_t delay;
-	// lowerTime = millis() + responseDelay - (raisedHeight - loweredHeight)*tillerLowerTime/100 - precision/2
-	delay = config->get(Setting::ResponseDelay)
-		- (config->get(Setting::TillerRaisedHeight) - config->get(Setting::TillerLoweredHeight)) * static_cast<long>(config->get(Setting::TillerLowerTime)) / 100l
-		- config->get(Setting::Precision) / 2;
-	setHeight(TillerCommand::LOWERED, delay);
-	delay = config->get(Setting::ResponseDelay) + config->get(Setting::Precision) / 2;
-	setHeight(TillerCommand::RAISED, delay);
+bool Tiller::scheduleKillEdge() {
+	// The tiller never has more than one KILL_EDGE in the queue, and execute() is only called after its command has been
+	// removed from the queue, so once a window has started, there is always room to schedule its END.
+	commandQueue.cancelCommand(this, KILL_EDGE);
+	uint32_t time;
+	return !killWindows.getNextEdge(time) || commandQueue.push(this, KILL_EDGE, time);
 }
 
 void Tiller::update() {
-	// see if any commands are done waiting and ready to be executed.
-	for (unsigned int i = 0; i < sizeof(commandList) / sizeof(commandList[0]); i++) {
-		if (timers[i].isUp()) {
-			targetHeight = commandList[i];
-			break;
+	updateActualHeight();
+	ACTUATOR_ATOMIC {
+		// targetHeight may have been set without a delay since the last update
+		applyTargetHeight();
+	}
+}
+
+void Tiller::execute(uint8_t command, uint32_t time) {
+	if (command == KILL_EDGE) {
+		switch (killWindows.advance(time)) {
+			case KillWindows::START:
+				targetHeight = TillerCommand::LOWERED;
+				break;
+			case KillWindows::END:
+				targetHeight = TillerCommand::RAISED;
+				break;
+			default:
+				break;
 		}
+		scheduleKillEdge();
 	}
+	else {
+		targetHeight = command;
+	}
+	applyTargetHeight();
+}
 
-	updateActualHeight();
+void Tiller::applyTargetHeight() {
 	int8_t newDh;
 	switch (targetHeight) {
 		case TillerCommand::STOP:
@@ -111,16 +149,16 @@ void Tiller::update() {
 		setDH(newDh);
 		switch (newDh) {
 			case 0:
-				digitalWrite(getRaisePin(), getOffVoltage());
-				digitalWrite(getLowerPin(), getOffVoltage());
+				raisePin.write(getOffVoltage());
+				lowerPin.write(getOffVoltage());
 				break;
 			case 1:
-				digitalWrite(getLowerPin(), getOffVoltage());
-				digitalWrite(getRaisePin(), getOnVoltage());
+				lowerPin.write(getOffVoltage());
+				raisePin.write(getOnVoltage());
 				break;
 			case -1:
-				digitalWrite(getRaisePin(), getOffVoltage());
-				digitalWrite(getLowerPin(), getOnVoltage());
+				raisePin.write(getOffVoltage());
+				lowerPin.write(getOnVoltage());
 				break;
 		}
 	}
@@ -6,8 +6,9 @@
  * The tiller class breaks from C++ RAII pattern, to allow for its instantiation as a global variable before main() runs.
  * Accordingly, you must call begin() on every tiller before using it.
  * 
- * tiller.update() must be called every loop iteration. Most operations are scheduled, not immediate,
- * so failing to call update() will result in the physical I/O points not being activated
+ * tiller.update() must be called every loop iteration. Most operations are scheduled in the shared CommandQueue (see
+ * Common.h), not immediate, so commandQueue.dispatch() must also be called every loop iteration; otherwise, the physical
+ * I/O points will not be activated
  * 
  * Usage example:
  *	Tiller tiller;
@@ -23,6 +24,8 @@
 
 #include "Common.h"
 #include "Config.h"
+#include "FastGpio.h"
+#include "KillWindows.h"
 
 // Commands that can be given to the tiller in setHeight() in place of a height 0-100.
 enum TillerCommand : uint8_t {
@@ -33,18 +36,20 @@ enum TillerCommand : uint8_t {
 	STOP = 255 // Tiller should stop where it is.
 };
 
-class Tiller {
+class Tiller : public Actuator {
 	public:
 		static const uint8_t COUNT = 3; // number of tillers on the machine
 		static const uint8_t MAX_HEIGHT = 100;
 	private:
-		static const uint8_t COMMAND_LIST_SIZE = 4;
-		Timer timers[COMMAND_LIST_SIZE];
+		static const uint8_t KILL_EDGE = 250; // scheduled in place of a height or TillerCommand at the next edge of killWindows
+
 		Config const* config;
-		uint8_t commandList[COMMAND_LIST_SIZE];
+		KillWindows killWindows;
 		uint8_t state; // To save space, id is stored in bits 4-5, and dh in bits 6-7 (where the least significant bit is bit 0)
 		uint8_t targetHeight; // is either a height 0-Tiller::MAX_HEIGHT or a TillerCommand
 		mutable uint8_t actualHeight;
+		CachedPin raisePin;
+		CachedPin lowerPin;
 
 		inline uint8_t getOnVoltage(void) const { return getId() == 2 ? LOW : HIGH; } // TODO: change mapping if need be
 		inline uint8_t getOffVoltage(void) const { return !getOnVoltage(); }
@@ -54,6 +59,13 @@ class Tiller {
 		inline uint8_t getLowerPin(void) const { return getRaisePin() + 1; }
 		inline uint8_t getHeightSensorPin(void) const { return PIN_A9 + getId(); }
 
+		// Drives the GPIO pins to move the tiller towards targetHeight.
+		void applyTargetHeight(void);
+
+		// Replaces the KILL_EDGE command in the CommandQueue with one for the next edge of killWindows.
+		// returns: false if the queue is full.
+		bool scheduleKillEdge(void);
+
 		// disallow copy constructor since Tiller interacts with hardware, which makes duplicate instances a bad idea
 		void operator =(Tiller const&) {}
 		Tiller(Tiller const& other) { }
@@ -84,21 +96,33 @@ class Tiller {
 		// Returns the target height of the tiller (0-100 or a TillerCommand)
 		inline uint8_t getTargetHeight(void) const { return targetHeight; }
 
-		// Adds a command to the command list, to be executed after a delay. Commands are executed from the command list as their timers
-		// expire. The most recently inserted command overrides all commands that would otherwise trigger after it; so, for example, if
-		// the tiller is set to raise in 100ms, calling setHeight(TillerCommand::STOP, 0) will cancel that operation.
+		// Adds a command to the CommandQueue, to be executed after a delay. Commands are executed from the queue as they come
+		// due. The most recently inserted command overrides all commands that would otherwise trigger after it; so, for example,
+		// if the tiller is set to raise in 100ms, calling setHeight(TillerCommand::STOP, 0) will cancel that operation. This
+		// includes operations scheduled by killWeed().
 		// Arguments: command is either a height 0-100 or a TillerCommand. delay is a value in milliseconds.
-		// returns: true if there is room in the command list for the command; false if the command list is full.
-		bool setHeight(uint8_t command, uint32_t delay = 0);
+		// returns: true if there is room in the queue for the command; false if the queue is full.
+		bool setHeight(uint8_t command, uint32_t delay = 0) { return setHeight(command, delay, micros()); }
+		// same as setHeight(), but counts the delay (still in milliseconds) from the given micros() time.
+		bool setHeight(uint8_t command, uint32_t delay, uint32_t now);
 
 		// Signals to the tiller that a weed has been sighted up ahead and the tiller should begin lowering at some point in the future.
 		// The exact time is computed from the configuration settings. This command should be issued for every weed that is sighted,
 		// even if the tiller is already lowered. If enough time passes after sending this command, the tiller will raise back up.
-		void killWeed(void);
+		// Overlapping kills are merged, so the tiller stays down through a patch of weeds rather than raising between them.
+		// The timing is computed from now (a micros() time), to the microsecond.
+		// returns: true if the kill was scheduled; false if the command queue is full.
+		bool killWeed(uint32_t now);
+		inline bool killWeed(void) { return killWeed(micros()); }
 
-		// Checks for and performs any scheduled operations. This should be called every iteration of the main controller loop.
+		// Reads the height sensor and drives the GPIO pins towards the target height. This should be called every iteration of
+		// the main controller loop.
 		void update(void);
 
+		// Sets the target height to command (or follows the kill windows) and drives the GPIO pins accordingly. Called by the
+		// CommandQueue when a scheduled command comes due. This does no analog I/O, so it is cheap enough to call from an interrupt.
+		void execute(uint8_t command, uint32_t time);
+
 		// Writes the information pertaining to this tiller to the given string. Writes at most n characters, including the null
 		// terminator, and returns the number of characters in the serialized string, excluding the null terminator. If the string length
 		// exceeds n, returns the number of characters that would have been in the string, were there enough space.
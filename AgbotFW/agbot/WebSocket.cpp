@@ -0,0 +1,122 @@
+/*
+ * WebSocket.cpp
+ * Implements the WebSocket handshake and frame headers defined in WebSocket.h.
+ * See WebSocket.h for more info.
+ * Created: 10/16/2026 7:40:51 PM
+ *  Author: troy.honegger
+ */
+
+#include <string.h>
+
+#include "WebSocket.h"
+
+// appended to the Sec-WebSocket-Key before it's hashed, as RFC 6455 specifies
+static const char WEBSOCKET_GUID[] PROGMEM = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const uint8_t WEBSOCKET_GUID_LEN = 36;
+
+static const uint8_t SHA1_DIGEST_SIZE = 20;
+
+static const char BASE64_CHARS[] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static inline uint32_t rotateLeft(uint32_t x, uint8_t n) {
+	return (x << n) | (x >> (32 - n));
+}
+
+// Hashes one 64-byte block into the SHA-1 state. The message schedule is kept as a rolling window of 16 words, rather than
+// all 80, to save stack space.
+static void sha1Block(uint32_t* state, const uint8_t* block) {
+	uint32_t w[16];
+	for (uint8_t i = 0; i < 16; i++) {
+		w[i] = static_cast<uint32_t>(block[4 * i]) << 24 | static_cast<uint32_t>(block[4 * i + 1]) << 16
+				| static_cast<uint32_t>(block[4 * i + 2]) << 8 | block[4 * i + 3];
+	}
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	for (uint8_t i = 0; i < 80; i++) {
+		if (i >= 16) {
+			// w[i & 15] holds word i - 16; the others are words i - 3, i - 8, and i - 14
+			w[i & 15] = rotateLeft(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+		}
+		uint32_t f, k;
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		uint32_t temp = rotateLeft(a, 5) + f + e + k + w[i & 15];
+		e = d;
+		d = c;
+		c = rotateLeft(b, 30);
+		b = a;
+		a = temp;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+void webSocketAccept(const char* key, char* accept) {
+	// The key and the GUID are 60 bytes together, so SHA-1 pads them out to two blocks: the first holds the message and the
+	// 0x80 that ends it, and the second holds only the message's length in bits.
+	uint8_t block[64];
+	uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	memcpy(block, key, WEBSOCKET_KEY_SIZE);
+	memcpy_P(block + WEBSOCKET_KEY_SIZE, WEBSOCKET_GUID, WEBSOCKET_GUID_LEN);
+	block[60] = 0x80;
+	block[61] = block[62] = block[63] = 0;
+	sha1Block(state, block);
+	memset(block, 0, sizeof(block));
+	uint16_t bits = (WEBSOCKET_KEY_SIZE + WEBSOCKET_GUID_LEN) * 8;
+	block[62] = bits >> 8;
+	block[63] = bits;
+	sha1Block(state, block);
+
+	uint8_t digest[SHA1_DIGEST_SIZE];
+	for (uint8_t i = 0; i < 5; i++) {
+		digest[4 * i] = state[i] >> 24;
+		digest[4 * i + 1] = state[i] >> 16;
+		digest[4 * i + 2] = state[i] >> 8;
+		digest[4 * i + 3] = state[i];
+	}
+
+	// base64-encode the digest: 6 groups of 3 bytes, and 2 bytes left over, padded with '='
+	uint8_t j = 0;
+	for (uint8_t i = 0; i < SHA1_DIGEST_SIZE; i += 3) {
+		uint32_t group = static_cast<uint32_t>(digest[i]) << 16;
+		if (i + 1 < SHA1_DIGEST_SIZE) {
+			group |= static_cast<uint16_t>(digest[i + 1]) << 8;
+		}
+		if (i + 2 < SHA1_DIGEST_SIZE) {
+			group |= digest[i + 2];
+		}
+		accept[j++] = pgm_read_byte(BASE64_CHARS + ((group >> 18) & 0x3F));
+		accept[j++] = pgm_read_byte(BASE64_CHARS + ((group >> 12) & 0x3F));
+		accept[j++] = i + 1 < SHA1_DIGEST_SIZE ? pgm_read_byte(BASE64_CHARS + ((group >> 6) & 0x3F)) : '=';
+		accept[j++] = i + 2 < SHA1_DIGEST_SIZE ? pgm_read_byte(BASE64_CHARS + (group & 0x3F)) : '=';
+	}
+	accept[j] = '\0';
+}
+
+uint8_t webSocketFrameHeader(uint8_t* header, uint8_t opcode, bool fin, uint16_t length) {
+	header[0] = (fin ? 0x80 : 0) | opcode;
+	if (length < 126) {
+		header[1] = length;
+		return 2;
+	}
+	header[1] = 126; // the length follows, in 2 bytes
+	header[2] = length >> 8;
+	header[3] = length;
+	return 4;
+}
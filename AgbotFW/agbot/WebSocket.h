@@ -0,0 +1,51 @@
+/*
+ * WebSocket.h
+ * The pieces of the WebSocket protocol (RFC 6455) that HttpServer needs on top of HTTP: the handshake that upgrades a
+ * connection, and the headers of the frames sent over it.
+ *
+ * The server only supports what the API uses: text messages small enough to fit in one frame, plus the control frames
+ * (ping, pong, and close). Fragmented messages and binary messages are refused with a close frame.
+ *
+ * Usage example:
+ *	char accept[WEBSOCKET_ACCEPT_SIZE + 1];
+ *	webSocketAccept(key, accept); // key is the request's Sec-WebSocket-Key; send accept as the Sec-WebSocket-Accept
+ *	uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+ *	client.write(header, webSocketFrameHeader(header, WEBSOCKET_OPCODE_TEXT, true, length));
+ *	client.write(payload, length);
+ *
+ * Created: 10/16/2026 7:32:05 PM
+ *  Author: troy.honegger
+ */
+
+#pragma once
+
+#include "Common.h"
+
+#define WEBSOCKET_OPCODE_CONTINUATION		(0x0)
+#define WEBSOCKET_OPCODE_TEXT				(0x1)
+#define WEBSOCKET_OPCODE_BINARY				(0x2)
+#define WEBSOCKET_OPCODE_CLOSE				(0x8) // opcodes from here up are control frames
+#define WEBSOCKET_OPCODE_PING				(0x9)
+#define WEBSOCKET_OPCODE_PONG				(0xA)
+
+// Status codes sent in a close frame
+#define WEBSOCKET_CLOSE_NORMAL				(1000)
+#define WEBSOCKET_CLOSE_PROTOCOL_ERROR		(1002)
+#define WEBSOCKET_CLOSE_UNSUPPORTED_DATA	(1003)
+#define WEBSOCKET_CLOSE_MESSAGE_TOO_BIG		(1009)
+
+// Length of a Sec-WebSocket-Key (16 bytes, base64-encoded), and of the Sec-WebSocket-Accept computed from it (a SHA-1 hash,
+// base64-encoded)
+#define WEBSOCKET_KEY_SIZE					(24)
+#define WEBSOCKET_ACCEPT_SIZE				(28)
+
+// Longest header of a frame sent by the server. Its payload is never more than 65535 bytes, and isn't masked.
+#define WEBSOCKET_MAX_HEADER_SIZE			(4)
+
+// Computes the Sec-WebSocket-Accept for the given Sec-WebSocket-Key (WEBSOCKET_KEY_SIZE characters), and writes it to accept,
+// followed by a null terminator (WEBSOCKET_ACCEPT_SIZE + 1 characters in all)
+void webSocketAccept(const char* key, char* accept);
+
+// Writes the header of a frame sent by the server, with the given opcode and payload length, and returns its length. fin is
+// false for every frame of a fragmented message but the last.
+uint8_t webSocketFrameHeader(uint8_t* header, uint8_t opcode, bool fin, uint16_t length);
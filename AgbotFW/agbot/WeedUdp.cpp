@@ -0,0 +1,94 @@
+/*
+ * WeedUdp.cpp
+ * Implements the WeedUdpServer class defined in WeedUdp.h for receiving weed commands over UDP.
+ * See WeedUdp.h for more info.
+ * Created: 10/16/2026 6:58:30 PM
+ *  Author: troy.honegger
+ */
+
+#include <string.h>
+
+#include "Devices.h"
+#include "Log.h"
+#include "WeedUdp.h"
+
+static_assert(WeedUdpServer::MAX_EVENTS % 8 == 0, "MAX_EVENTS must be a multiple of 8");
+
+void WeedUdpServer::begin(void) {
+	udp.begin(port);
+}
+
+void WeedUdpServer::serve(void) {
+	for (uint8_t i = 0; i < MAX_DATAGRAMS_PER_SERVE; i++) {
+		int size = udp.parsePacket();
+		if (!size) {
+			return;
+		}
+		processDatagram(size);
+	}
+}
+
+void WeedUdpServer::processDatagram(int size) {
+	uint8_t header[HEADER_SIZE];
+	if (size < HEADER_SIZE || udp.read(header, HEADER_SIZE) != HEADER_SIZE) {
+		LOG_WARNING("Weed datagram too short (%d bytes) - dropped", size);
+		return;
+	}
+	uint8_t flags = header[1];
+	uint16_t sequence = static_cast<uint16_t>(header[3]) << 8 | header[2];
+	uint8_t count = header[4];
+	if (header[0] != VERSION || (flags & ~FLAG_ACK) || count > MAX_EVENTS || size != HEADER_SIZE + count * EVENT_SIZE) {
+		LOG_WARNING("Malformed weed datagram (version %hhu, %hhu events, %d bytes) - dropped", header[0], count, size);
+		return;
+	}
+
+	if (!hasLastDatagram || sequence != lastSequence || count != lastEventCount) {
+		hasLastDatagram = true;
+		lastSequence = sequence;
+		lastEventCount = count;
+		memset(lastAck, 0, sizeof(lastAck));
+
+		// every event is timed from the same instant, so weeds seen in the same camera frame are killed together
+		uint32_t now = micros();
+		for (uint8_t i = 0; i < count; i++) {
+			uint8_t event[EVENT_SIZE];
+			udp.read(event, EVENT_SIZE);
+			uint8_t tillerMask = event[0];
+			uint8_t sprayerMask = event[1];
+			uint32_t time = now + eventDelay(event);
+			if (tillerMask >> Tiller::COUNT) {
+				continue; // no such tiller - the event isn't acked
+			}
+			bool success = true;
+			for (uint8_t j = 0; j < Tiller::COUNT; j++) {
+				if (tillerMask & (1 << j)) {
+					success &= tillers[j].killWeed(time);
+				}
+			}
+			for (uint8_t j = 0; j < Sprayer::COUNT; j++) {
+				if (sprayerMask & (1 << j)) {
+					success &= sprayers[j].killWeed(time);
+				}
+			}
+			if (success) {
+				lastAck[i >> 3] |= 1 << (i & 7);
+			}
+		}
+	}
+	// otherwise, it's a retransmission of the last datagram, which has already been applied
+
+	if (flags & FLAG_ACK) {
+		sendAck();
+	}
+}
+
+void WeedUdpServer::sendAck(void) {
+	uint8_t ack[HEADER_SIZE + sizeof(lastAck)] = {
+		VERSION, FLAG_ACK, static_cast<uint8_t>(lastSequence), static_cast<uint8_t>(lastSequence >> 8), lastEventCount
+	};
+	uint8_t ackLength = (lastEventCount + 7) >> 3;
+	memcpy(ack + HEADER_SIZE, lastAck, ackLength);
+	udp.beginPacket(udp.remoteIP(), udp.remotePort());
+	udp.write(ack, HEADER_SIZE + ackLength);
+	udp.endPacket();
+}
@@ -0,0 +1,70 @@
+/*
+ * WeedUdp.h
+ * Receives weed commands over UDP, in a compact binary format, as a faster alternative to POST /api/weeds.
+ *
+ * Over HTTP, every weed costs a TCP handshake (unless the connection is kept alive), a request to parse, a hex string to
+ * decode, and a response. Over UDP, a command is a single datagram, and one datagram can carry every weed seen in a
+ * camera frame. Each event in it is dispatched to Tiller::killWeed() and Sprayer::killWeed(), just like POST /api/weeds.
+ *
+ * Every datagram has a sequence number. A datagram with the same sequence number as the one before it is taken to be a
+ * retransmission: it isn't applied again, but it is acknowledged again, if the sender asked for an ack. The ack says which
+ * of the datagram's events were scheduled. See api.md for the datagram formats.
+ *
+ * Usage example:
+ *	EthernetUDP weedSocket;
+ *	WeedUdpServer weedServer(weedSocket, WEED_UDP_PORT);
+ *	weedServer.begin(); // in setup(), after Ethernet.begin()
+ *	weedServer.serve(); // call this repeatedly to process incoming datagrams
+ *
+ * Created: 10/16/2026 6:41:12 PM
+ *  Author: troy.honegger
+ */
+
+#pragma once
+
+#include <Ethernet.h>
+
+#include "Common.h"
+
+// UDP port the weed commands are sent to
+#define WEED_UDP_PORT		(5000)
+
+class WeedUdpServer {
+	public:
+		static const uint8_t VERSION = 1; // first byte of every datagram
+		static const uint8_t FLAG_ACK = 0x01; // set in a command if the sender wants an ack, and in every ack
+		static const uint8_t HEADER_SIZE = 5; // version, flags, sequence number (2 bytes), and event count
+		static const uint8_t EVENT_SIZE = 4; // tiller bitmask, sprayer bitmask, and delay (2 bytes)
+		static const uint8_t MAX_EVENTS = 32;
+		// Most datagrams processed per call to serve(), so a flood of them can't hold up the main loop
+		static const uint8_t MAX_DATAGRAMS_PER_SERVE = 4;
+	private:
+		EthernetUDP& udp;
+		uint16_t port;
+
+		// the most recent datagram, and which of its events were scheduled, in case it's retransmitted
+		bool hasLastDatagram;
+		uint16_t lastSequence;
+		uint8_t lastEventCount;
+		uint8_t lastAck[MAX_EVENTS / 8];
+
+		// Reads and applies the datagram that was just received (size bytes), and acks it if the sender asked for an ack
+		void processDatagram(int size);
+		// Sends an ack for the most recent datagram to its sender
+		void sendAck(void);
+	public:
+		// Returns the delay of the given event (EVENT_SIZE bytes), converted from milliseconds to microseconds. The whole
+		// range of the 2-byte delay is unsigned, so it's widened to 32 bits before it's assembled.
+		static inline uint32_t eventDelay(const uint8_t* event) {
+			return (static_cast<uint32_t>(event[3]) << 8 | event[2]) * 1000UL;
+		}
+
+		WeedUdpServer(EthernetUDP& udp, uint16_t port) : udp(udp), port(port), hasLastDatagram(false), lastSequence(0),
+				lastEventCount(0), lastAck() {}
+
+		// Starts listening for datagrams. Ethernet must already be initialized.
+		void begin(void);
+
+		// Processes the datagrams that have come in since the last call. Call this repeatedly.
+		void serve(void);
+};
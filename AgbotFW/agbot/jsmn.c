@@ -1,5 +0,0 @@
-
-#define JSMN_PARENT_LINKS
-#include "jsmn.h"
-
-// intentionally left blank - jsmn.h contains necessary function definitions inline